@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "disk_emu.h"
+#include "block_cache.h"
+
+CacheEntry *cacheEntries = NULL; // every block currently held in memory
+int *cacheBuckets = NULL; // hash table from block number to the first entry of its chain
+int cacheCapacity = 0; // number of entries that fit in the memory budget
+int cacheBucketMask = 0;
+int cacheBlockSize = 0;
+int clockHand = 0; // next entry inspected by the CLOCK eviction sweep
+int loadingCount = 0; // entries whose prefetch read is still in flight
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER; // every public function holds it, so the cache can be shared by threads
+BlockCacheStats cacheStats;
+
+static int bucketOf(int blockNumber) {
+    return (unsigned int)blockNumber * 2654435761u & cacheBucketMask; // Knuth multiplicative hash
+}
+
+static int lookupEntry(int blockNumber) {
+    int entryIndex = cacheBuckets[bucketOf(blockNumber)];
+    while (entryIndex != CACHE_EMPTY_SLOT)
+    {
+        if (cacheEntries[entryIndex].blockNumber == blockNumber) {
+            return entryIndex;
+        }
+        entryIndex = cacheEntries[entryIndex].next;
+    }
+    return CACHE_EMPTY_SLOT;
+}
+
+static void unlinkEntry(int entryIndex) {
+    int *link = &cacheBuckets[bucketOf(cacheEntries[entryIndex].blockNumber)];
+    while (*link != entryIndex)
+    {
+        link = &cacheEntries[*link].next;
+    }
+    *link = cacheEntries[entryIndex].next;
+}
+
+/**
+ * @brief picks an entry to recycle with the CLOCK algorithm, writes it back to the disk if it is
+ *        dirty, and rebinds it to the given block number. The data of the returned entry is stale.
+ *        A dirty victim that cannot be written back stays cached and dirty, and the sweep moves on to
+ *        another one. Returns CACHE_EMPTY_SLOT if no entry could be recycled.
+ */
+static int claimEntry(int blockNumber) {
+    int failedWriteBacks = 0;
+    int entryIndex;
+    CacheEntry *victim;
+    while (1)
+    {
+        entryIndex = clockHand;
+        victim = &cacheEntries[entryIndex];
+        clockHand = (clockHand + 1) % cacheCapacity;
+        if (victim->blockNumber == CACHE_EMPTY_SLOT) {
+            break;
+        }
+        if (victim->loading) {
+            continue; // the disk is still writing into its data
+        }
+        if (victim->referenced) {
+            victim->referenced = 0; // second chance
+            continue;
+        }
+        if (victim->dirty && write_blocks(victim->blockNumber, 1, victim->data) < 0) {
+            if (++failedWriteBacks == cacheCapacity) {
+                printf("ERROR in block cache: no dirty block could be written back to make room.\n");
+                return CACHE_EMPTY_SLOT;
+            }
+            continue; // the block keeps its only up-to-date copy in memory
+        }
+        ++cacheStats.evictions;
+        if (victim->dirty) {
+            ++cacheStats.dirtyEvictions;
+        }
+        unlinkEntry(entryIndex);
+        break;
+    }
+
+    int bucket = bucketOf(blockNumber);
+    victim->blockNumber = blockNumber;
+    victim->dirty = 0;
+    victim->referenced = 1;
+    victim->next = cacheBuckets[bucket];
+    cacheBuckets[bucket] = entryIndex;
+    return entryIndex;
+}
+
+/**
+ * @brief marks the entries of a finished prefetch request as loaded. The entries of a failed request are dropped,
+ *        so the next read of their blocks goes to the disk and reports the error.
+ */
+static void finishLoad(int firstEntry, int result) {
+    int entryCount = cacheEntries[firstEntry].loadLength;
+    for (int entryIndex = firstEntry; entryIndex < firstEntry + entryCount; entryIndex++)
+    {
+        cacheEntries[entryIndex].loading = 0;
+        if (result < 0) {
+            unlinkEntry(entryIndex);
+            cacheEntries[entryIndex].blockNumber = CACHE_EMPTY_SLOT;
+        }
+    }
+    loadingCount -= entryCount;
+}
+
+/**
+ * @brief collects the prefetch requests that have finished, waiting until at least minimum of them have.
+ */
+static void collectLoads(int minimum) {
+    struct disk_completion completions[CACHE_COMPLETION_BATCH];
+    int count;
+    do
+    {
+        count = poll_completions(completions, CACHE_COMPLETION_BATCH, minimum);
+        for (int completionIndex = 0; completionIndex < count; completionIndex++)
+        {
+            finishLoad((CacheEntry *)completions[completionIndex].tag - cacheEntries, completions[completionIndex].result);
+        }
+        minimum -= count;
+    } while (count == CACHE_COMPLETION_BATCH);
+}
+
+/**
+ * @brief looks a block up like lookupEntry, waiting first for its prefetch read if it is still in flight.
+ */
+static int findEntry(int blockNumber) {
+    int entryIndex = lookupEntry(blockNumber);
+    while (entryIndex != CACHE_EMPTY_SLOT && cacheEntries[entryIndex].loading)
+    {
+        collectLoads(1);
+        entryIndex = lookupEntry(blockNumber); // a failed read dropped the entry
+    }
+    return entryIndex;
+}
+
+/**
+ * @brief starts reading the blocks of entryCount entries, consecutive in the arena and on the disk, without waiting.
+ */
+static int startLoad(int firstEntry, int entryCount) {
+    CacheEntry *first = &cacheEntries[firstEntry];
+    first->loadLength = entryCount;
+    if (submit_read_blocks(first->blockNumber, entryCount, first->data, first) < 0) {
+        finishLoad(firstEntry, -1);
+        return -1;
+    }
+    return 0;
+}
+
+static int compareBlockNumbers(const void *a, const void *b) {
+    return cacheEntries[*(const int *)a].blockNumber - cacheEntries[*(const int *)b].blockNumber;
+}
+
+static int initCache(int block_size, int budget_bytes) {
+    cacheBlockSize = block_size;
+    cacheCapacity = budget_bytes / block_size;
+    if (cacheCapacity < BLOCK_CACHE_MIN_ENTRIES) {
+        cacheCapacity = BLOCK_CACHE_MIN_ENTRIES;
+    }
+    int bucketCount = 1;
+    while (bucketCount < 2 * cacheCapacity)
+    {
+        bucketCount <<= 1;
+    }
+    cacheBucketMask = bucketCount - 1;
+    clockHand = 0;
+    loadingCount = 0;
+
+    cacheEntries = malloc(cacheCapacity * sizeof(CacheEntry));
+    cacheBuckets = malloc(bucketCount * sizeof(int));
+    char *arena = malloc((size_t)cacheCapacity * block_size);
+    if (cacheEntries == NULL || cacheBuckets == NULL || arena == NULL) {
+        free(cacheEntries);
+        free(cacheBuckets);
+        free(arena);
+        cacheEntries = NULL;
+        cacheBuckets = NULL;
+        printf("ERROR in init_block_cache: could not allocate %d cache blocks.\n", cacheCapacity);
+        return -1;
+    }
+    for (int bucket = 0; bucket < bucketCount; bucket++)
+    {
+        cacheBuckets[bucket] = CACHE_EMPTY_SLOT;
+    }
+    for (int entryIndex = 0; entryIndex < cacheCapacity; entryIndex++)
+    {
+        cacheEntries[entryIndex].blockNumber = CACHE_EMPTY_SLOT;
+        cacheEntries[entryIndex].next = CACHE_EMPTY_SLOT;
+        cacheEntries[entryIndex].dirty = 0;
+        cacheEntries[entryIndex].referenced = 0;
+        cacheEntries[entryIndex].loading = 0;
+        cacheEntries[entryIndex].loadLength = 0;
+        cacheEntries[entryIndex].data = arena + (size_t)entryIndex * block_size;
+    }
+    return 0;
+}
+
+static int readBlocks(int start_address, int nblocks, void *buffer) {
+    if (cacheEntries == NULL) {
+        return read_blocks(start_address, nblocks, buffer);
+    }
+
+    int blockIndex = 0;
+    while (blockIndex < nblocks)
+    {
+        char *destination = (char *)buffer + (size_t)blockIndex * cacheBlockSize;
+        int entryIndex = findEntry(start_address + blockIndex);
+        if (entryIndex != CACHE_EMPTY_SLOT) {
+            memcpy(destination, cacheEntries[entryIndex].data, cacheBlockSize);
+            cacheEntries[entryIndex].referenced = 1;
+            ++cacheStats.hits;
+            ++blockIndex;
+            continue;
+        }
+
+        // Fetch the whole run of missing blocks with one disk request, then keep a copy of each
+        int runLength = 1;
+        while (blockIndex + runLength < nblocks && lookupEntry(start_address + blockIndex + runLength) == CACHE_EMPTY_SLOT)
+        {
+            ++runLength;
+        }
+        cacheStats.misses += runLength;
+        if (read_blocks(start_address + blockIndex, runLength, destination) < 0) {
+            return -1;
+        }
+        for (int runIndex = 0; runIndex < runLength; runIndex++)
+        {
+            entryIndex = claimEntry(start_address + blockIndex + runIndex);
+            if (entryIndex != CACHE_EMPTY_SLOT) { // the caller has its copy either way
+                memcpy(cacheEntries[entryIndex].data, destination + (size_t)runIndex * cacheBlockSize, cacheBlockSize);
+            }
+        }
+        blockIndex += runLength;
+    }
+    return nblocks;
+}
+
+static int writeBlocks(int start_address, int nblocks, void *buffer) {
+    if (cacheEntries == NULL) {
+        return write_blocks(start_address, nblocks, buffer);
+    }
+
+    for (int blockIndex = 0; blockIndex < nblocks; blockIndex++)
+    {
+        int entryIndex = findEntry(start_address + blockIndex);
+        if (entryIndex == CACHE_EMPTY_SLOT) {
+            entryIndex = claimEntry(start_address + blockIndex); // whole block is overwritten, no need to read it first
+        }
+        if (entryIndex == CACHE_EMPTY_SLOT) {
+            return -1;
+        }
+        memcpy(cacheEntries[entryIndex].data, (char *)buffer + (size_t)blockIndex * cacheBlockSize, cacheBlockSize);
+        cacheEntries[entryIndex].dirty = 1;
+        cacheEntries[entryIndex].referenced = 1;
+    }
+    return nblocks;
+}
+
+static int readBlocksV(int *block_addresses, int nblocks, void **buffers) {
+    if (cacheEntries == NULL) {
+        return read_blocks_v(block_addresses, nblocks, buffers);
+    }
+
+    int missCount = 0;
+    int *missAddresses = malloc(nblocks * sizeof(int));
+    void **missBuffers = malloc(nblocks * sizeof(void *));
+    for (int blockIndex = 0; blockIndex < nblocks; blockIndex++)
+    {
+        int entryIndex = findEntry(block_addresses[blockIndex]);
+        if (entryIndex != CACHE_EMPTY_SLOT) {
+            memcpy(buffers[blockIndex], cacheEntries[entryIndex].data, cacheBlockSize);
+            cacheEntries[entryIndex].referenced = 1;
+            ++cacheStats.hits;
+        } else {
+            missAddresses[missCount] = block_addresses[blockIndex];
+            missBuffers[missCount] = buffers[blockIndex];
+            ++missCount;
+        }
+    }
+
+    // Every missing block is fetched with a single vectored request, straight into the caller's buffers
+    cacheStats.misses += missCount;
+    int result = nblocks;
+    if (missCount > 0 && read_blocks_v(missAddresses, missCount, missBuffers) < 0) {
+        result = -1;
+    }
+    for (int missIndex = 0; result >= 0 && missIndex < missCount; missIndex++)
+    {
+        if (lookupEntry(missAddresses[missIndex]) == CACHE_EMPTY_SLOT) { // the same block may be listed twice
+            int entryIndex = claimEntry(missAddresses[missIndex]);
+            if (entryIndex != CACHE_EMPTY_SLOT) {
+                memcpy(cacheEntries[entryIndex].data, missBuffers[missIndex], cacheBlockSize);
+            }
+        }
+    }
+    free(missAddresses);
+    free(missBuffers);
+    return result;
+}
+
+static int writeBlocksV(int *block_addresses, int nblocks, void **buffers) {
+    if (cacheEntries == NULL) {
+        return write_blocks_v(block_addresses, nblocks, buffers);
+    }
+
+    for (int blockIndex = 0; blockIndex < nblocks; blockIndex++)
+    {
+        int entryIndex = findEntry(block_addresses[blockIndex]);
+        if (entryIndex == CACHE_EMPTY_SLOT) {
+            entryIndex = claimEntry(block_addresses[blockIndex]);
+        }
+        if (entryIndex == CACHE_EMPTY_SLOT) {
+            return -1;
+        }
+        memcpy(cacheEntries[entryIndex].data, buffers[blockIndex], cacheBlockSize);
+        cacheEntries[entryIndex].dirty = 1;
+        cacheEntries[entryIndex].referenced = 1;
+    }
+    return nblocks;
+}
+
+static int prefetchBlocksV(int *block_addresses, int nblocks) {
+    if (cacheEntries == NULL) {
+        return 0;
+    }
+    if (loadingCount > 0) {
+        collectLoads(0); // entries whose read is done can be recycled again
+    }
+    // The blocks prefetched first must not be recycled for the last ones, and the clock must find entries to recycle
+    if (nblocks > cacheCapacity / 2 - loadingCount) {
+        nblocks = cacheCapacity / 2 - loadingCount;
+    }
+
+    // The missing blocks are read straight into their cache entries, one request per run of entries that follow each
+    // other both in the arena and on the disk
+    int missCount = 0;
+    int result = 0;
+    int runStart = CACHE_EMPTY_SLOT;
+    int runLength = 0;
+    for (int blockIndex = 0; blockIndex < nblocks; blockIndex++)
+    {
+        if (lookupEntry(block_addresses[blockIndex]) != CACHE_EMPTY_SLOT) {
+            continue;
+        }
+        int entryIndex = claimEntry(block_addresses[blockIndex]);
+        if (entryIndex == CACHE_EMPTY_SLOT) {
+            break; // prefetch what was claimed so far
+        }
+        cacheEntries[entryIndex].loading = 1;
+        ++loadingCount;
+        ++missCount;
+        if (runLength > 0 && entryIndex == runStart + runLength &&
+            block_addresses[blockIndex] == cacheEntries[runStart].blockNumber + runLength) {
+            ++runLength;
+            continue;
+        }
+        if (runLength > 0 && startLoad(runStart, runLength) < 0) {
+            result = -1;
+        }
+        runStart = entryIndex;
+        runLength = 1;
+    }
+    if (runLength > 0 && startLoad(runStart, runLength) < 0) {
+        result = -1;
+    }
+    cacheStats.prefetched += missCount;
+    return result < 0 ? result : missCount;
+}
+
+static int dirtyBlocksV(int *block_addresses, int nblocks, char *dirty) {
+    int dirtyCount = 0;
+    for (int blockIndex = 0; blockIndex < nblocks; blockIndex++)
+    {
+        int entryIndex = cacheEntries == NULL ? CACHE_EMPTY_SLOT : lookupEntry(block_addresses[blockIndex]);
+        dirty[blockIndex] = entryIndex != CACHE_EMPTY_SLOT && cacheEntries[entryIndex].dirty; // a block still loading is clean
+        dirtyCount += dirty[blockIndex];
+    }
+    return dirtyCount;
+}
+
+static int syncCache() {
+    if (cacheEntries == NULL) {
+        return 0;
+    }
+
+    int dirtyCount = 0;
+    int *dirtyEntries = malloc(cacheCapacity * sizeof(int));
+    for (int entryIndex = 0; entryIndex < cacheCapacity; entryIndex++)
+    {
+        if (cacheEntries[entryIndex].blockNumber != CACHE_EMPTY_SLOT && cacheEntries[entryIndex].dirty) {
+            dirtyEntries[dirtyCount++] = entryIndex;
+        }
+    }
+    qsort(dirtyEntries, dirtyCount, sizeof(int), compareBlockNumbers);
+
+    // Blocks are handed over sorted, so each run of consecutive dirty blocks costs a single pwritev
+    int *dirtyAddresses = malloc(cacheCapacity * sizeof(int));
+    void **dirtyBuffers = malloc(cacheCapacity * sizeof(void *));
+    for (int dirtyIndex = 0; dirtyIndex < dirtyCount; dirtyIndex++)
+    {
+        CacheEntry *entry = &cacheEntries[dirtyEntries[dirtyIndex]];
+        dirtyAddresses[dirtyIndex] = entry->blockNumber;
+        dirtyBuffers[dirtyIndex] = entry->data;
+    }
+    int written = dirtyCount > 0 ? write_blocks_v(dirtyAddresses, dirtyCount, dirtyBuffers) : 0;
+    for (int dirtyIndex = 0; written >= 0 && dirtyIndex < dirtyCount; dirtyIndex++)
+    {
+        cacheEntries[dirtyEntries[dirtyIndex]].dirty = 0; // a failed write leaves every block dirty for the next sync
+    }
+    free(dirtyAddresses);
+    free(dirtyBuffers);
+    free(dirtyEntries);
+    return written;
+}
+
+static int closeCache() {
+    while (loadingCount > 0)
+    {
+        collectLoads(1); // no read may land in the arena once it is freed
+    }
+    int written = syncCache();
+    if (cacheEntries != NULL) {
+        free(cacheEntries[0].data); // arena holding the data of every entry
+        free(cacheEntries);
+        free(cacheBuckets);
+    }
+    cacheEntries = NULL;
+    cacheBuckets = NULL;
+    cacheCapacity = 0;
+    return written;
+}
+
+int init_block_cache(int block_size, int budget_bytes) {
+    pthread_mutex_lock(&cacheLock);
+    int result = initCache(block_size, budget_bytes);
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+int cached_read_blocks(int start_address, int nblocks, void *buffer) {
+    pthread_mutex_lock(&cacheLock);
+    int result = readBlocks(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+int cached_write_blocks(int start_address, int nblocks, void *buffer) {
+    pthread_mutex_lock(&cacheLock);
+    int result = writeBlocks(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+int cached_read_blocks_v(int *block_addresses, int nblocks, void **buffers) {
+    pthread_mutex_lock(&cacheLock);
+    int result = readBlocksV(block_addresses, nblocks, buffers);
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+int cached_write_blocks_v(int *block_addresses, int nblocks, void **buffers) {
+    pthread_mutex_lock(&cacheLock);
+    int result = writeBlocksV(block_addresses, nblocks, buffers);
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+int cached_prefetch_blocks_v(int *block_addresses, int nblocks) {
+    pthread_mutex_lock(&cacheLock);
+    int result = prefetchBlocksV(block_addresses, nblocks);
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+int cached_dirty_blocks_v(int *block_addresses, int nblocks, char *dirty) {
+    pthread_mutex_lock(&cacheLock);
+    int result = dirtyBlocksV(block_addresses, nblocks, dirty);
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+void get_block_cache_stats(BlockCacheStats *stats) {
+    pthread_mutex_lock(&cacheLock);
+    *stats = cacheStats;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+void reset_block_cache_stats() {
+    pthread_mutex_lock(&cacheLock);
+    memset(&cacheStats, 0, sizeof(cacheStats));
+    pthread_mutex_unlock(&cacheLock);
+}
+
+int sync_block_cache() {
+    pthread_mutex_lock(&cacheLock);
+    int result = syncCache();
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+int close_block_cache() {
+    pthread_mutex_lock(&cacheLock);
+    int result = closeCache();
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
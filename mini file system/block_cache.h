@@ -0,0 +1,155 @@
+/**
+ * @author Zhanna Klimanova (zhanna.klimanova@mail.mcgill.ca)
+ * @brief write-back block buffer cache that sits between the Simple File System (SFS)
+ *        and the disk emulator. Every function takes the cache lock, so several threads may share it.
+ * @version disko
+ * @date 2022-12-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#define BLOCK_CACHE_MIN_ENTRIES 8 // the cache always holds at least this many blocks, whatever the budget
+#define CACHE_EMPTY_SLOT -1
+#define CACHE_COMPLETION_BATCH 16 // finished prefetch reads collected per poll_completions call
+
+/**
+ * @brief one cached disk block. Entries are recycled with the CLOCK (second chance) algorithm:
+ *        the referenced bit is set on every hit and cleared as the clock hand sweeps past.
+ *
+ */
+typedef struct CacheEntry_t {
+    int blockNumber; // disk block held by this entry (CACHE_EMPTY_SLOT when unused)
+    int next; // next entry in the same hash bucket chain
+    char dirty; // block was modified in memory and not yet written back to the disk
+    char referenced; // CLOCK second chance bit
+    char loading; // a prefetch is reading the block into data, which cannot be used or recycled until it is done
+    int loadLength; // on the first entry of a prefetch request, the entries it reads (they follow each other in the arena)
+    char *data;
+} CacheEntry;
+
+/**
+ * @brief counters kept by the cache since it was created or the counters were reset. Hits and misses count
+ *        the blocks requested by the read functions; prefetched blocks are counted apart.
+ *
+ */
+typedef struct BlockCacheStats_t {
+    long long hits;
+    long long misses;
+    long long prefetched; // blocks fetched from the disk by cached_prefetch_blocks_v
+    long long evictions;
+    long long dirtyEvictions; // evicted blocks that had to be written back first
+} BlockCacheStats;
+
+/**
+ * @brief creates the block cache for a disk with the given block size. The number of cached
+ *        blocks is derived from the memory budget (in bytes). Any previous cache must be closed first.
+ *
+ * @param block_size
+ * @param budget_bytes
+ * @return int 0 on success, -1 if the cache could not be allocated
+ */
+int init_block_cache(int block_size, int budget_bytes);
+
+/**
+ * @brief reads a series of blocks, serving the cached ones from memory and fetching the rest
+ *        from the disk emulator.
+ *
+ * @param start_address
+ * @param nblocks
+ * @param buffer
+ * @return int number of blocks read, -1 on error
+ */
+int cached_read_blocks(int start_address, int nblocks, void *buffer);
+
+/**
+ * @brief writes a series of blocks into the cache and marks them dirty. The blocks only reach
+ *        the disk emulator when they are evicted or when the cache is synced.
+ *
+ * @param start_address
+ * @param nblocks
+ * @param buffer
+ * @return int number of blocks written, -1 if no dirty block could be written back to make room
+ */
+int cached_write_blocks(int start_address, int nblocks, void *buffer);
+
+/**
+ * @brief reads a list of blocks that need not be contiguous on the disk, one buffer per block.
+ *        Cached blocks are copied from memory and all the others are fetched with a single
+ *        read_blocks_v request.
+ *
+ * @param block_addresses
+ * @param nblocks
+ * @param buffers
+ * @return int number of blocks read, -1 on error
+ */
+int cached_read_blocks_v(int *block_addresses, int nblocks, void **buffers);
+
+/**
+ * @brief writes a list of blocks that need not be contiguous on the disk, one buffer per block,
+ *        into the cache and marks them dirty.
+ *
+ * @param block_addresses
+ * @param nblocks
+ * @param buffers
+ * @return int number of blocks written, -1 if no dirty block could be written back to make room
+ */
+int cached_write_blocks_v(int *block_addresses, int nblocks, void **buffers);
+
+/**
+ * @brief starts loading a list of blocks into the cache ahead of their use, and returns without
+ *        waiting for them. Blocks already cached are skipped. Every run of blocks consecutive both on
+ *        the disk and in the cache becomes one submit_read_blocks request, so all of them are in flight
+ *        at once on the io_uring backend. A later read or write of a block still loading waits for it,
+ *        and a block whose read fails is dropped from the cache. At most half the cache is loading at a time.
+ *
+ * @param block_addresses
+ * @param nblocks
+ * @return int number of blocks whose read was started, -1 if a request could not be started
+ */
+int cached_prefetch_blocks_v(int *block_addresses, int nblocks);
+
+/**
+ * @brief tells, for each block of a list, whether the cache holds a newer copy of it than the disk, so a caller
+ *        reading the disk by itself knows which blocks it must read through the cache instead.
+ *
+ * @param block_addresses
+ * @param nblocks
+ * @param dirty set to 1 for each block dirty in the cache, 0 for the others
+ * @return int number of dirty blocks
+ */
+int cached_dirty_blocks_v(int *block_addresses, int nblocks, char *dirty);
+
+/**
+ * @brief copies the cache counters.
+ *
+ * @param stats
+ */
+void get_block_cache_stats(BlockCacheStats *stats);
+
+/**
+ * @brief sets every cache counter back to zero.
+ *
+ */
+void reset_block_cache_stats();
+
+/**
+ * @brief writes every dirty block back to the disk emulator with one write_blocks_v request, so
+ *        each run of consecutive dirty blocks costs a single vectored write. The blocks stay dirty if
+ *        the request fails.
+ *
+ * @return int number of blocks written back, -1 on error
+ */
+int sync_block_cache();
+
+/**
+ * @brief flushes the dirty blocks and releases the memory of the cache.
+ *
+ * @return int
+ */
+int close_block_cache();
+
+#endif
@@ -1,143 +1,1795 @@
-#include <stdio.h>
-#include <stdlib.h> 
-#include <string.h>
-#include <unistd.h>
-#include <time.h>
-#include "disk_emu.h"
-
-
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
-
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
-{
-    if(NULL != fp)
-    {
-        fclose(fp);
-    }
-    return 0;
-}
-
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
-{
-    int i, j;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
-    }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
-    return 0;
-}
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
-{
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not open %s\n\n", filename);
-        return -1;
-    }
-    return 0;
-}
-
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, s;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error %d\n", start_address);
-        return -1;
-    }
-
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-    }
-
-    free(blockRead);
-    return s;
-}
-
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, s;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error\n");
-        return -1;
-    }
-
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
-    return s;
-}
+#include <stdio.h>
+#include <stdlib.h> 
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "disk_emu.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1 /*crc32 instruction, used when the processor has SSE4.2*/
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE /*pulled in from linux/fs.h, the emulator has its own*/
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#define MAX_IOV 64 /*Largest number of blocks moved by one preadv/pwritev call*/
+#define URING_ENTRIES 64 /*Requests in flight at once on the io_uring backend*/
+#define CRC32C_POLYNOMIAL 0x82F63B78 /*Castagnoli polynomial, bit-reflected*/
+#define SCRUB_BATCH 64 /*Blocks checked by the scrubber at a time, while writes wait*/
+#define CHECKSUM_EPOCH_SYNCS 256 /*sync_disk calls between two writes of the checksum area to the disk file*/
+#define INTENT_RANGE_BLOCKS 4096 /*disk blocks covered by one intent bit*/
+
+/*One request handed to the kernel, or completed at once when io_uring is not used*/
+struct disk_request
+{
+    int start_address;
+    int nblocks;
+    int writing;
+    int async; /*completion is reported by poll_completions*/
+    int done;
+    int result;
+    void *tag;
+    int iovcnt;
+    struct iovec iov[MAX_IOV];
+    struct disk_request *next; /*next completed async request*/
+};
+
+FILE* fp = NULL;
+int disk_fd = -1; /*Raw descriptor of the disk file, used for pread/pwrite*/
+char* mapping = NULL;
+int BLOCK_SIZE, MAX_BLOCK;
+int backend = DISK_BACKEND_FILE;
+struct disk_model model; /*all zero: requests cost nothing*/
+int model_configured = 0; /*set_disk_model or set_disk_profile was called, the environment is not read*/
+int head_position = 0; /*block after the last one transferred, where a request costs no seek*/
+struct disk_times times;
+pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER; /*model, head position and times*/
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER; /*io_uring rings and the completed request list*/
+struct disk_request *completed_head = NULL; /*async requests completed and not yet polled*/
+struct disk_request *completed_tail = NULL;
+int completed_count = 0;
+int async_pending = 0; /*async requests submitted and not yet completed*/
+size_t mapped_bytes = 0; /*disk blocks*/
+int checksums_enabled = 0; /*set_disk_checksums; takes effect the next time a disk is initialized*/
+int checksum_area_blocks = 0; /*blocks at the start of the checksum file holding one checksum per disk block*/
+int intent_area_blocks = 0; /*blocks after the checksum area holding one intent bit per INTENT_RANGE_BLOCKS blocks*/
+char *checksum_mapping = NULL; /*the whole checksum file, kept apart so the disk file is laid out as without checksums*/
+size_t checksum_mapping_bytes = 0;
+int checksum_fd = -1; /*the checksum file, open while it is mapped*/
+unsigned char *verified = NULL; /*a bit set: the block matched its checksum when it was last read or written in this run*/
+int verified_blocks = 0;
+struct stat verified_files[2]; /*the disk and checksum files when last closed: remounted unchanged, they keep the bits*/
+uint32_t *checksums = NULL; /*CRC32C of every block, in the checksum mapping*/
+unsigned char *intents = NULL; /*a bit set: the checksum area may not match the blocks of the range on the disk*/
+pthread_mutex_t intent_lock = PTHREAD_MUTEX_INITIALIZER; /*intent bits and epoch_syncs*/
+int epoch_syncs = 0; /*sync_disk calls since the checksum area was last written*/
+uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *data, size_t length) = NULL;
+uint32_t crc32c_table[8][256];
+uint32_t crc32c_shift_table[4][256]; /*CRC32C of 32 bits followed by crc32c_shift_length 0 bytes*/
+size_t crc32c_shift_length = 0;
+pthread_rwlock_t scrub_lock = PTHREAD_RWLOCK_INITIALIZER; /*shared by writes, held alone by the scrubber while it checks a batch and by a checksum flush*/
+pthread_mutex_t scrub_mutex = PTHREAD_MUTEX_INITIALIZER; /*scrubber thread state below*/
+pthread_cond_t scrub_wakeup;
+pthread_t scrub_thread;
+int scrub_running = 0;
+int scrub_stopping = 0;
+int scrub_rate = 0; /*blocks checked per second*/
+
+static int transfer_range(int start_address, int nblocks, char *buffer, int writing);
+
+#ifdef HAVE_IO_URING
+int ring_fd = -1;
+void *sq_ring = NULL;
+void *cq_ring = NULL;
+size_t sq_ring_size, cq_ring_size;
+struct io_uring_sqe *sqes = NULL;
+unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+unsigned *cq_head, *cq_tail, *cq_mask;
+struct io_uring_cqe *cqes;
+unsigned sq_entries;
+int ring_inflight = 0; /*requests queued in the rings and not yet reaped*/
+int ring_unsubmitted = 0; /*entries in the submission ring not yet passed to io_uring_enter*/
+
+static void uring_reap(int wait);
+
+/*----------------------------------------------------------*/
+/*Creates the submission and completion rings with raw      */
+/*system calls, so liburing is not needed.                  */
+/*----------------------------------------------------------*/
+static int uring_setup()
+{
+    struct io_uring_params params;
+    int single_mmap;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd < 0)
+    {
+        return -1;
+    }
+    single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    sq_entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (single_mmap)
+    {
+        sq_ring_size = cq_ring_size > sq_ring_size ? cq_ring_size : sq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring :
+              mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+        }
+        if (cq_ring != MAP_FAILED && !single_mmap)
+        {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED)
+        {
+            munmap(sq_ring, sq_ring_size);
+        }
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    sq_head = (unsigned *)((char *)sq_ring + params.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+    ring_inflight = 0;
+    ring_unsubmitted = 0;
+    return 0;
+}
+
+static void uring_teardown()
+{
+    munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    if (cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+    ring_fd = -1;
+}
+#endif
+
+/*----------------------------------------------------------*/
+/*Device models for the profiles. Transfer costs are given  */
+/*per KiB so they hold for every block size.                */
+/*----------------------------------------------------------*/
+static int profile_model(int profile, struct disk_model *profile_model)
+{
+    memset(profile_model, 0, sizeof(*profile_model));
+    switch (profile)
+    {
+    case DISK_PROFILE_NONE:
+        return 0;
+    case DISK_PROFILE_HDD: /*7200 rpm disk, about 150 MB/s once the head is in place*/
+        profile_model->seek_us = 4000;
+        profile_model->seek_us_per_mib = 2;
+        profile_model->max_seek_us = 12000;
+        profile_model->read_us_per_kib = 6.5;
+        profile_model->write_us_per_kib = 6.5;
+        return 0;
+    case DISK_PROFILE_SSD: /*NVMe flash, about 2 GB/s reads and 1 GB/s writes*/
+        profile_model->seek_us = 80;
+        profile_model->read_us_per_kib = 0.5;
+        profile_model->write_us_per_kib = 1.0;
+        return 0;
+    }
+    printf("Unknown disk profile %d\n", profile);
+    return -1;
+}
+
+/*----------------------------------------------------------*/
+/*Sets the cost of every request from now on                */
+/*----------------------------------------------------------*/
+int set_disk_model(const struct disk_model *disk_model)
+{
+    if (disk_model->seek_us < 0 || disk_model->seek_us_per_mib < 0 || disk_model->max_seek_us < 0 ||
+        disk_model->read_us_per_kib < 0 || disk_model->write_us_per_kib < 0)
+    {
+        printf("Invalid disk model\n");
+        return -1;
+    }
+    pthread_mutex_lock(&model_lock);
+    model = *disk_model;
+    model_configured = 1;
+    pthread_mutex_unlock(&model_lock);
+    return 0;
+}
+
+int set_disk_profile(int profile)
+{
+    struct disk_model disk_model;
+
+    if (profile_model(profile, &disk_model) < 0)
+    {
+        return -1;
+    }
+    return set_disk_model(&disk_model);
+}
+
+/*----------------------------------------------------------*/
+/*Reads DISK_EMU_PROFILE (none, hdd or ssd), then the       */
+/*DISK_EMU_* variables that override single costs. Only     */
+/*used while no model was set by a call                     */
+/*----------------------------------------------------------*/
+static void load_model_from_env()
+{
+    struct disk_model disk_model;
+    const char *value;
+
+    if (model_configured)
+    {
+        return;
+    }
+    value = getenv("DISK_EMU_PROFILE");
+    profile_model(NULL == value ? DISK_PROFILE_NONE :
+                  strcmp(value, "hdd") == 0 ? DISK_PROFILE_HDD :
+                  strcmp(value, "ssd") == 0 ? DISK_PROFILE_SSD : DISK_PROFILE_NONE, &disk_model);
+    if (NULL != (value = getenv("DISK_EMU_SEEK_US")))
+    {
+        disk_model.seek_us = atof(value);
+    }
+    if (NULL != (value = getenv("DISK_EMU_SEEK_US_PER_MIB")))
+    {
+        disk_model.seek_us_per_mib = atof(value);
+    }
+    if (NULL != (value = getenv("DISK_EMU_MAX_SEEK_US")))
+    {
+        disk_model.max_seek_us = atof(value);
+    }
+    if (NULL != (value = getenv("DISK_EMU_READ_US_PER_KIB")))
+    {
+        disk_model.read_us_per_kib = atof(value);
+    }
+    if (NULL != (value = getenv("DISK_EMU_WRITE_US_PER_KIB")))
+    {
+        disk_model.write_us_per_kib = atof(value);
+    }
+    if (NULL != (value = getenv("DISK_EMU_SLEEP")))
+    {
+        disk_model.sleep = atoi(value);
+    }
+    pthread_mutex_lock(&model_lock);
+    model = disk_model;
+    pthread_mutex_unlock(&model_lock);
+}
+
+static double now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/*----------------------------------------------------------*/
+/*Charges one request for a run of consecutive blocks: a    */
+/*seek unless it starts where the last one ended, then the  */
+/*transfer. Requests kept in flight together are charged    */
+/*one after the other, like a single head would serve them  */
+/*----------------------------------------------------------*/
+static void charge_request(int start_address, int nblocks, int writing)
+{
+    double cost = 0;
+    double distance;
+    int pause;
+
+    pthread_mutex_lock(&model_lock);
+    if (start_address != head_position)
+    {
+        distance = (double)abs(start_address - head_position) * BLOCK_SIZE / (1024 * 1024);
+        cost = model.seek_us + model.seek_us_per_mib * distance;
+        if (model.max_seek_us > 0 && cost > model.max_seek_us)
+        {
+            cost = model.max_seek_us;
+        }
+        times.seeks++;
+    }
+    cost += (double)nblocks * BLOCK_SIZE / 1024 * (writing ? model.write_us_per_kib : model.read_us_per_kib);
+    head_position = start_address + nblocks;
+    if (writing)
+    {
+        times.write_requests++;
+        times.blocks_written += nblocks;
+    }
+    else
+    {
+        times.read_requests++;
+        times.blocks_read += nblocks;
+    }
+    times.simulated_us += cost;
+    pause = model.sleep;
+    pthread_mutex_unlock(&model_lock);
+
+    /*Pause until the latency duration is elapsed*/
+    if (pause && cost >= 1)
+    {
+        usleep((useconds_t)cost);
+    }
+}
+
+static void charge_wall(double start_us)
+{
+    double elapsed = now_us() - start_us;
+    pthread_mutex_lock(&model_lock);
+    times.wall_us += elapsed;
+    pthread_mutex_unlock(&model_lock);
+}
+
+void get_disk_times(struct disk_times *disk_times)
+{
+    pthread_mutex_lock(&model_lock);
+    *disk_times = times;
+    pthread_mutex_unlock(&model_lock);
+}
+
+void reset_disk_times()
+{
+    pthread_mutex_lock(&model_lock);
+    memset(&times, 0, sizeof(times));
+    pthread_mutex_unlock(&model_lock);
+}
+
+/*----------------------------------------------------------*/
+/*CRC32C of a byte range with lookup tables, eight bytes at */
+/*a time (slicing-by-8) on little-endian processors         */
+/*----------------------------------------------------------*/
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *data, size_t length)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word;
+
+    while (length >= 8)
+    {
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+#endif
+    while (length > 0)
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data) & 0xff];
+        data++;
+        length--;
+    }
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+/*----------------------------------------------------------*/
+/*CRC32C of a byte range with the SSE4.2 crc32 instruction. */
+/*Three streams run side by side over the block, since the  */
+/*instruction takes three cycles but starts one every cycle */
+/*----------------------------------------------------------*/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_shift(uint32_t crc, size_t length)
+{
+    uint64_t shifted = crc;
+    size_t i;
+
+    if (length == crc32c_shift_length)
+    {
+        return crc32c_shift_table[0][crc & 0xff] ^ crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+               crc32c_shift_table[2][(crc >> 16) & 0xff] ^ crc32c_shift_table[3][crc >> 24];
+    }
+    /*Running the CRC over 0's multiplies by x^(8*length)*/
+    for (i = 0; i < length; i += 8)
+    {
+        shifted = _mm_crc32_u64(shifted, 0);
+    }
+    return (uint32_t)shifted;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+    uint64_t word0, word1, word2;
+    size_t stream, i;
+
+    stream = length / 24 * 8;
+    for (i = 0; i < stream; i += 8)
+    {
+        memcpy(&word0, data + i, 8);
+        memcpy(&word1, data + stream + i, 8);
+        memcpy(&word2, data + 2 * stream + i, 8);
+        crc0 = _mm_crc32_u64(crc0, word0);
+        crc1 = _mm_crc32_u64(crc1, word1);
+        crc2 = _mm_crc32_u64(crc2, word2);
+    }
+    if (stream > 0)
+    {
+        /*Each stream's CRC is carried over the bytes of the streams after it*/
+        crc0 = crc32c_shift(crc32c_shift((uint32_t)crc0, stream) ^ (uint32_t)crc1, stream) ^ crc2;
+        data += 3 * stream;
+        length -= 3 * stream;
+    }
+    while (length >= 8)
+    {
+        memcpy(&word0, data, 8);
+        crc0 = _mm_crc32_u64(crc0, word0);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc0;
+    while (length > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+        data++;
+        length--;
+    }
+    return crc;
+}
+
+/*----------------------------------------------------------*/
+/*Tabulates the shift over one stream of a block, so whole  */
+/*blocks combine their streams with four lookups each       */
+/*----------------------------------------------------------*/
+static void crc32c_shift_setup(size_t block_size)
+{
+    int i, k;
+
+    crc32c_shift_length = 0;
+    for (k = 0; k < 4; k++)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            crc32c_shift_table[k][i] = crc32c_shift((uint32_t)i << (8 * k), block_size / 24 * 8);
+        }
+    }
+    crc32c_shift_length = block_size / 24 * 8;
+}
+#endif
+
+/*----------------------------------------------------------*/
+/*Builds the tables and picks the fastest CRC32C. Setting   */
+/*DISK_EMU_CRC32C=portable forces the tables                */
+/*----------------------------------------------------------*/
+static void crc32c_setup()
+{
+    uint32_t crc;
+    int i, k;
+    const char *value = getenv("DISK_EMU_CRC32C");
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (k = 0; k < 8; k++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        for (k = 1; k < 8; k++)
+        {
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+        }
+    }
+    crc32c_update = crc32c_portable;
+#ifdef HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && (NULL == value || strcmp(value, "portable") != 0))
+    {
+        crc32c_update = crc32c_sse42;
+    }
+#endif
+}
+
+static uint32_t block_checksum(const void *block)
+{
+    return ~crc32c_update(~(uint32_t)0, block, BLOCK_SIZE);
+}
+
+static int is_verified(int block_number)
+{
+    return (__atomic_load_n(&verified[block_number / 8], __ATOMIC_RELAXED) >> block_number % 8) & 1;
+}
+
+static void set_verified(int block_number, int matches)
+{
+    unsigned char bit = (unsigned char)(1 << block_number % 8);
+
+    if (matches)
+    {
+        __atomic_fetch_or(&verified[block_number / 8], bit, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_and(&verified[block_number / 8], (unsigned char)~bit, __ATOMIC_RELAXED);
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Checks a block against its checksum. A mismatch is        */
+/*counted in the disk times and left to the caller          */
+/*----------------------------------------------------------*/
+static int check_block(int block_number, const void *block)
+{
+    int matches = block_checksum(block) == checksums[block_number];
+
+    set_verified(block_number, matches);
+    if (matches)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&model_lock);
+    times.checksum_errors++;
+    pthread_mutex_unlock(&model_lock);
+    return DISK_CHECKSUM_ERROR;
+}
+
+/*----------------------------------------------------------*/
+/*Checks a block just read, unless it already matched its   */
+/*checksum in this run: a block is checked at most once     */
+/*until it is written again, and the scrubber checks it     */
+/*again for good                                            */
+/*----------------------------------------------------------*/
+static int verify_block(int block_number, const void *block)
+{
+    if (NULL == checksums || is_verified(block_number))
+    {
+        return 0;
+    }
+    return check_block(block_number, block);
+}
+
+/*----------------------------------------------------------*/
+/*Forces the blocks written so far onto the disk file.      */
+/*----------------------------------------------------------*/
+static int sync_data()
+{
+    if (NULL != mapping)
+    {
+        return msync(mapping, mapped_bytes, MS_SYNC);
+    }
+    if (disk_fd >= 0)
+    {
+        return fdatasync(disk_fd);
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Forces a part of the checksum mapping onto the checksum   */
+/*file, from the start of the page it begins in             */
+/*----------------------------------------------------------*/
+static int sync_checksum_range(void *start, size_t length)
+{
+    size_t offset = (size_t)((char *)start - checksum_mapping) % (size_t)sysconf(_SC_PAGESIZE);
+
+    return msync((char *)start - offset, length + offset, MS_SYNC);
+}
+
+/*----------------------------------------------------------*/
+/*Sets the intent bits of the ranges holding a run of       */
+/*blocks. Returns 1 if one of them was not set yet. Called  */
+/*with intent_lock held                                     */
+/*----------------------------------------------------------*/
+static int mark_intent(int start_address, int nblocks)
+{
+    int range, marked = 0;
+
+    if (start_address < 0 || nblocks <= 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        return 0; /*the write itself fails*/
+    }
+    for (range = start_address / INTENT_RANGE_BLOCKS; range <= (start_address + nblocks - 1) / INTENT_RANGE_BLOCKS; range++)
+    {
+        if (!(intents[range / 8] & (1 << range % 8)))
+        {
+            intents[range / 8] |= 1 << range % 8;
+            marked = 1;
+        }
+    }
+    return marked;
+}
+
+/*----------------------------------------------------------*/
+/*Records on the disk that the checksums of a run of blocks */
+/*are about to change, before the blocks reach the disk     */
+/*file. Only the first write to a range since the checksum  */
+/*area was last written pays for a sync                     */
+/*----------------------------------------------------------*/
+static int intend_write(int start_address, int nblocks)
+{
+    int result = 0;
+
+    if (NULL == checksums)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&intent_lock);
+    if (mark_intent(start_address, nblocks))
+    {
+        result = sync_checksum_range(intents, (size_t)BLOCK_SIZE * intent_area_blocks);
+    }
+    pthread_mutex_unlock(&intent_lock);
+    return result;
+}
+
+static int intend_write_v(int *block_addresses, int nblocks)
+{
+    int i, marked = 0, result = 0;
+
+    if (NULL == checksums)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&intent_lock);
+    for (i = 0; i < nblocks; i++)
+    {
+        marked |= mark_intent(block_addresses[i], 1);
+    }
+    if (marked)
+    {
+        result = sync_checksum_range(intents, (size_t)BLOCK_SIZE * intent_area_blocks);
+    }
+    pthread_mutex_unlock(&intent_lock);
+    return result;
+}
+
+/*----------------------------------------------------------*/
+/*Records the checksums of a run of blocks just written.    */
+/*They reach the disk file with the next checksum flush     */
+/*----------------------------------------------------------*/
+static int store_checksums(int start_address, int nblocks, const char *buffer)
+{
+    int i;
+
+    if (NULL == checksums)
+    {
+        return nblocks;
+    }
+    for (i = 0; i < nblocks; i++)
+    {
+        checksums[start_address + i] = block_checksum(buffer + (size_t)i * BLOCK_SIZE);
+        set_verified(start_address + i, 1);
+    }
+    return nblocks;
+}
+
+static int store_checksums_v(int *block_addresses, int nblocks, void **buffers)
+{
+    int i;
+
+    if (NULL == checksums)
+    {
+        return nblocks;
+    }
+    for (i = 0; i < nblocks; i++)
+    {
+        checksums[block_addresses[i]] = block_checksum(buffers[i]);
+        set_verified(block_addresses[i], 1);
+    }
+    return nblocks;
+}
+
+/*----------------------------------------------------------*/
+/*Writes the checksum area to the checksum file after the   */
+/*blocks it covers reach the disk file, then clears the     */
+/*intent bits. Called when no write is under way: with      */
+/*scrub_lock held alone, or while the disk is initialized   */
+/*or closed                                                 */
+/*----------------------------------------------------------*/
+static int flush_checksums()
+{
+    size_t intent_bytes = (size_t)BLOCK_SIZE * intent_area_blocks;
+    size_t i;
+    int result = 0;
+
+    pthread_mutex_lock(&intent_lock);
+    for (i = 0; i < intent_bytes && 0 == intents[i]; i++)
+    {
+    }
+    if (i < intent_bytes)
+    {
+        result = sync_data() != 0 || sync_checksum_range(checksums, (size_t)BLOCK_SIZE * checksum_area_blocks) != 0 ? -1 : 0;
+        if (0 == result)
+        {
+            memset(intents, 0, intent_bytes);
+            result = sync_checksum_range(intents, intent_bytes);
+        }
+    }
+    epoch_syncs = 0;
+    pthread_mutex_unlock(&intent_lock);
+    return result;
+}
+
+/*----------------------------------------------------------*/
+/*Maps the checksum file of a disk, named after it with a   */
+/*.sum suffix, whatever the backend of the disk blocks. A   */
+/*fresh disk gets a new one                                 */
+/*----------------------------------------------------------*/
+static int map_checksums(char *filename, int fresh)
+{
+    char *checksum_filename = malloc(strlen(filename) + sizeof(".sum"));
+    struct stat file_status;
+    int fd;
+
+    if (NULL == checksum_filename)
+    {
+        return -1;
+    }
+    sprintf(checksum_filename, "%s.sum", filename);
+    fd = open(checksum_filename, fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    free(checksum_filename);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    checksum_mapping_bytes = (size_t)BLOCK_SIZE * (checksum_area_blocks + intent_area_blocks);
+    if ((fresh && ftruncate(fd, (off_t)checksum_mapping_bytes) != 0) ||
+        (!fresh && (fstat(fd, &file_status) != 0 || (size_t)file_status.st_size < checksum_mapping_bytes)))
+    {
+        close(fd);
+        return -1;
+    }
+    checksum_mapping = mmap(NULL, checksum_mapping_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (checksum_mapping == MAP_FAILED)
+    {
+        checksum_mapping = NULL;
+        close(fd);
+        return -1;
+    }
+    checksum_fd = fd;
+    checksums = (uint32_t *)checksum_mapping;
+    intents = (unsigned char *)checksum_mapping + (size_t)BLOCK_SIZE * checksum_area_blocks;
+    return 0;
+}
+
+static void unmap_checksums()
+{
+    if (NULL != checksum_mapping)
+    {
+        munmap(checksum_mapping, checksum_mapping_bytes);
+        checksum_mapping = NULL;
+        close(checksum_fd);
+        checksum_fd = -1;
+    }
+    checksums = NULL;
+    intents = NULL;
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*----------------------------------------------------------*/
+/*Keeps the verified bits of the disk last closed if it is  */
+/*mounted again unchanged since. Otherwise every block is   */
+/*checked on its first read, except on a fresh disk, whose  */
+/*blocks are all 0's like their checksums                   */
+/*----------------------------------------------------------*/
+static int load_verified(int fresh)
+{
+    struct stat files[2];
+    size_t verified_bytes = ((size_t)MAX_BLOCK + 7) / 8;
+
+    if (!fresh && NULL != verified && verified_blocks == MAX_BLOCK &&
+        fstat(disk_fd, &files[0]) == 0 && fstat(checksum_fd, &files[1]) == 0 &&
+        same_file(&files[0], &verified_files[0]) && same_file(&files[1], &verified_files[1]))
+    {
+        return 0;
+    }
+    free(verified);
+    verified = malloc(verified_bytes);
+    verified_blocks = NULL != verified ? MAX_BLOCK : 0;
+    if (NULL == verified)
+    {
+        return -1;
+    }
+    memset(verified, fresh ? 0xff : 0, verified_bytes);
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Records the disk and checksum files as they are left, so  */
+/*the next mount can tell if they changed in between        */
+/*----------------------------------------------------------*/
+static void save_verified()
+{
+    if (fstat(disk_fd, &verified_files[0]) != 0 || fstat(checksum_fd, &verified_files[1]) != 0)
+    {
+        verified_blocks = 0; /*the bits are not kept*/
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Computes again the checksums of the ranges whose intent   */
+/*bit was left set: the disk was not closed, and their      */
+/*blocks may have reached the disk file without their       */
+/*checksums                                                 */
+/*----------------------------------------------------------*/
+static int recover_checksums()
+{
+    char *batch = malloc((size_t)SCRUB_BATCH * BLOCK_SIZE);
+    int block, nblocks, i;
+
+    if (NULL == batch)
+    {
+        return -1;
+    }
+    for (block = 0; block < MAX_BLOCK; block += nblocks)
+    {
+        nblocks = MAX_BLOCK - block < SCRUB_BATCH ? MAX_BLOCK - block : SCRUB_BATCH;
+        if (!(intents[block / INTENT_RANGE_BLOCKS / 8] & (1 << block / INTENT_RANGE_BLOCKS % 8)))
+        {
+            continue;
+        }
+        if (transfer_range(block, nblocks, batch, 0) < 0)
+        {
+            free(batch);
+            return -1;
+        }
+        for (i = 0; i < nblocks; i++)
+        {
+            checksums[block + i] = block_checksum(batch + (size_t)i * BLOCK_SIZE);
+        }
+    }
+    free(batch);
+    return flush_checksums();
+}
+
+/*----------------------------------------------------------*/
+/*Finds the checksums of the disk just initialized. A fresh */
+/*disk gets the checksum of a block of 0's for every block  */
+/*----------------------------------------------------------*/
+static int load_checksums(char *filename, int fresh)
+{
+    uint32_t zero_checksum;
+    char *zero_block;
+    int i;
+
+    if (0 == checksum_area_blocks)
+    {
+        return 0;
+    }
+    if (NULL == crc32c_update)
+    {
+        crc32c_setup();
+    }
+#ifdef HAVE_SSE42_CRC
+    if (crc32c_sse42 == crc32c_update)
+    {
+        crc32c_shift_setup(BLOCK_SIZE);
+    }
+#endif
+    if (map_checksums(filename, fresh) < 0)
+    {
+        return -1;
+    }
+    if (load_verified(fresh) < 0)
+    {
+        unmap_checksums();
+        return -1;
+    }
+    if (!fresh)
+    {
+        if (recover_checksums() < 0)
+        {
+            unmap_checksums(); /*the intent bits stay set for the next mount*/
+            return -1;
+        }
+        return 0;
+    }
+    zero_block = calloc(1, BLOCK_SIZE);
+    if (NULL == zero_block)
+    {
+        unmap_checksums();
+        return -1;
+    }
+    zero_checksum = block_checksum(zero_block);
+    free(zero_block);
+    for (i = 0; i < MAX_BLOCK; i++)
+    {
+        checksums[i] = zero_checksum;
+    }
+    mark_intent(0, MAX_BLOCK); /*so the flush writes the whole area*/
+    return flush_checksums();
+}
+
+/*----------------------------------------------------------*/
+/*Reads every block in turn and checks it against its       */
+/*checksum, sleeping between batches so no more than        */
+/*scrub_rate blocks are checked per second                  */
+/*----------------------------------------------------------*/
+static void *scrub_main(void *unused)
+{
+    char *batch = malloc((size_t)SCRUB_BATCH * BLOCK_SIZE);
+    int block = 0;
+    int nblocks, i;
+    double next_us = now_us();
+    struct timespec deadline;
+
+    pthread_mutex_lock(&scrub_mutex);
+    while (!scrub_stopping && NULL != batch)
+    {
+        pthread_mutex_unlock(&scrub_mutex);
+        nblocks = MAX_BLOCK - block < SCRUB_BATCH ? MAX_BLOCK - block : SCRUB_BATCH;
+        /*Writes wait, so a block only differs from its checksum if it is corrupt*/
+        pthread_rwlock_wrlock(&scrub_lock);
+        if (transfer_range(block, nblocks, batch, 0) >= 0)
+        {
+            for (i = 0; i < nblocks; i++)
+            {
+                check_block(block + i, batch + (size_t)i * BLOCK_SIZE);
+            }
+        }
+        pthread_rwlock_unlock(&scrub_lock);
+        pthread_mutex_lock(&model_lock);
+        times.blocks_scrubbed += nblocks;
+        pthread_mutex_unlock(&model_lock);
+        block = (block + nblocks) % MAX_BLOCK;
+
+        /*The next batch starts once this one is paid for at the rate*/
+        next_us += 1e6 * nblocks / scrub_rate;
+        if (next_us < now_us())
+        {
+            next_us = now_us();
+        }
+        deadline.tv_sec = (time_t)(next_us / 1e6);
+        deadline.tv_nsec = (long)((next_us - deadline.tv_sec * 1e6) * 1e3);
+        pthread_mutex_lock(&scrub_mutex);
+        while (!scrub_stopping && pthread_cond_timedwait(&scrub_wakeup, &scrub_mutex, &deadline) != ETIMEDOUT)
+        {
+        }
+    }
+    pthread_mutex_unlock(&scrub_mutex);
+    free(batch);
+    return NULL;
+}
+
+static void stop_scrub()
+{
+    if (!scrub_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&scrub_mutex);
+    scrub_stopping = 1;
+    pthread_cond_signal(&scrub_wakeup);
+    pthread_mutex_unlock(&scrub_mutex);
+    pthread_join(scrub_thread, NULL);
+    pthread_cond_destroy(&scrub_wakeup);
+    scrub_running = 0;
+}
+
+/*----------------------------------------------------------*/
+/*Keeps checking every block against its checksum in a      */
+/*background thread, over and over, at blocks_per_second at */
+/*most; 0 stops it. The disk must have checksums            */
+/*----------------------------------------------------------*/
+int scrub_disk(int blocks_per_second)
+{
+    pthread_condattr_t attributes;
+
+    stop_scrub();
+    if (blocks_per_second <= 0)
+    {
+        return 0;
+    }
+    if (NULL == checksums)
+    {
+        printf("The disk has no checksums to scrub\n");
+        return -1;
+    }
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC); /*the deadlines come from now_us*/
+    pthread_cond_init(&scrub_wakeup, &attributes);
+    pthread_condattr_destroy(&attributes);
+    scrub_rate = blocks_per_second;
+    scrub_stopping = 0;
+    if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0)
+    {
+        pthread_cond_destroy(&scrub_wakeup);
+        return -1;
+    }
+    scrub_running = 1;
+    return 0;
+}
+
+/*--------------------------------------------------------------*/
+/*Selects whether the disks initialized from now on keep a      */
+/*CRC32C of every block, in a checksum file named after the disk*/
+/*file with a .sum suffix. Reads of a block that does not match */
+/*its checksum fail                                             */
+/*--------------------------------------------------------------*/
+int set_disk_checksums(int enabled)
+{
+    checksums_enabled = enabled != 0;
+    return 0;
+}
+
+/*--------------------------------------------------------------*/
+/*Maps the whole disk file in memory, or sets up io_uring, when */
+/*that backend is selected. Falls back to pread/pwrite if the   */
+/*mapping or the rings cannot be made.                          */
+/*--------------------------------------------------------------*/
+static void map_disk()
+{
+    fflush(fp);
+    disk_fd = fileno(fp);
+#ifdef HAVE_IO_URING
+    if (backend == DISK_BACKEND_URING && uring_setup() == 0)
+    {
+        return;
+    }
+#endif
+    if (backend == DISK_BACKEND_URING)
+    {
+        printf("Could not set up io_uring, using pread/pwrite instead\n");
+        return;
+    }
+    if (backend != DISK_BACKEND_MMAP)
+    {
+        return;
+    }
+    mapping = mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    if (mapping == MAP_FAILED)
+    {
+        printf("Could not map the disk file, using pread/pwrite instead\n");
+        mapping = NULL;
+    }
+}
+
+/*--------------------------------------------------------------*/
+/*Selects how the disk file is accessed. Takes effect the next  */
+/*time a disk is initialized.                                   */
+/*--------------------------------------------------------------*/
+int set_disk_backend(int disk_backend)
+{
+    if (disk_backend != DISK_BACKEND_FILE && disk_backend != DISK_BACKEND_MMAP && disk_backend != DISK_BACKEND_URING)
+    {
+        printf("Unknown disk backend %d\n", disk_backend);
+        return -1;
+    }
+    backend = disk_backend;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Forces the blocks written so far onto the disk file. Their*/
+/*checksums follow every CHECKSUM_EPOCH_SYNCS calls: until  */
+/*then the intent bits cover them                           */
+/*----------------------------------------------------------*/
+int sync_disk()
+{
+    double start_us = now_us();
+    int result = sync_data();
+    int flush;
+
+    if (0 == result && NULL != checksums)
+    {
+        pthread_mutex_lock(&intent_lock);
+        flush = ++epoch_syncs >= CHECKSUM_EPOCH_SYNCS;
+        pthread_mutex_unlock(&intent_lock);
+        if (flush)
+        {
+            pthread_rwlock_wrlock(&scrub_lock);
+            result = flush_checksums();
+            pthread_rwlock_unlock(&scrub_lock);
+        }
+    }
+    charge_wall(start_us);
+    return result;
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int close_disk()
+{
+    stop_scrub();
+    pthread_mutex_lock(&ring_lock);
+#ifdef HAVE_IO_URING
+    if (ring_fd >= 0)
+    {
+        /*Requests still in flight must not land in buffers released after the disk is closed*/
+        while (ring_inflight > 0)
+        {
+            uring_reap(1);
+        }
+        uring_teardown();
+    }
+#endif
+    while (NULL != completed_head)
+    {
+        struct disk_request *request = completed_head;
+        completed_head = request->next;
+        free(request);
+    }
+    completed_tail = NULL;
+    completed_count = 0;
+    async_pending = 0;
+    pthread_mutex_unlock(&ring_lock);
+    if(NULL != checksum_mapping)
+    {
+        flush_checksums();
+    }
+    if(NULL != mapping)
+    {
+        msync(mapping, mapped_bytes, MS_SYNC);
+        munmap(mapping, mapped_bytes);
+        mapping = NULL;
+    }
+    if(NULL != checksum_mapping)
+    {
+        save_verified();
+    }
+    unmap_checksums();
+    if(NULL != fp)
+    {
+        fclose(fp);
+        fp = NULL;
+        disk_fd = -1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Sets the size of the disk and of its checksum file areas  */
+/*----------------------------------------------------------*/
+static void set_geometry(int block_size, int num_blocks)
+{
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+    checksum_area_blocks = checksums_enabled ? (int)(((size_t)num_blocks * sizeof(uint32_t) + block_size - 1) / block_size) : 0;
+    intent_area_blocks = 0;
+    if (checksum_area_blocks > 0)
+    {
+        /*one bit per range, rounded up to whole blocks*/
+        intent_area_blocks = (int)((((size_t)num_blocks + INTENT_RANGE_BLOCKS - 1) / INTENT_RANGE_BLOCKS + 8 * (size_t)block_size - 1) / (8 * (size_t)block_size));
+    }
+    mapped_bytes = (size_t)BLOCK_SIZE * MAX_BLOCK;
+    epoch_syncs = 0;
+}
+
+/*---------------------------------------*/
+/*Initializes a disk file filled with 0's*/
+/*---------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    set_geometry(block_size, num_blocks);
+    head_position = 0;
+    load_model_from_env();
+    
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+    /*Creates a new file*/
+    fp = fopen (filename, "w+b");
+
+    if (fp == NULL)
+    {
+        printf("Could not create new disk file %s\n\n", filename);
+        return -1;
+    }
+    
+    /*Grows the file to its given size as a sparse file: every block */
+    /*reads as 0's and no space is used until it is written          */
+    if (ftruncate(fileno(fp), (off_t)mapped_bytes) != 0)
+    {
+        printf("Could not size new disk file %s\n\n", filename);
+        fclose(fp);
+        fp = NULL;
+        return -1;
+    }
+    map_disk();
+    if (load_checksums(filename, 1) < 0)
+    {
+        printf("Could not write the checksums of %s\n\n", filename);
+        close_disk();
+        return -1;
+    }
+    return 0;
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    set_geometry(block_size, num_blocks);
+    head_position = 0;
+    load_model_from_env();
+    
+    /*Opens a file*/
+    fp = fopen (filename, "r+b");
+
+    if (fp == NULL)
+    {
+        printf("Could not open %s\n\n", filename);
+        return -1;
+    }
+    map_disk();
+    if (load_checksums(filename, 0) < 0)
+    {
+        printf("Could not read the checksums of %s\n\n", filename);
+        close_disk();
+        return -1;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Moves the whole byte range with as many pread/pwrite calls as the  */
+/*kernel needs (usually one)                                          */
+/*-------------------------------------------------------------------*/
+static int transfer_range(int start_address, int nblocks, char *buffer, int writing)
+{
+    size_t length = (size_t)nblocks * BLOCK_SIZE;
+    off_t offset = (off_t)start_address * BLOCK_SIZE;
+    ssize_t done;
+
+    while (length > 0)
+    {
+        done = writing ? pwrite(disk_fd, buffer, length, offset) : pread(disk_fd, buffer, length, offset);
+        if (done <= 0)
+        {
+            printf("disk %s error at block %d\n", writing ? "write" : "read", (int)(offset / BLOCK_SIZE));
+            return -1;
+        }
+        buffer += done;
+        offset += done;
+        length -= done;
+    }
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/*Records the result of a request. Completed async requests wait in  */
+/*a list until poll_completions hands them out. Called with          */
+/*ring_lock held                                                     */
+/*-------------------------------------------------------------------*/
+static void complete_request(struct disk_request *request, int result)
+{
+    request->result = result;
+    request->done = 1;
+    if (request->async)
+    {
+        request->next = NULL;
+        if (NULL == completed_tail)
+        {
+            completed_head = request;
+        }
+        else
+        {
+            completed_tail->next = request;
+        }
+        completed_tail = request;
+        completed_count++;
+        async_pending--;
+    }
+}
+
+#ifdef HAVE_IO_URING
+/*-------------------------------------------------------------------*/
+/*Passes the queued entries to the kernel and reaps the completions, */
+/*waiting for at least one when asked to. A short transfer is done   */
+/*again with pread/pwrite. Called with ring_lock held                */
+/*-------------------------------------------------------------------*/
+static void uring_reap(int wait)
+{
+    unsigned head, tail;
+    int submitted, i, block, result;
+    size_t length;
+
+    if (ring_unsubmitted > 0 || wait)
+    {
+        submitted = syscall(__NR_io_uring_enter, ring_fd, ring_unsubmitted, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted > 0)
+        {
+            ring_unsubmitted -= submitted;
+        }
+    }
+
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        struct disk_request *request = (struct disk_request *)(unsigned long)cqe->user_data;
+        head++;
+        ring_inflight--;
+
+        length = 0;
+        for (i = 0; i < request->iovcnt; i++)
+        {
+            length += request->iov[i].iov_len;
+        }
+        result = request->nblocks;
+        if (cqe->res < 0 || (size_t)cqe->res != length)
+        {
+            /*Short or failed transfer: do it again one buffer at a time*/
+            block = request->start_address;
+            for (i = 0; i < request->iovcnt && result >= 0; i++)
+            {
+                result = transfer_range(block, request->iov[i].iov_len / BLOCK_SIZE, request->iov[i].iov_base, request->writing) < 0 ? -1 : result;
+                block += request->iov[i].iov_len / BLOCK_SIZE;
+            }
+        }
+        if (request->async && result >= 0)
+        {
+            /*Blocking reads are checked by their caller, these are only seen by poll_completions*/
+            for (i = 0; i < request->nblocks && result >= 0; i++)
+            {
+                result = verify_block(request->start_address + i, (char *)request->iov[0].iov_base + (size_t)i * BLOCK_SIZE) < 0 ? DISK_CHECKSUM_ERROR : result;
+            }
+        }
+        complete_request(request, result);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*-------------------------------------------------------------------*/
+/*Queues a request in the submission ring. It reaches the kernel     */
+/*with the next uring_reap. Called with ring_lock held               */
+/*-------------------------------------------------------------------*/
+static void uring_queue(struct disk_request *request)
+{
+    unsigned tail, index;
+    struct io_uring_sqe *sqe;
+
+    while (ring_inflight >= (int)sq_entries)
+    {
+        uring_reap(1);
+    }
+    tail = *sq_tail;
+    index = tail & *sq_mask;
+    sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = disk_fd;
+    sqe->addr = (unsigned long)request->iov;
+    sqe->len = request->iovcnt;
+    sqe->off = (unsigned long long)request->start_address * BLOCK_SIZE;
+    sqe->user_data = (unsigned long)request;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring_inflight++;
+    ring_unsubmitted++;
+}
+
+/*-------------------------------------------------------------------*/
+/*Keeps every request of a blocking call in flight at once and waits */
+/*for all of them                                                    */
+/*-------------------------------------------------------------------*/
+static int uring_transfer(struct disk_request *requests, int count)
+{
+    int i, s;
+
+    pthread_mutex_lock(&ring_lock);
+    for (i = 0; i < count; i++)
+    {
+        uring_queue(&requests[i]);
+    }
+    for (i = 0; i < count; i++)
+    {
+        while (!requests[i].done)
+        {
+            uring_reap(1);
+        }
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    s = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (requests[i].result < 0)
+        {
+            return -1;
+        }
+        s += requests[i].nblocks;
+    }
+    return s;
+}
+#endif
+
+/*-------------------------------------------------------------------*/
+/*Moves a contiguous range of blocks from or into a single buffer    */
+/*as one io_uring request                                            */
+/*-------------------------------------------------------------------*/
+static int transfer_single(int start_address, int nblocks, void *buffer, int writing)
+{
+#ifdef HAVE_IO_URING
+    if (ring_fd >= 0)
+    {
+        struct disk_request request;
+        memset(&request, 0, sizeof(request));
+        request.start_address = start_address;
+        request.nblocks = nblocks;
+        request.writing = writing;
+        request.iovcnt = 1;
+        request.iov[0].iov_base = buffer;
+        request.iov[0].iov_len = (size_t)nblocks * BLOCK_SIZE;
+        return uring_transfer(&request, 1);
+    }
+#endif
+    return transfer_range(start_address, nblocks, buffer, writing);
+}
+
+/*-------------------------------------------------------------------*/
+/*Moves a list of (possibly non-contiguous) blocks, one buffer per   */
+/*block. Every run of consecutive block numbers costs a single       */
+/*preadv/pwritev call, or a series of memcpy on the mapped disk      */
+/*-------------------------------------------------------------------*/
+static int transfer_blocks_v(int *block_addresses, int nblocks, void **buffers, int writing)
+{
+    struct iovec iov[MAX_IOV];
+    int i, j, run, s;
+    size_t length;
+    ssize_t done;
+    s = 0;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        /*Checks that the data requested is within the range of addresses of the disk*/
+        if (block_addresses[i] < 0 || block_addresses[i] >= MAX_BLOCK)
+        {
+            printf("out of bound error %d\n", block_addresses[i]);
+            return -1;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    /*Every run becomes one readv/writev request, and all of them are in flight at once*/
+    if (ring_fd >= 0)
+    {
+        struct disk_request *requests = calloc(nblocks > 0 ? nblocks : 1, sizeof(struct disk_request));
+        int count = 0;
+        for (i = 0; i < nblocks; i += run)
+        {
+            run = 1;
+            while (i + run < nblocks && run < MAX_IOV && block_addresses[i + run] == block_addresses[i] + run)
+            {
+                run++;
+            }
+            requests[count].start_address = block_addresses[i];
+            requests[count].nblocks = run;
+            requests[count].writing = writing;
+            requests[count].iovcnt = run;
+            charge_request(block_addresses[i], run, writing);
+            for (j = 0; j < run; j++)
+            {
+                requests[count].iov[j].iov_base = buffers[i + j];
+                requests[count].iov[j].iov_len = BLOCK_SIZE;
+            }
+            count++;
+        }
+        s = uring_transfer(requests, count);
+        free(requests);
+        return s;
+    }
+#endif
+
+    for (i = 0; i < nblocks; i += run)
+    {
+        run = 1;
+        while (i + run < nblocks && run < MAX_IOV && block_addresses[i + run] == block_addresses[i] + run)
+        {
+            run++;
+        }
+
+        charge_request(block_addresses[i], run, writing);
+        for (j = 0; j < run; j++)
+        {
+            if (NULL != mapping)
+            {
+                char *block = mapping + (size_t)(block_addresses[i] + j) * BLOCK_SIZE;
+                memcpy(writing ? block : buffers[i + j], writing ? buffers[i + j] : block, BLOCK_SIZE);
+            }
+            iov[j].iov_base = buffers[i + j];
+            iov[j].iov_len = BLOCK_SIZE;
+        }
+
+        if (NULL == mapping)
+        {
+            length = (size_t)run * BLOCK_SIZE;
+            if (writing)
+            {
+                done = pwritev(disk_fd, iov, run, (off_t)block_addresses[i] * BLOCK_SIZE);
+            }
+            else
+            {
+                done = preadv(disk_fd, iov, run, (off_t)block_addresses[i] * BLOCK_SIZE);
+            }
+            if (done < 0 || (size_t)done != length)
+            {
+                /*Short transfer: finish the run one block at a time*/
+                for (j = 0; j < run; j++)
+                {
+                    if (transfer_range(block_addresses[i] + j, 1, buffers[i + j], writing) < 0)
+                    {
+                        return -1;
+                    }
+                }
+            }
+        }
+        s += run;
+    }
+    return s;
+}
+
+static int read_contiguous(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    charge_request(start_address, nblocks, 0);
+
+    /*The mapped disk is read in place*/
+    if (NULL != mapping)
+    {
+        memcpy(buffer, mapping + (size_t)start_address * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    /*All the blocks requested are read with one call*/
+    return transfer_single(start_address, nblocks, buffer, 0);
+}
+
+static int write_contiguous(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+    charge_request(start_address, nblocks, 1);
+
+    /*The mapped disk is written in place, msync happens in sync_disk*/
+    if (NULL != mapping)
+    {
+        memcpy(mapping + (size_t)start_address * BLOCK_SIZE, buffer, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    /*All the blocks requested are written with one call, fdatasync happens in sync_disk*/
+    return transfer_single(start_address, nblocks, buffer, 1);
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    double start_us = now_us();
+    int result = read_contiguous(start_address, nblocks, buffer);
+    int i;
+
+    for (i = 0; result >= 0 && i < nblocks; i++)
+    {
+        result = verify_block(start_address + i, (char *)buffer + (size_t)i * BLOCK_SIZE) < 0 ? DISK_CHECKSUM_ERROR : result;
+    }
+    charge_wall(start_us);
+    return result;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    double start_us = now_us();
+    int result;
+
+    pthread_rwlock_rdlock(&scrub_lock); /*the scrubber never sees a block without its checksum*/
+    result = intend_write(start_address, nblocks);
+    if (result >= 0)
+    {
+        result = write_contiguous(start_address, nblocks, buffer);
+    }
+    if (result >= 0)
+    {
+        result = store_checksums(start_address, nblocks, buffer);
+    }
+    pthread_rwlock_unlock(&scrub_lock);
+    charge_wall(start_us);
+    return result;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a list of blocks, not necessarily contiguous on the disk,    */
+/*into one buffer per block                                          */
+/*-------------------------------------------------------------------*/
+int read_blocks_v(int *block_addresses, int nblocks, void **buffers)
+{
+    double start_us = now_us();
+    int result = transfer_blocks_v(block_addresses, nblocks, buffers, 0);
+    int i;
+
+    for (i = 0; result >= 0 && i < nblocks; i++)
+    {
+        result = verify_block(block_addresses[i], buffers[i]) < 0 ? DISK_CHECKSUM_ERROR : result;
+    }
+    charge_wall(start_us);
+    return result;
+}
+
+/*-------------------------------------------------------------------*/
+/*Returns the descriptor of the disk file, for a caller that reads a */
+/*series of blocks from it by itself (at start_address * block size),*/
+/*once each block has matched its checksum in this run. The blocks   */
+/*not checked yet are read and checked first; -1 if one fails        */
+/*-------------------------------------------------------------------*/
+int read_blocks_fd(int start_address, int nblocks)
+{
+    char *block = NULL;
+    int result = disk_fd;
+    int i;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 1 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    for (i = 0; NULL != checksums && result >= 0 && i < nblocks; i++)
+    {
+        if (is_verified(start_address + i))
+        {
+            continue;
+        }
+        if (NULL == block && NULL == (block = malloc(BLOCK_SIZE)))
+        {
+            return -1;
+        }
+        result = read_blocks(start_address + i, 1, block) < 0 ? -1 : result;
+    }
+    free(block);
+    return result;
+}
+
+/*-------------------------------------------------------------------*/
+/*Writes a list of blocks, not necessarily contiguous on the disk,   */
+/*from one buffer per block                                          */
+/*-------------------------------------------------------------------*/
+int write_blocks_v(int *block_addresses, int nblocks, void **buffers)
+{
+    double start_us = now_us();
+    int result;
+
+    pthread_rwlock_rdlock(&scrub_lock);
+    result = intend_write_v(block_addresses, nblocks);
+    if (result >= 0)
+    {
+        result = transfer_blocks_v(block_addresses, nblocks, buffers, 1);
+    }
+    if (result >= 0)
+    {
+        result = store_checksums_v(block_addresses, nblocks, buffers);
+    }
+    pthread_rwlock_unlock(&scrub_lock);
+    charge_wall(start_us);
+    return result;
+}
+
+/*-------------------------------------------------------------------*/
+/*Starts reading a series of blocks into the buffer and returns      */
+/*without waiting. The buffer must stay valid until the tag comes    */
+/*back from poll_completions. Without io_uring the read is done at   */
+/*once and only its completion is deferred                           */
+/*-------------------------------------------------------------------*/
+int submit_read_blocks(int start_address, int nblocks, void *buffer, void *tag)
+{
+    struct disk_request *request;
+    int result;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 1 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    request = calloc(1, sizeof(struct disk_request));
+    if (NULL == request)
+    {
+        return -1;
+    }
+    request->start_address = start_address;
+    request->nblocks = nblocks;
+    request->async = 1;
+    request->tag = tag;
+    request->iovcnt = 1;
+    request->iov[0].iov_base = buffer;
+    request->iov[0].iov_len = (size_t)nblocks * BLOCK_SIZE;
+
+#ifdef HAVE_IO_URING
+    if (ring_fd >= 0)
+    {
+        charge_request(start_address, nblocks, 0);
+        pthread_mutex_lock(&ring_lock);
+        async_pending++;
+        uring_queue(request);
+        uring_reap(0);
+        pthread_mutex_unlock(&ring_lock);
+        return 0;
+    }
+#endif
+    result = read_blocks(start_address, nblocks, buffer);
+    pthread_mutex_lock(&ring_lock);
+    async_pending++;
+    complete_request(request, result < 0 ? result : nblocks);
+    pthread_mutex_unlock(&ring_lock);
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Hands out up to max_completions finished submit_read_blocks        */
+/*requests, waiting until at least min_completions are finished (or  */
+/*none is left in flight)                                            */
+/*-------------------------------------------------------------------*/
+int poll_completions(struct disk_completion *completions, int max_completions, int min_completions)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&ring_lock);
+#ifdef HAVE_IO_URING
+    if (ring_fd >= 0)
+    {
+        uring_reap(0);
+        while (completed_count < min_completions && async_pending > 0)
+        {
+            uring_reap(1);
+        }
+    }
+#endif
+    while (n < max_completions && NULL != completed_head)
+    {
+        struct disk_request *request = completed_head;
+        completed_head = request->next;
+        if (NULL == completed_head)
+        {
+            completed_tail = NULL;
+        }
+        completed_count--;
+        completions[n].tag = request->tag;
+        completions[n].result = request->result;
+        free(request);
+        n++;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return n;
+}
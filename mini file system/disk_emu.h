@@ -1,5 +1,68 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#define DISK_BACKEND_FILE 0 /*pread/pwrite on the raw file descriptor*/
+#define DISK_BACKEND_MMAP 1 /*whole disk mapped in memory*/
+#define DISK_BACKEND_URING 2 /*readv/writev requests kept in flight through io_uring*/
+
+#define DISK_CHECKSUM_ERROR -2 /*returned by a read of a block that does not match its checksum, with the block read all the same; other errors return -1*/
+
+#define DISK_PROFILE_NONE 0 /*requests cost nothing (the default)*/
+#define DISK_PROFILE_HDD 1
+#define DISK_PROFILE_SSD 2
+
+/*Cost of a request in the device model. A request that does not start */
+/*where the previous one ended pays a seek that grows with the distance. */
+/*The environment (DISK_EMU_PROFILE=none|hdd|ssd, DISK_EMU_SEEK_US, ...) */
+/*sets it when a disk is initialized, unless set_disk_model was called   */
+struct disk_model
+{
+    double seek_us;
+    double seek_us_per_mib; /*extra seek time per MiB between the head and the request*/
+    double max_seek_us; /*0 for no limit*/
+    double read_us_per_kib;
+    double write_us_per_kib;
+    int sleep; /*1 to really pause for the simulated time, 0 to only count it*/
+};
+
+/*Time and requests counted since the last reset_disk_times*/
+struct disk_times
+{
+    double simulated_us; /*time the requests would take on the modelled device*/
+    double wall_us; /*time really spent in the emulator*/
+    long long read_requests;
+    long long write_requests;
+    long long blocks_read;
+    long long blocks_written;
+    long long seeks;
+    long long checksum_errors; /*blocks read or scrubbed that did not match their checksum*/
+    long long blocks_scrubbed;
+};
+
+/*Result of a request started with submit_read_blocks*/
+struct disk_completion
+{
+    void *tag;
+    int result; /*blocks read, DISK_CHECKSUM_ERROR or -1 on error*/
+};
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int read_blocks_v(int *block_addresses, int nblocks, void **buffers);
+int read_blocks_fd(int start_address, int nblocks);
+int write_blocks_v(int *block_addresses, int nblocks, void **buffers);
 int close_disk();
+int set_disk_backend(int disk_backend);
+int sync_disk();
+int set_disk_model(const struct disk_model *disk_model);
+int set_disk_profile(int profile);
+void get_disk_times(struct disk_times *disk_times);
+void reset_disk_times();
+int set_disk_checksums(int enabled);
+int scrub_disk(int blocks_per_second);
+int submit_read_blocks(int start_address, int nblocks, void *buffer, void *tag);
+int poll_completions(struct disk_completion *completions, int max_completions, int min_completions);
+
+#endif
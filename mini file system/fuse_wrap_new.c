@@ -10,9 +10,38 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <stdint.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+#define MAXFILENAME (MAX_FILENAME_LENGTH + 1) // SFS names are the FUSE paths, leading '/' included
+#define STATS_PATH "/.sfs_stats" // read-only file with the runtime counters of SFS, not stored on the disk
+#define READ_EXTENTS 16 // pieces of a read_buf reply; the rest of a more fragmented range is read into memory
+
+/* Text of the stats file, formatted once per open so every read of the handle sees the same counters */
+struct stats_snapshot {
+    int length;
+    char text[];
+};
+
+static int is_stats_path(const char *path)
+{
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+/* SFS open flags for the access mode of a FUSE open */
+static int sfs_open_flags(int flags)
+{
+    switch (flags & O_ACCMODE) {
+    case O_WRONLY:
+        return OpenWrite;
+    case O_RDWR:
+        return OpenReadWrite;
+    default:
+        return OpenRead;
+    }
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -23,6 +52,11 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
+    } else if (is_stats_path(path)) {
+        /* The size changes with every operation; the file is opened with direct_io so reads ignore it */
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = sfs_format_stats(NULL, 0);
     } else if((size = sfs_getfilesize(path)) != -1) {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
@@ -43,6 +77,7 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
+    filler(buf, &STATS_PATH[1], NULL, 0);
     
     while(sfs_getnextfilename(file_name)) {
         filler(buf, &file_name[1], NULL, 0);
@@ -56,6 +91,8 @@ static int fuse_unlink(const char *path)
     int res;
     char filename[MAXFILENAME];
     
+    if (is_stats_path(path))
+        return -EACCES;
     strcpy(filename, path);
     res = sfs_remove(filename);
     if (res == -1)
@@ -64,68 +101,210 @@ static int fuse_unlink(const char *path)
     return 0;
 }
 
+static int stats_open(struct fuse_file_info *fi)
+{
+    struct stats_snapshot *snapshot;
+    int length;
+    
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    
+    length = sfs_format_stats(NULL, 0);
+    snapshot = malloc(sizeof(struct stats_snapshot) + length + 1);
+    if (snapshot == NULL)
+        return -ENOMEM;
+    /* The counters may have grown since they were measured: keep what fits */
+    snapshot->length = sfs_format_stats(snapshot->text, length + 1);
+    if (snapshot->length > length)
+        snapshot->length = length;
+    
+    fi->fh = (uintptr_t)snapshot;
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int stats_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct stats_snapshot *snapshot = (struct stats_snapshot *)(uintptr_t)fi->fh;
+    
+    if (offset >= snapshot->length)
+        return 0;
+    if (size > snapshot->length - offset)
+        size = snapshot->length - offset;
+    memcpy(buf, snapshot->text + offset, size);
+    return size;
+}
+
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
     int res;
     char filename[MAXFILENAME];
     
+    if (is_stats_path(path))
+        return stats_open(fi);
+    if (strlen(path) > MAX_FILENAME_LENGTH)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
-    res = sfs_fopen(filename);
+    /* The SFS descriptor lives as long as the FUSE handle: read and write use it directly */
+    res = sfs_open(filename, sfs_open_flags(fi->flags));
     if (res == -1)
-        return -errno;
+        return -ENOENT;
+    
+    /* O_TRUNC reaches us with the open since fuse_init asks for FUSE_CAP_ATOMIC_O_TRUNC */
+    if ((fi->flags & O_TRUNC) && (fi->flags & O_ACCMODE) != O_RDONLY && sfs_ftruncate(res, 0) == -1) {
+        sfs_fclose(res);
+        return -EIO;
+    }
     
-    sfs_fclose(res);
+    fi->fh = res;
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    if (is_stats_path(path))
+        free((struct stats_snapshot *)(uintptr_t)fi->fh);
+    else
+        sfs_fclose(fi->fh);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
+    if (is_stats_path(path))
+        return stats_read(buf, size, offset, fi);
     
-    strcpy(filename, path);
+    /* Positional: requests on the same handle may run on several threads at once */
+    res = sfs_pread(fi->fh, buf, size, offset);
+    if (res == -1)
+        return -EIO;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
+    return res;
+}
+
+/* Frees a reply of fuse_read_buf, the way FUSE does once it is sent */
+static void free_bufvec(struct fuse_bufvec *bufv)
+{
+    size_t i;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    for (i = 0; i < bufv->count; i++)
+        free(bufv->buf[i].mem);
+    free(bufv);
+}
+
+/* Reads the stats file into a buffer FUSE replies from (and frees) */
+static int stats_read_buf(struct fuse_bufvec **bufp, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src;
+    char *mem;
+    int res;
     
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    src = malloc(sizeof(struct fuse_bufvec));
+    mem = malloc(size);
+    if (src == NULL || mem == NULL) {
+        free(src);
+        free(mem);
+        return -ENOMEM;
+    }
     
-    sfs_fclose(fd);
-    return res;
+    res = stats_read(mem, size, offset, fi);
+    *src = FUSE_BUFVEC_INIT(res);
+    src->buf[0].mem = mem;
+    *bufp = src;
+    return 0;
 }
 
-static int fuse_write(const char *path, const char *buf, size_t size,
+static int fuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
+    SfsExtent extents[READ_EXTENTS];
+    struct fuse_bufvec *src;
+    struct fuse_buf *buf;
+    int count, i, res;
     
-    char filename[MAXFILENAME];
+    if (is_stats_path(path))
+        return stats_read_buf(bufp, size, offset, fi);
     
-    strcpy(filename, path);
+    /* Runs of blocks whose bytes are on the disk go out straight from the disk file (spliced when the
+       kernel allows it); only the rest is read into buffers FUSE replies from and frees */
+    count = sfs_pread_extents(fi->fh, size, offset, extents, READ_EXTENTS);
+    if (count == -1)
+        return -EIO;
+    src = calloc(1, sizeof(struct fuse_bufvec) + (count > 1 ? count - 1 : 0) * sizeof(struct fuse_buf));
+    if (src == NULL)
+        return -ENOMEM;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
+    *src = FUSE_BUFVEC_INIT(0);
+    src->count = count > 0 ? count : 1;
+    for (i = 0; i < count; i++) {
+        buf = &src->buf[i];
+        buf->size = extents[i].length;
+        if (extents[i].diskFd != -1) {
+            buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            buf->fd = extents[i].diskFd;
+            buf->pos = extents[i].diskOffset;
+            offset += extents[i].length;
+            continue;
+        }
+        buf->mem = malloc(extents[i].length);
+        if (buf->mem == NULL) {
+            free_bufvec(src);
+            return -ENOMEM;
+        }
+        res = sfs_pread(fi->fh, buf->mem, extents[i].length, offset);
+        if (res == -1) {
+            free_bufvec(src);
+            return -EIO;
+        }
+        if (res < extents[i].length) {
+            /* The file was truncated in between: the reply ends where it now ends */
+            buf->size = res;
+            src->count = i + 1;
+            break;
+        }
+        offset += extents[i].length;
+    }
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    *bufp = src;
+    return 0;
+}
+
+static int fuse_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    int res;
     
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_pwrite(fi->fh, buf, size, offset);
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
+    return res;
+}
+
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    int res;
+    
+    /* Data already in memory goes to SFS straight from the request buffer */
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+        return fuse_write(path, buf->buf[0].mem, size, offset, fi);
+    
+    /* Spliced from a pipe or split in pieces: gathered into one buffer first */
+    dst.buf[0].mem = malloc(size);
+    if (dst.buf[0].mem == NULL)
+        return -ENOMEM;
+    res = fuse_buf_copy(&dst, buf, 0);
+    if (res >= 0)
+        res = fuse_write(path, dst.buf[0].mem, res, offset, fi);
+    free(dst.buf[0].mem);
     return res;
 }
 
@@ -133,15 +312,31 @@ static int fuse_truncate(const char *path, off_t size)
 {
     char filename[MAXFILENAME];
     int fd;
+    int res;
     
+    if (is_stats_path(path))
+        return -EACCES;
+    if (strlen(path) > MAX_FILENAME_LENGTH)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
+    fd = sfs_open(filename, OpenWrite);
     if (fd == -1)
-        return -errno;
+        return -ENOENT;
     
-    fd = sfs_fopen(filename);
+    res = sfs_ftruncate(fd, size);
     sfs_fclose(fd);
+    if (res == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    if (sfs_ftruncate(fi->fh, size) == -1)
+        return -EIO;
+    
     return 0;
 }
 
@@ -160,28 +355,70 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     char filename[MAXFILENAME];
     int fd;
     
+    if (is_stats_path(path))
+        return -EACCES;
+    if (strlen(path) > MAX_FILENAME_LENGTH)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    fd = sfs_open(filename, sfs_open_flags(fp->flags) | OpenCreate);
+    if (fd == -1)
+        return -ENOSPC;
+    
+    /* create may open a file that already exists */
+    if ((fp->flags & O_TRUNC) && (fp->flags & O_ACCMODE) != O_RDONLY && sfs_ftruncate(fd, 0) == -1) {
+        sfs_fclose(fd);
+        return -EIO;
+    }
+    
+    fp->fh = fd;
+    return 0;
+}
+
+static int fuse_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    if (sfs_sync() == -1)
+        return -EIO;
     
-    sfs_fclose(fd);
     return 0;
 }
 
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    /* Writes arrive in requests of up to max_write bytes instead of one page at a time */
+    conn->want |= FUSE_CAP_BIG_WRITES;
+    /* Opens with O_TRUNC truncate in fuse_open rather than through a separate truncate request */
+    conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    sfs_sync();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open, 
+    .release = fuse_release,
     .read = fuse_read, 
+    .read_buf = fuse_read_buf,
     .write = fuse_write, 
+    .write_buf = fuse_write_buf,
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
     mksfs(1);
+    /* SFS is thread-safe: requests are dispatched on several threads unless -s is given */
     return fuse_main(argc, argv, &xmp_oper, NULL);
 }
@@ -13,6 +13,22 @@
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+#define MAXFILENAME (MAX_FILENAME_LENGTH + 1) // SFS names are the FUSE paths, leading '/' included
+#define READ_EXTENTS 16 // pieces of a read_buf reply; the rest of a more fragmented range is read into memory
+
+/* SFS open flags for the access mode of a FUSE open */
+static int sfs_open_flags(int flags)
+{
+    switch (flags & O_ACCMODE) {
+    case O_WRONLY:
+        return OpenWrite;
+    case O_RDWR:
+        return OpenReadWrite;
+    default:
+        return OpenRead;
+    }
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -69,63 +85,137 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     int res;
     char filename[MAXFILENAME];
     
+    if (strlen(path) > MAX_FILENAME_LENGTH)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
-    res = sfs_fopen(filename);
+    /* The SFS descriptor lives as long as the FUSE handle: read and write use it directly */
+    res = sfs_open(filename, sfs_open_flags(fi->flags));
     if (res == -1)
-        return -errno;
+        return -ENOENT;
     
-    sfs_fclose(res);
+    /* O_TRUNC reaches us with the open since fuse_init asks for FUSE_CAP_ATOMIC_O_TRUNC */
+    if ((fi->flags & O_TRUNC) && (fi->flags & O_ACCMODE) != O_RDONLY && sfs_ftruncate(res, 0) == -1) {
+        sfs_fclose(res);
+        return -EIO;
+    }
+    
+    fi->fh = res;
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    sfs_fclose(fi->fh);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
+    /* Positional: requests on the same handle may run on several threads at once */
+    res = sfs_pread(fi->fh, buf, size, offset);
+    if (res == -1)
+        return -EIO;
     
-    strcpy(filename, path);
+    return res;
+}
+
+/* Frees a reply of fuse_read_buf, the way FUSE does once it is sent */
+static void free_bufvec(struct fuse_bufvec *bufv)
+{
+    size_t i;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
+    for (i = 0; i < bufv->count; i++)
+        free(bufv->buf[i].mem);
+    free(bufv);
+}
+
+static int fuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    SfsExtent extents[READ_EXTENTS];
+    struct fuse_bufvec *src;
+    struct fuse_buf *buf;
+    int count, i, res;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    /* Runs of blocks whose bytes are on the disk go out straight from the disk file (spliced when the
+       kernel allows it); only the rest is read into buffers FUSE replies from and frees */
+    count = sfs_pread_extents(fi->fh, size, offset, extents, READ_EXTENTS);
+    if (count == -1)
+        return -EIO;
+    src = calloc(1, sizeof(struct fuse_bufvec) + (count > 1 ? count - 1 : 0) * sizeof(struct fuse_buf));
+    if (src == NULL)
+        return -ENOMEM;
     
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    *src = FUSE_BUFVEC_INIT(0);
+    src->count = count > 0 ? count : 1;
+    for (i = 0; i < count; i++) {
+        buf = &src->buf[i];
+        buf->size = extents[i].length;
+        if (extents[i].diskFd != -1) {
+            buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            buf->fd = extents[i].diskFd;
+            buf->pos = extents[i].diskOffset;
+            offset += extents[i].length;
+            continue;
+        }
+        buf->mem = malloc(extents[i].length);
+        if (buf->mem == NULL) {
+            free_bufvec(src);
+            return -ENOMEM;
+        }
+        res = sfs_pread(fi->fh, buf->mem, extents[i].length, offset);
+        if (res == -1) {
+            free_bufvec(src);
+            return -EIO;
+        }
+        if (res < extents[i].length) {
+            /* The file was truncated in between: the reply ends where it now ends */
+            buf->size = res;
+            src->count = i + 1;
+            break;
+        }
+        offset += extents[i].length;
+    }
     
-    sfs_fclose(fd);
-    return res;
+    *bufp = src;
+    return 0;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
+    res = sfs_pwrite(fi->fh, buf, size, offset);
+    if (res == -1)
+        return -EIO;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    return res;
+}
+
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    int res;
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    /* Data already in memory goes to SFS straight from the request buffer */
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+        return fuse_write(path, buf->buf[0].mem, size, offset, fi);
     
-    sfs_fclose(fd);
+    /* Spliced from a pipe or split in pieces: gathered into one buffer first */
+    dst.buf[0].mem = malloc(size);
+    if (dst.buf[0].mem == NULL)
+        return -ENOMEM;
+    res = fuse_buf_copy(&dst, buf, 0);
+    if (res >= 0)
+        res = fuse_write(path, dst.buf[0].mem, res, offset, fi);
+    free(dst.buf[0].mem);
     return res;
 }
 
@@ -133,15 +223,29 @@ static int fuse_truncate(const char *path, off_t size)
 {
     char filename[MAXFILENAME];
     int fd;
+    int res;
     
+    if (strlen(path) > MAX_FILENAME_LENGTH)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
+    fd = sfs_open(filename, OpenWrite);
     if (fd == -1)
-        return -errno;
+        return -ENOENT;
     
-    fd = sfs_fopen(filename);
+    res = sfs_ftruncate(fd, size);
     sfs_fclose(fd);
+    if (res == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    if (sfs_ftruncate(fi->fh, size) == -1)
+        return -EIO;
+    
     return 0;
 }
 
@@ -160,28 +264,68 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     char filename[MAXFILENAME];
     int fd;
     
+    if (strlen(path) > MAX_FILENAME_LENGTH)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    fd = sfs_open(filename, sfs_open_flags(fp->flags) | OpenCreate);
+    if (fd == -1)
+        return -ENOSPC;
     
-    sfs_fclose(fd);
+    /* create may open a file that already exists */
+    if ((fp->flags & O_TRUNC) && (fp->flags & O_ACCMODE) != O_RDONLY && sfs_ftruncate(fd, 0) == -1) {
+        sfs_fclose(fd);
+        return -EIO;
+    }
+    
+    fp->fh = fd;
     return 0;
 }
 
+static int fuse_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    if (sfs_sync() == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    /* Writes arrive in requests of up to max_write bytes instead of one page at a time */
+    conn->want |= FUSE_CAP_BIG_WRITES;
+    /* Opens with O_TRUNC truncate in fuse_open rather than through a separate truncate request */
+    conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    sfs_sync();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open, 
+    .release = fuse_release,
     .read = fuse_read, 
+    .read_buf = fuse_read_buf,
     .write = fuse_write, 
+    .write_buf = fuse_write_buf,
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
   mksfs(0);
+  /* SFS is thread-safe: requests are dispatched on several threads unless -s is given */
   return fuse_main(argc, argv, &xmp_oper, NULL);
 }
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "disk_emu.h"
+#include "block_cache.h"
+#include "journal.h"
+
+int journalStart = 0; // first block of the journal region
+int journalLength = 0;
+int journalBlockSize = 0;
+int journalCapacity = 0; // block images that fit in one append, with their descriptor and commit block
+int journalPosition = 0; // block of the region the next transaction is appended at
+int journalSequence = 1; // sequence of the running transaction
+int journalOperations = 0; // operations gathered in the running transaction
+int operationCredits = 0; // metadata blocks reserved in the running transaction for every operation in progress
+void (*committedCallback)() = NULL;
+int transactionCount = 0; // block images in the running transaction
+int transactionSize = 0; // images the transaction buffers can hold before they grow
+int *transactionBlocks = NULL; // home block number of every image
+char *transactionImages = NULL;
+int checkpointCount = 0; // committed images not yet written to their home locations, one per block
+int *checkpointBlocks = NULL;
+char *checkpointImages = NULL;
+int checkpointRequired = 0; // a block committed in the region was freed, so the region is reused from its start
+int activeOperations = 0; // operations begun and not yet ended; a transaction is only committed when none are
+int commitRequested = 0; // the running transaction is due, so new operations wait until it is committed
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journalQuiescent = PTHREAD_COND_INITIALIZER; // signalled when a commit is done or the last operation ends
+
+static char *imageOf(char *images, int imageIndex) {
+    return images + (size_t)imageIndex * journalBlockSize;
+}
+
+static int findImage(const int *blocks, int count, int blockNumber) {
+    for (int imageIndex = 0; imageIndex < count; imageIndex++)
+    {
+        if (blocks[imageIndex] == blockNumber) {
+            return imageIndex;
+        }
+    }
+    return -1;
+}
+
+static unsigned int checksumBytes(unsigned int hash, const char *bytes, size_t length) {
+    for (size_t byte = 0; byte < length; byte++) // FNV-1a
+    {
+        hash = (hash ^ (unsigned char)bytes[byte]) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int checksumTransaction(const int *homeBlocks, const char *images, int count) {
+    unsigned int hash = checksumBytes(2166136261u, (const char *)homeBlocks, count * sizeof(int));
+    return checksumBytes(hash, images, (size_t)count * journalBlockSize);
+}
+
+/**
+ * @brief blocks taken by the descriptor of a transaction: its header, then the home block number of every image.
+ */
+static int descriptorBlocks(int count, int blockSize) {
+    return (sizeof(JournalHeader) + count * sizeof(int) + blockSize - 1) / blockSize;
+}
+
+int journal_length_for(int nblocks, int block_size) {
+    return descriptorBlocks(nblocks, block_size) + nblocks + 1;
+}
+
+/**
+ * @brief removes an image from a set of images, moving the last one into its place.
+ */
+static void removeImage(int *blocks, char *images, int *count, int imageIndex) {
+    --*count;
+    blocks[imageIndex] = blocks[*count];
+    memcpy(imageOf(images, imageIndex), imageOf(images, *count), journalBlockSize);
+}
+
+/**
+ * @brief writes the committed images to their home locations, through the block cache, and makes them durable
+ *        along with everything else the cache holds. The region may then be reused from its start.
+ */
+static int checkpointJournal() {
+    void **checkpointBuffers = malloc((checkpointCount + 1) * sizeof(void *));
+    for (int imageIndex = 0; imageIndex < checkpointCount; imageIndex++)
+    {
+        checkpointBuffers[imageIndex] = imageOf(checkpointImages, imageIndex);
+    }
+    int result = checkpointCount > 0 ? cached_write_blocks_v(checkpointBlocks, checkpointCount, checkpointBuffers) : 0;
+    free(checkpointBuffers);
+    if (result < 0 || sync_block_cache() < 0 || sync_disk() != 0) {
+        return -1;
+    }
+    checkpointCount = 0;
+    checkpointRequired = 0;
+    journalPosition = 0;
+    return 0;
+}
+
+/**
+ * @brief appends the running transaction to the journal region at journalPosition: descriptor, images and commit
+ *        block are one run of consecutive blocks, so the whole transaction costs a single vectored write.
+ */
+static int appendTransaction() {
+    int descriptorLength = descriptorBlocks(transactionCount, journalBlockSize);
+    int appendLength = descriptorLength + transactionCount + 1;
+    char *descriptor = calloc(descriptorLength + 1, journalBlockSize); // descriptor blocks followed by the commit block
+    char *commit = descriptor + (size_t)descriptorLength * journalBlockSize;
+    JournalHeader *descriptorHeader = (JournalHeader *)descriptor;
+    JournalHeader *commitHeader = (JournalHeader *)commit;
+    int *journalAddresses = malloc(appendLength * sizeof(int));
+    void **journalBuffers = malloc(appendLength * sizeof(void *));
+
+    descriptorHeader->magic = JOURNAL_MAGIC;
+    descriptorHeader->kind = JournalDescriptor;
+    descriptorHeader->sequence = journalSequence;
+    descriptorHeader->blockCount = transactionCount;
+    memcpy(descriptorHeader + 1, transactionBlocks, transactionCount * sizeof(int));
+    *commitHeader = *descriptorHeader;
+    commitHeader->kind = JournalCommit;
+    commitHeader->checksum = checksumTransaction(transactionBlocks, transactionImages, transactionCount);
+
+    for (int blockIndex = 0; blockIndex < appendLength; blockIndex++)
+    {
+        journalAddresses[blockIndex] = journalStart + journalPosition + blockIndex;
+        if (blockIndex < descriptorLength) {
+            journalBuffers[blockIndex] = imageOf(descriptor, blockIndex);
+        } else if (blockIndex < descriptorLength + transactionCount) {
+            journalBuffers[blockIndex] = imageOf(transactionImages, blockIndex - descriptorLength);
+        } else {
+            journalBuffers[blockIndex] = commit;
+        }
+    }
+    int result = write_blocks_v(journalAddresses, appendLength, journalBuffers) < 0 || sync_disk() != 0 ? -1 : appendLength;
+
+    free(descriptor);
+    free(journalAddresses);
+    free(journalBuffers);
+    return result;
+}
+
+int init_journal(int start_block, int num_blocks, int block_size, int operation_blocks, void (*committed)()) {
+    journalStart = start_block;
+    journalLength = num_blocks;
+    journalBlockSize = block_size;
+    journalCapacity = num_blocks - 2;
+    while (journal_length_for(journalCapacity, block_size) > num_blocks)
+    {
+        --journalCapacity;
+    }
+    operationCredits = operation_blocks < journalCapacity ? operation_blocks : journalCapacity;
+    committedCallback = committed;
+    journalPosition = 0;
+    journalOperations = 0;
+    transactionCount = 0;
+    transactionSize = journalCapacity;
+    checkpointCount = 0;
+    checkpointRequired = 0;
+    transactionBlocks = malloc(transactionSize * sizeof(int));
+    transactionImages = malloc((size_t)transactionSize * block_size);
+    checkpointBlocks = malloc(num_blocks * sizeof(int)); // the region holds fewer images than it has blocks
+    checkpointImages = malloc((size_t)num_blocks * block_size);
+    if (transactionBlocks == NULL || transactionImages == NULL || checkpointBlocks == NULL || checkpointImages == NULL) {
+        free(transactionBlocks);
+        free(transactionImages);
+        free(checkpointBlocks);
+        free(checkpointImages);
+        transactionBlocks = NULL;
+        transactionImages = NULL;
+        checkpointBlocks = NULL;
+        checkpointImages = NULL;
+        printf("ERROR in init_journal: could not allocate the transaction buffers.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief reads the header block of a transaction and checks it could start one that fits the rest of the region.
+ *
+ * A header that does not match its checksum was torn by a crash during its append, so it starts no transaction.
+ */
+static int readTransactionHeader(int position, char *block, JournalHeader *header) {
+    int result = read_blocks(journalStart + position, 1, block);
+    if (result == DISK_CHECKSUM_ERROR) {
+        return 0;
+    }
+    if (result < 0) {
+        return -1;
+    }
+    memcpy(header, block, sizeof(JournalHeader));
+    return header->magic == JOURNAL_MAGIC && header->kind == JournalDescriptor && header->blockCount >= 1 &&
+           header->blockCount <= journalCapacity &&
+           position + journal_length_for(header->blockCount, journalBlockSize) <= journalLength;
+}
+
+int replay_journal() {
+    char *block = malloc(journalBlockSize);
+    JournalHeader header;
+    int replayed = 0;
+
+    // Later transactions get higher sequences than any header left in the region, whole or torn, so a transaction
+    // left over from before the region was last reused never passes for the successor of a newer one. A block torn
+    // from its checksum still holds its old or its new bytes, so its sequence counts too
+    int lastSequence = 0;
+    for (int position = 0; position < journalLength; position++)
+    {
+        int result = read_blocks(journalStart + position, 1, block);
+        if (result < 0 && result != DISK_CHECKSUM_ERROR) {
+            free(block);
+            return -1;
+        }
+        memcpy(&header, block, sizeof(JournalHeader));
+        if (header.magic == JOURNAL_MAGIC && header.sequence > lastSequence) {
+            lastSequence = header.sequence;
+        }
+    }
+
+    // The transactions of the current pass over the region follow each other from its start, one sequence apart
+    int position = 0;
+    int expectedSequence = 0;
+    while (position < journalLength && replayed >= 0)
+    {
+        int headerValid = readTransactionHeader(position, block, &header);
+        if (headerValid < 0) {
+            replayed = -1;
+            break;
+        }
+        if (!headerValid || (position > 0 && header.sequence != expectedSequence)) {
+            break;
+        }
+
+        int count = header.blockCount;
+        int descriptorLength = descriptorBlocks(count, journalBlockSize);
+        int appendLength = descriptorLength + count + 1;
+        char *transaction = malloc((size_t)appendLength * journalBlockSize);
+        int result = read_blocks(journalStart + position, appendLength, transaction);
+        if (result == DISK_CHECKSUM_ERROR) {
+            free(transaction);
+            break; // torn append: a block of the transaction was cut off from its checksum
+        }
+        if (result < 0) {
+            free(transaction);
+            replayed = -1;
+            break;
+        }
+        int *homeBlocks = (int *)(transaction + sizeof(JournalHeader));
+        char *images = imageOf(transaction, descriptorLength);
+        JournalHeader *commitHeader = (JournalHeader *)imageOf(transaction, appendLength - 1);
+        if (commitHeader->magic != JOURNAL_MAGIC || commitHeader->kind != JournalCommit ||
+            commitHeader->sequence != header.sequence || commitHeader->blockCount != count ||
+            commitHeader->checksum != checksumTransaction(homeBlocks, images, count)) {
+            free(transaction);
+            break; // torn append: the transaction was never committed
+        }
+
+        void **imageBuffers = malloc(count * sizeof(void *));
+        for (int imageIndex = 0; imageIndex < count; imageIndex++)
+        {
+            imageBuffers[imageIndex] = imageOf(images, imageIndex);
+        }
+        if (cached_write_blocks_v(homeBlocks, count, imageBuffers) < 0) {
+            replayed = -1;
+        } else {
+            replayed += count;
+        }
+        free(imageBuffers);
+        free(transaction);
+        expectedSequence = header.sequence + 1;
+        position += appendLength;
+    }
+    free(block);
+
+    // Every committed block is home now, so the next transaction starts a new pass at the start of the region
+    if (replayed > 0 && (sync_block_cache() < 0 || sync_disk() != 0)) {
+        replayed = -1;
+    }
+    journalSequence = lastSequence + 1;
+    journalPosition = 0;
+    return replayed;
+}
+
+static int logImages(int *block_addresses, int nblocks, void **buffers) {
+    if (transactionImages == NULL) {
+        return cached_write_blocks_v(block_addresses, nblocks, buffers);
+    }
+
+    for (int blockIndex = 0; blockIndex < nblocks; blockIndex++)
+    {
+        int imageIndex = findImage(transactionBlocks, transactionCount, block_addresses[blockIndex]);
+        if (imageIndex < 0) {
+            if (transactionCount == transactionSize) { // only when an operation logs more than it was given room for
+                int *grownBlocks = realloc(transactionBlocks, 2 * transactionSize * sizeof(int));
+                if (grownBlocks == NULL) {
+                    return -1;
+                }
+                transactionBlocks = grownBlocks;
+                char *grownImages = realloc(transactionImages, 2 * (size_t)transactionSize * journalBlockSize);
+                if (grownImages == NULL) {
+                    return -1;
+                }
+                transactionImages = grownImages;
+                transactionSize *= 2;
+            }
+            imageIndex = transactionCount++;
+            transactionBlocks[imageIndex] = block_addresses[blockIndex];
+        }
+        memcpy(imageOf(transactionImages, imageIndex), buffers[blockIndex], journalBlockSize);
+    }
+    return nblocks;
+}
+
+int journal_write_blocks_v(int *block_addresses, int nblocks, void **buffers) {
+    pthread_mutex_lock(&journalLock);
+    int result = logImages(block_addresses, nblocks, buffers);
+    pthread_mutex_unlock(&journalLock);
+    return result;
+}
+
+int journal_read_block(int block_address, void *buffer) {
+    pthread_mutex_lock(&journalLock);
+    char *image = NULL;
+    int imageIndex = transactionImages != NULL ? findImage(transactionBlocks, transactionCount, block_address) : -1;
+    if (imageIndex >= 0) {
+        image = imageOf(transactionImages, imageIndex);
+    } else if (transactionImages != NULL && (imageIndex = findImage(checkpointBlocks, checkpointCount, block_address)) >= 0) {
+        image = imageOf(checkpointImages, imageIndex); // committed, and newer than the block's home location
+    }
+    if (image != NULL) {
+        memcpy(buffer, image, journalBlockSize);
+    }
+    pthread_mutex_unlock(&journalLock);
+    return image != NULL;
+}
+
+void journal_forget_block(int block_address) {
+    pthread_mutex_lock(&journalLock);
+    if (transactionImages != NULL) {
+        int imageIndex = findImage(transactionBlocks, transactionCount, block_address);
+        if (imageIndex >= 0) {
+            removeImage(transactionBlocks, transactionImages, &transactionCount, imageIndex);
+        }
+        imageIndex = findImage(checkpointBlocks, checkpointCount, block_address);
+        if (imageIndex >= 0) {
+            removeImage(checkpointBlocks, checkpointImages, &checkpointCount, imageIndex);
+            checkpointRequired = 1; // the region still holds the image, and a replay would write it back
+        }
+    }
+    pthread_mutex_unlock(&journalLock);
+}
+
+static int commitTransaction() {
+    if (transactionImages == NULL || transactionCount == 0) {
+        journalOperations = 0;
+        if (committedCallback != NULL) {
+            committedCallback();
+        }
+        return 0;
+    }
+    if (transactionCount > journalCapacity) {
+        printf("ERROR in commit_journal: the transaction holds %d blocks, more than the %d the journal holds.\n",
+               transactionCount, journalCapacity);
+        return -1;
+    }
+
+    // Ordered mode: file data reaches the disk before the metadata that makes it part of a file. Once the region is
+    // full, the committed images go home with it, and the transaction starts the next pass over the region
+    int appendLength = journal_length_for(transactionCount, journalBlockSize);
+    int reuseRegion = checkpointRequired || journalPosition + appendLength > journalLength;
+    if ((reuseRegion && checkpointJournal() < 0) || (!reuseRegion && (sync_block_cache() < 0 || sync_disk() != 0)) ||
+        appendTransaction() < 0) {
+        printf("ERROR in commit_journal: could not write the transaction to the disk.\n");
+        return -1;
+    }
+    journalPosition += appendLength;
+    ++journalSequence;
+
+    // The images stay in memory until the next checkpoint instead of being written home by every commit
+    for (int imageIndex = 0; imageIndex < transactionCount; imageIndex++)
+    {
+        int checkpointIndex = findImage(checkpointBlocks, checkpointCount, transactionBlocks[imageIndex]);
+        if (checkpointIndex < 0) {
+            checkpointIndex = checkpointCount++;
+            checkpointBlocks[checkpointIndex] = transactionBlocks[imageIndex];
+        }
+        memcpy(imageOf(checkpointImages, checkpointIndex), imageOf(transactionImages, imageIndex), journalBlockSize);
+    }
+    int committed = transactionCount;
+    transactionCount = 0;
+    journalOperations = 0;
+    if (committedCallback != NULL) {
+        committedCallback();
+    }
+    return committed;
+}
+
+/**
+ * @brief whether the running transaction keeps room for one more operation besides those in progress.
+ */
+static int roomForOperation() {
+    return transactionImages == NULL || transactionCount + (activeOperations + 1) * operationCredits <= journalCapacity;
+}
+
+int journal_begin_operation() {
+    pthread_mutex_lock(&journalLock);
+    while (commitRequested || !roomForOperation())
+    {
+        if (!commitRequested && activeOperations == 0) {
+            if (commitTransaction() < 0) {
+                pthread_mutex_unlock(&journalLock); // the transaction stays full: the operation must not log into it
+                return -1;
+            }
+            continue;
+        }
+        commitRequested = 1; // the last operation in progress commits, and makes room
+        pthread_cond_wait(&journalQuiescent, &journalLock);
+    }
+    ++activeOperations;
+    pthread_mutex_unlock(&journalLock);
+    return 0;
+}
+
+int journal_end_operation() {
+    int result = 0;
+    pthread_mutex_lock(&journalLock);
+    --activeOperations;
+    if (transactionImages != NULL && (++journalOperations >= JOURNAL_GROUP_OPERATIONS ||
+                                      transactionCount + operationCredits > journalCapacity)) {
+        commitRequested = 1;
+    }
+    // The last operation out commits: the images logged by operations that were still running are complete by now
+    if (commitRequested && activeOperations == 0) {
+        result = commitTransaction() < 0 ? -1 : 0;
+        commitRequested = 0;
+    }
+    pthread_cond_broadcast(&journalQuiescent);
+    pthread_mutex_unlock(&journalLock);
+    return result;
+}
+
+int commit_journal() {
+    pthread_mutex_lock(&journalLock);
+    commitRequested = 1;
+    while (activeOperations > 0)
+    {
+        pthread_cond_wait(&journalQuiescent, &journalLock);
+    }
+    int committed = commitTransaction();
+    commitRequested = 0;
+    pthread_cond_broadcast(&journalQuiescent);
+    pthread_mutex_unlock(&journalLock);
+    return committed;
+}
+
+int close_journal() {
+    int committed = commit_journal();
+    pthread_mutex_lock(&journalLock);
+    if (committed >= 0 && transactionImages != NULL && checkpointJournal() < 0) {
+        committed = -1;
+    }
+    free(transactionBlocks);
+    free(transactionImages);
+    free(checkpointBlocks);
+    free(checkpointImages);
+    transactionBlocks = NULL;
+    transactionImages = NULL;
+    checkpointBlocks = NULL;
+    checkpointImages = NULL;
+    transactionSize = 0;
+    checkpointCount = 0;
+    pthread_mutex_unlock(&journalLock);
+    return committed;
+}
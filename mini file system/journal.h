@@ -0,0 +1,139 @@
+/**
+ * @author Zhanna Klimanova (zhanna.klimanova@mail.mcgill.ca)
+ * @brief write-ahead journal for the metadata blocks of the Simple File System (SFS). Metadata blocks modified
+ *        by several operations are gathered in one transaction, appended to the journal region with a single
+ *        sequential write, and kept in memory until the region is full; only then are they copied to their home
+ *        locations (checkpoint) and the region reused from its start. Every function takes the journal lock; a
+ *        transaction is only committed once no operation is in progress.
+ * @version disko
+ * @date 2022-12-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_MAGIC 0x4A524E4C // "JRNL"
+#define JOURNAL_MIN_BLOCKS 8 // descriptor, commit block and at least a few block images
+#define JOURNAL_MAX_BLOCKS 1024
+#define JOURNAL_GROUP_OPERATIONS 16 // operations gathered in one transaction before it is committed
+
+enum JournalBlockKind {JournalDescriptor = 1, JournalCommit = 2};
+
+/**
+ * @brief start of the descriptor (followed by the home block number of every image, over as many blocks as they
+ *        take) and of the commit block of a transaction. A transaction is only replayed if both carry the same
+ *        sequence, the sequence follows the one of the transaction before it in the region, and the commit
+ *        block's checksum matches the home block numbers and the images, so a torn append is ignored.
+ *
+ */
+typedef struct JournalHeader_t {
+    int magic;
+    int kind; // JournalDescriptor or JournalCommit
+    int sequence;
+    int blockCount; // block images in the transaction
+    unsigned int checksum; // of the home block numbers and the block images, in the commit block
+} JournalHeader;
+
+/**
+ * @brief journal region length that holds a transaction of the given number of block images.
+ *
+ * @param nblocks
+ * @param block_size
+ * @return int
+ */
+int journal_length_for(int nblocks, int block_size);
+
+/**
+ * @brief sets up the journal region [start_block, start_block + num_blocks) of a disk with the given block size.
+ *        Until it is called, metadata writes pass straight through to the block cache.
+ *
+ * @param start_block
+ * @param num_blocks
+ * @param block_size
+ * @param operation_blocks most metadata blocks one operation may log; room for them is kept for every operation
+ *        in progress, so a transaction never outgrows the journal
+ * @param committed called after every commit, with no operation in progress; the blocks freed by the committed
+ *        transaction may then be reused
+ * @return int 0 on success, -1 if the transaction buffers could not be allocated
+ */
+int init_journal(int start_block, int num_blocks, int block_size, int operation_blocks, void (*committed)());
+
+/**
+ * @brief copies the committed transactions found in the journal region to the home locations of their blocks, in
+ *        the order they were committed. Called when an existing disk is mounted, before its metadata is read.
+ *        Replaying a transaction that was already checkpointed is harmless: its blocks are rewritten with the same
+ *        contents.
+ *
+ * @return int number of blocks replayed, -1 on error
+ */
+int replay_journal();
+
+/**
+ * @brief adds metadata blocks to the running transaction, replacing any older image of the same block. The blocks
+ *        reach the disk when the transaction is committed.
+ *
+ * @param block_addresses
+ * @param nblocks
+ * @param buffers
+ * @return int number of blocks logged, -1 on error
+ */
+int journal_write_blocks_v(int *block_addresses, int nblocks, void **buffers);
+
+/**
+ * @brief copies the running transaction's image of a block, which is newer than the block's home location.
+ *
+ * @param block_address
+ * @param buffer
+ * @return int 1 if the transaction holds the block, 0 otherwise
+ */
+int journal_read_block(int block_address, void *buffer);
+
+/**
+ * @brief drops the images of a block that is being freed, so they are not written over the block's next owner.
+ *        If the block was already committed in the journal region, the region is checkpointed and reused from
+ *        its start at the next commit, so a replay never brings the old image back either.
+ *
+ * @param block_address
+ */
+void journal_forget_block(int block_address);
+
+/**
+ * @brief marks the start of a file system operation that modifies metadata. Waits while a commit is pending, or
+ *        while the running transaction has no room left for the operation, so it must be called before the
+ *        operation takes any other lock. If the transaction can neither be committed nor has room, the operation
+ *        must not go ahead: its blocks would never fit in the journal.
+ *
+ * @return int 0 on success, -1 if the transaction could not be committed to make room for the operation
+ */
+int journal_begin_operation();
+
+/**
+ * @brief marks the end of a file system operation; every JOURNAL_GROUP_OPERATIONS operations, or once the
+ *        transaction has no room left for another operation, the transaction is due and the last operation still
+ *        in progress commits it. Transactions only ever end between operations, so an operation is either entirely
+ *        replayed after a crash or not at all.
+ *
+ * @return int 0 on success, -1 on error
+ */
+int journal_end_operation();
+
+/**
+ * @brief waits for the operations in progress to end, then commits the running transaction: the data blocks in
+ *        the block cache are written first, then the transaction is appended to the journal with one sequential
+ *        write. A transaction larger than the journal is rejected and nothing is written.
+ *
+ * @return int number of metadata blocks committed, -1 on error
+ */
+int commit_journal();
+
+/**
+ * @brief commits the running transaction, checkpoints the journal and releases it.
+ *
+ * @return int
+ */
+int close_journal();
+
+#endif
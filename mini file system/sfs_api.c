@@ -1,429 +1,2738 @@
 #include "sfs_api.h"
 
-SuperBlock superBlockCache; // in-memory cache for the super block
-iNodesTable iNodesTableCache; // in-memory cache for the i-Node table
-Block freeBlockListCache; // in-memory cache for the free bitmap/blocklist
+SuperBlock superBlockCache; // in-memory cache for the super block; holds the geometry of the mounted file system
+iNodesTable *iNodesTableCache = NULL; // in-memory cache for the i-Node table
+uint64_t *freeBlockListCache = NULL; // in-memory cache for the free bitmap/blocklist, one bit per block
+uint64_t *releasedBlockList = NULL; // free blocks freed by the running transaction, not handed out until it commits
 OpenFileDescriptorTable openFDTCache; // in-memory cache for the open file descriptor table
-struct { // in-memory cache for all the root directory entries/files
-    DirectoryEntry directoryEntries[TOTAL_FILES];
-    int location; // pointer to the location of a file on device (mentioned in textbook pg 530)
-} rootDirectoryCache;
+RootDirectory *rootDirectoryCache = NULL; // in-memory cache for all the root directory entries/files
+char *iNodeTableDirtyBlocks = NULL; // i-Node table blocks modified since the last metadata flush
+char *rootDirectoryDirtyBlocks = NULL; // root directory blocks modified since the last metadata flush
+char *freeBlockListDirtyBlocks = NULL; // free block list blocks modified since the last metadata flush
+char *freeBlockListImage = NULL; // copy of the dirty free block list blocks being logged, under metadataLock
+int *directoryIndexBuckets = NULL; // hash table from filename to the first directory slot of its chain
+int *directoryIndexChain = NULL; // next directory slot in the same hash bucket chain
+int directoryIndexMask = 0;
+uint64_t *freeSlotMap = NULL; // one bit per root directory slot (and i-Node), set while the slot is free
+IndirectCacheEntry *indirectCache = NULL; // indirect and extent blocks used by the block mapping code
+int *blockReferences = NULL; // references to each data block beyond the first, held by the files sharing it
+int *dedupBuckets = NULL; // hash table from block contents to the first indexed data block of its chain (dedupEnabled)
+int *dedupChain = NULL; // next indexed data block in the same hash bucket chain
+uint64_t *dedupHashes = NULL; // content hash of each indexed data block, 0 while the block is not indexed
+int dedupMask = 0;
+char superBlockDirty = 0; // the in-memory super block was modified since the last metadata flush
+int freeBlockCount = 0; // number of bits set in the free block list
+int releasedBlockCount = 0; // number of bits set in the released block list
+int nextFitCursor = 0; // block after the last one handed out; the next search starts there
+int cacheBudget = BLOCK_CACHE_BUDGET; // memory budget (bytes) of the block cache created by mksfs
+int scrubRate = SCRUB_BLOCKS_PER_SECOND; // blocks per second checked by the disk scrubber once mounted
+int dedupSetting = SFS_DEDUP; // whether the next mksfs shares data blocks holding the same bytes
+int dedupEnabled = 0; // dedupSetting as of the last mksfs, which built the dedup index for it
+int diskMounted = 0;
+SfsStats statistics; // runtime counters, updated with relaxed atomic adds; the block cache and disk emulator keep their own
+int allocatorScanWords = 0; // free block list words inspected by the running allocator search (under allocatorLock)
+
+// Locks, always taken in this order: journal_begin_operation, directoryLock, an i-Node lock, metadataLock, allocatorLock.
+// descriptorLock is never held while another lock is taken. The journal lock comes after metadataLock, but before
+// allocatorLock: a commit hands the blocks freed by its transaction back to the allocator.
+pthread_rwlock_t directoryLock = PTHREAD_RWLOCK_INITIALIZER; // root directory entries, filename index and listing cursor
+pthread_rwlock_t *iNodeLocks = NULL; // one per i-Node: readers of a file share it, writing or removing the file holds it alone
+int iNodeLockCount = 0;
+pthread_mutex_t metadataLock = PTHREAD_MUTEX_INITIALIZER; // indirect cache, i-Node table and root directory updates, their dirty maps, the free slot map, block references and the dedup index
+pthread_mutex_t allocatorLock = PTHREAD_MUTEX_INITIALIZER; // free and released block lists, free block list dirty map, their counts and next fit cursor
+pthread_mutex_t descriptorLock = PTHREAD_MUTEX_INITIALIZER; // open file table free list, i-Node open counts and descriptor bindings
+
+static void countStat(long long *counter, long long amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static double statsClockUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/**
+ * @brief counts a call of an API function and adds its latency to the operation's histogram.
+ */
+static void recordOperation(enum StatsOperation operation, double startUs) {
+    long long latency = (long long)(statsClockUs() - startUs);
+    int bucket = 0;
+    while (bucket < STATS_LATENCY_BUCKETS - 1 && latency >= (1LL << bucket))
+    {
+        ++bucket;
+    }
+    countStat(&statistics.calls[operation], 1);
+    countStat(&statistics.latencyUs[operation], latency);
+    countStat(&statistics.latencyHistogram[operation][bucket], 1);
+}
+
+/**
+ * @brief counts an allocator search once it has handed out its blocks. Called with allocatorLock held.
+ */
+static void recordAllocatorScan() {
+    countStat(&statistics.allocations, 1);
+    countStat(&statistics.allocatorWordsScanned, allocatorScanWords);
+    if (allocatorScanWords > __atomic_load_n(&statistics.allocatorLongestScan, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&statistics.allocatorLongestScan, allocatorScanWords, __ATOMIC_RELAXED);
+    }
+    allocatorScanWords = 0;
+}
+
+/**
+ * @brief marks the blocks of an in-memory metadata structure that hold the bytes [offset, offset + length).
+ */
+static void markDirty(char *dirtyBlocks, size_t offset, size_t length) {
+    for (size_t block = offset / superBlockCache.blockSize; block <= (offset + length - 1) / superBlockCache.blockSize; block++)
+    {
+        dirtyBlocks[block] = 1;
+    }
+}
+
+static void markINodeDirty(int iNodeIndex) {
+    markDirty(iNodeTableDirtyBlocks, offsetof(iNodesTable, iNodes) + iNodeIndex * sizeof(iNode), sizeof(iNode));
+}
+
+static void markDirectoryEntryDirty(int fileIndex) {
+    markDirty(rootDirectoryDirtyBlocks, offsetof(RootDirectory, directoryEntries) + fileIndex * sizeof(DirectoryEntry), sizeof(DirectoryEntry));
+}
+
+/**
+ * @brief writes the dirty blocks of an in-memory metadata structure to its on-disk location with a single
+ *        request, straight from the structure. Only a last block that is partly past the end of the structure
+ *        goes through a zero-padded copy.
+ */
+static void flushDirtyBlocks(int diskAddress, void *structure, size_t structureSize, char *dirtyBlocks, int numBlocks,
+                             enum StatsBlockPurpose purpose) {
+    int blockSize = superBlockCache.blockSize;
+    int blockNumbers[numBlocks];
+    void *blockBuffers[numBlocks];
+    int blocksToWrite = 0;
+    char lastBlock[blockSize];
+
+    for (int block = 0; block < numBlocks; block++)
+    {
+        if (!dirtyBlocks[block]) {
+            continue;
+        }
+        dirtyBlocks[block] = 0;
+        blockNumbers[blocksToWrite] = diskAddress + block;
+        if ((block + 1) * (size_t)blockSize <= structureSize) {
+            blockBuffers[blocksToWrite] = (char *)structure + (size_t)block * blockSize;
+        } else {
+            memset(lastBlock, 0, blockSize);
+            memcpy(lastBlock, (char *)structure + (size_t)block * blockSize, structureSize - (size_t)block * blockSize);
+            blockBuffers[blocksToWrite] = lastBlock;
+        }
+        ++blocksToWrite;
+    }
+    if (blocksToWrite > 0) {
+        journal_write_blocks_v(blockNumbers, blocksToWrite, blockBuffers);
+        countStat(&statistics.blockWrites[purpose], blocksToWrite);
+    }
+}
+
+/**
+ * @brief reads an in-memory metadata structure back from its on-disk location without overrunning it.
+ */
+static void readMetadata(int diskAddress, void *structure, size_t structureSize, enum StatsBlockPurpose purpose) {
+    int blockSize = superBlockCache.blockSize;
+    int fullBlocks = structureSize / blockSize;
+    char lastBlock[blockSize];
+
+    countStat(&statistics.blockReads[purpose], (structureSize + blockSize - 1) / blockSize);
+    cached_read_blocks(diskAddress, fullBlocks, structure);
+    if (structureSize % blockSize != 0) {
+        cached_read_blocks(diskAddress + fullBlocks, 1, lastBlock);
+        memcpy((char *)structure + (size_t)fullBlocks * blockSize, lastBlock, structureSize % blockSize);
+    }
+}
+
+/**
+ * @brief returns the in-memory copy of an indirect or extent block, loading it (or, for a block that was just
+ *        allocated, initializing every pointer as unused) in place of whatever shared its slot. The entry is only
+ *        valid until the next call; the caller sets its dirty flag after modifying it.
+ */
+static IndirectCacheEntry *indirectBlock(int blockNumber, int freshBlock) {
+    IndirectCacheEntry *entry = &indirectCache[blockNumber % INDIRECT_CACHE_ENTRIES];
+    if (entry->blockNumber == blockNumber) {
+        countStat(&statistics.indirectCacheHits, 1);
+        return entry;
+    }
+    countStat(&statistics.indirectCacheMisses, 1);
+    if (entry->blockNumber != CACHE_EMPTY_SLOT && entry->dirty) {
+        journal_write_blocks_v(&entry->blockNumber, 1, (void **)&entry->pointers);
+        countStat(&statistics.blockWrites[StatsIndirect], 1);
+    }
+    entry->blockNumber = blockNumber;
+    entry->dirty = freshBlock;
+    if (freshBlock) {
+        memset(entry->pointers, 0xFF, superBlockCache.blockSize); // every pointer is INITIALIZATION_VALUE
+    } else if (!journal_read_block(blockNumber, entry->pointers)) { // the running transaction has the newest copy
+        cached_read_blocks(blockNumber, 1, entry->pointers);
+        countStat(&statistics.blockReads[StatsIndirect], 1);
+    }
+    return entry;
+}
+
+/**
+ * @brief drops the in-memory copy of an indirect or extent block that is being freed, so it is never written
+ *        over the block's next owner.
+ */
+static void forgetIndirectBlock(int blockNumber) {
+    if (blockNumber < 0) {
+        return;
+    }
+    IndirectCacheEntry *entry = &indirectCache[blockNumber % INDIRECT_CACHE_ENTRIES];
+    if (entry->blockNumber == blockNumber) {
+        entry->blockNumber = CACHE_EMPTY_SLOT;
+        entry->dirty = 0;
+    }
+    journal_forget_block(blockNumber);
+}
+
+static void flushIndirectBlocks() {
+    for (int entryIndex = 0; indirectCache != NULL && entryIndex < INDIRECT_CACHE_ENTRIES; entryIndex++)
+    {
+        if (indirectCache[entryIndex].blockNumber != CACHE_EMPTY_SLOT && indirectCache[entryIndex].dirty) {
+            journal_write_blocks_v(&indirectCache[entryIndex].blockNumber, 1, (void **)&indirectCache[entryIndex].pointers);
+            countStat(&statistics.blockWrites[StatsIndirect], 1);
+            indirectCache[entryIndex].dirty = 0;
+        }
+    }
+}
+
+/**
+ * @brief extends the initialized part of the i-Node table over its dirty blocks, so the flush never writes past it.
+ *        The free i-Nodes in between are written too, and the new length is logged with the super block in the
+ *        same transaction as the i-Nodes. Called with metadataLock held.
+ */
+static void extendINodeTableInitialized() {
+    int initialized = superBlockCache.iNodeTableInitialized;
+    int lastDirty = superBlockCache.iNodeTableLength - 1;
+    while (lastDirty >= initialized && !iNodeTableDirtyBlocks[lastDirty])
+    {
+        --lastDirty;
+    }
+    if (lastDirty < initialized) {
+        return;
+    }
+    memset(iNodeTableDirtyBlocks + initialized, 1, lastDirty + 1 - initialized);
+    superBlockCache.iNodeTableInitialized = lastDirty + 1;
+    superBlockDirty = 1;
+}
+
+/**
+ * @brief logs the indirect, super block, i-Node table, root directory and free block list blocks modified by the current
+ *        operation in the journal; a single-file metadata update costs one block per structure it touched.
+ *        Called with metadataLock held.
+ */
+static void flushMetadata() {
+    // The in-memory structures span whole blocks, so every dirty block is written straight from memory
+    size_t blockSize = superBlockCache.blockSize;
+    flushIndirectBlocks();
+    extendINodeTableInitialized();
+    flushDirtyBlocks(SuperBlockIndex, &superBlockCache, sizeof(SuperBlock), &superBlockDirty, 1, StatsSuperBlock);
+    flushDirtyBlocks(superBlockCache.iNodeTableStart, iNodesTableCache, superBlockCache.iNodeTableLength * blockSize,
+                     iNodeTableDirtyBlocks, superBlockCache.iNodeTableLength, StatsINodeTable);
+    flushDirtyBlocks(superBlockCache.rootDirectoryStart, rootDirectoryCache, superBlockCache.rootDirectoryLength * blockSize,
+                     rootDirectoryDirtyBlocks, superBlockCache.rootDirectoryLength, StatsDirectory);
+
+    // The dirty free block list blocks are copied under allocatorLock and logged once it is released, since a commit
+    // takes allocatorLock inside the journal lock
+    int freeListBlocks = superBlockCache.freeBlockListLength;
+    char freeListDirty[freeListBlocks];
+    int dirtyCount = 0;
+    pthread_mutex_lock(&allocatorLock);
+    memcpy(freeListDirty, freeBlockListDirtyBlocks, freeListBlocks);
+    memset(freeBlockListDirtyBlocks, 0, freeListBlocks);
+    for (int block = 0; block < freeListBlocks; block++)
+    {
+        if (freeListDirty[block]) {
+            memcpy(freeBlockListImage + block * blockSize, (char *)freeBlockListCache + block * blockSize, blockSize);
+            ++dirtyCount;
+        }
+    }
+    pthread_mutex_unlock(&allocatorLock);
+    if (dirtyCount > 0) {
+        flushDirtyBlocks(superBlockCache.freeBlockListStart, freeBlockListImage, freeListBlocks * blockSize, freeListDirty,
+                         freeListBlocks, StatsBitmap);
+    }
+}
+
+static int filenameBucket(const char *filename) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int character = 0; character < MAX_FILENAME_LENGTH && filename[character] != EMPTY_STRING; character++)
+    {
+        hash = (hash ^ (unsigned char)filename[character]) * 16777619u;
+    }
+    return hash & directoryIndexMask;
+}
+
+static void indexDirectoryEntry(int fileIndex) {
+    int bucket = filenameBucket(rootDirectoryCache->directoryEntries[fileIndex].filename);
+    directoryIndexChain[fileIndex] = directoryIndexBuckets[bucket];
+    directoryIndexBuckets[bucket] = fileIndex;
+}
+
+static void unindexDirectoryEntry(int fileIndex) {
+    int *link = &directoryIndexBuckets[filenameBucket(rootDirectoryCache->directoryEntries[fileIndex].filename)];
+    while (*link != fileIndex)
+    {
+        link = &directoryIndexChain[*link];
+    }
+    *link = directoryIndexChain[fileIndex];
+}
+
+/**
+ * @brief rebuilds the in-memory filename index and the free slot map from the root directory; done once per mount.
+ */
+static void buildDirectoryIndex() {
+    for (int bucket = 0; bucket <= directoryIndexMask; bucket++)
+    {
+        directoryIndexBuckets[bucket] = DIRECTORY_INDEX_END;
+    }
+    memset(freeSlotMap, 0, (superBlockCache.iNodeCount + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(uint64_t));
+    for (int fileIndex = 0; fileIndex < superBlockCache.iNodeCount; fileIndex++)
+    {
+        if (rootDirectoryCache->directoryEntries[fileIndex].filename[0] != EMPTY_STRING) {
+            indexDirectoryEntry(fileIndex);
+        } else {
+            freeSlotMap[fileIndex / BITS_PER_WORD] |= 1ULL << (fileIndex % BITS_PER_WORD);
+        }
+    }
+}
+
+/**
+ * @brief takes the lowest free directory slot, so files are listed in the order they were created. Called with
+ *        metadataLock held.
+ *
+ * @return int directory slot, or DIRECTORY_INDEX_END if the root directory is full
+ */
+static int takeFreeSlot() {
+    for (int wordIndex = 0; wordIndex < (superBlockCache.iNodeCount + BITS_PER_WORD - 1) / BITS_PER_WORD; wordIndex++)
+    {
+        if (freeSlotMap[wordIndex] != 0) {
+            int fileIndex = wordIndex * BITS_PER_WORD + __builtin_ctzll(freeSlotMap[wordIndex]);
+            freeSlotMap[wordIndex] &= freeSlotMap[wordIndex] - 1;
+            return fileIndex;
+        }
+    }
+    return DIRECTORY_INDEX_END;
+}
+
+static void returnFreeSlot(int fileIndex) {
+    freeSlotMap[fileIndex / BITS_PER_WORD] |= 1ULL << (fileIndex % BITS_PER_WORD);
+}
+
+/**
+ * @brief finds the directory slot (and i-Node) of a file by name through the filename index.
+ *
+ * @return int directory slot, or DIRECTORY_INDEX_END if no file has this name
+ */
+static int lookupFile(const char *filename) {
+    int fileIndex = directoryIndexBuckets[filenameBucket(filename)];
+    while (fileIndex != DIRECTORY_INDEX_END)
+    {
+        if (strncmp(rootDirectoryCache->directoryEntries[fileIndex].filename, filename, MAX_FILENAME_LENGTH) == 0) {
+            return fileIndex;
+        }
+        fileIndex = directoryIndexChain[fileIndex];
+    }
+    return DIRECTORY_INDEX_END;
+}
+
+static void setBlockState(int blockNumber, enum BlockUtilizationState state) {
+    uint64_t bit = (uint64_t)1 << (blockNumber % BITS_PER_WORD);
+    if (state == FreeBlock) {
+        freeBlockListCache[blockNumber / BITS_PER_WORD] |= bit;
+    } else {
+        freeBlockListCache[blockNumber / BITS_PER_WORD] &= ~bit;
+    }
+    markDirty(freeBlockListDirtyBlocks, (blockNumber / BITS_PER_WORD) * sizeof(uint64_t), sizeof(uint64_t));
+}
+
+/**
+ * @brief 64 bits of the free block list, without the blocks freed by the running transaction: until it commits, a
+ *        crash brings back the files that held them, so their data must not be overwritten.
+ */
+static uint64_t allocatableBlocks(int wordIndex) {
+    return freeBlockListCache[wordIndex] & ~releasedBlockList[wordIndex];
+}
+
+/**
+ * @brief finds the first allocatable block in [fromBlock, endBlock), 64 blocks at a time. Returns -1 if there is none.
+ */
+static int nextFreeBlock(int fromBlock, int endBlock) {
+    if (fromBlock >= endBlock) {
+        return -1;
+    }
+    int wordIndex = fromBlock / BITS_PER_WORD;
+    uint64_t word = allocatableBlocks(wordIndex) & (~(uint64_t)0 << (fromBlock % BITS_PER_WORD)); // skip the blocks before fromBlock
+    ++allocatorScanWords;
+    while (word == 0)
+    {
+        if (++wordIndex * BITS_PER_WORD >= endBlock) {
+            return -1;
+        }
+        word = allocatableBlocks(wordIndex);
+        ++allocatorScanWords;
+    }
+    int blockNumber = wordIndex * BITS_PER_WORD + __builtin_ctzll(word);
+    return blockNumber < endBlock ? blockNumber : -1;
+}
+
+/**
+ * @brief finds the first free block at or after the given block, wrapping around to the start of the
+ *        disk. The caller makes sure there is at least one free block.
+ */
+static int findFreeBlock(int fromBlock) {
+    int blockNumber = nextFreeBlock(fromBlock, superBlockCache.fileSystemSize);
+    return blockNumber >= 0 ? blockNumber : nextFreeBlock(0, fromBlock);
+}
+
+/**
+ * @brief counts the allocatable blocks starting at startBlock, up to maxLength, a word at a time.
+ */
+static int freeRunLength(int startBlock, int maxLength) {
+    int length = 0;
+    while (length < maxLength && startBlock + length < superBlockCache.fileSystemSize)
+    {
+        int block = startBlock + length;
+        uint64_t occupied = ~(allocatableBlocks(block / BITS_PER_WORD) >> (block % BITS_PER_WORD));
+        ++allocatorScanWords;
+        int freeBits = occupied == 0 ? BITS_PER_WORD : __builtin_ctzll(occupied);
+        if (freeBits == 0) {
+            break;
+        }
+        length += freeBits;
+    }
+    return length < maxLength ? length : maxLength;
+}
+
+/**
+ * @brief finds a run of numBlocks contiguous free blocks, searching from fromBlock to the end of the disk
+ *        and then from the start. Returns -1 if the free space is too fragmented.
+ */
+static int findFreeRun(int fromBlock, int numBlocks) {
+    int passStart[2] = {fromBlock, 0};
+    int passEnd[2] = {superBlockCache.fileSystemSize, fromBlock};
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int runStart = nextFreeBlock(passStart[pass], passEnd[pass]);
+        while (runStart >= 0)
+        {
+            int runLength = freeRunLength(runStart, numBlocks);
+            if (runLength >= numBlocks) {
+                return runStart;
+            }
+            runStart = nextFreeBlock(runStart + runLength, passEnd[pass]); // the run is too short, skip it
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief marks blocks that hold on-disk metadata as occupied so they are never handed out as data blocks.
+ */
+static void reserveBlocks(int firstBlock, int numBlocks) {
+    for (int block = firstBlock; block < firstBlock + numBlocks; block++)
+    {
+        setBlockState(block, OccupiedBlock);
+    }
+}
+
+static int allocateScattered(int numBlocks, int *blockNumbers) {
+    if (numBlocks > freeBlockCount - releasedBlockCount) {
+        printf("ERROR: there are no more free blocks left to allocate.\n");
+        return allocateBlockError;
+    }
+
+    // Next fit: consecutive requests get consecutive blocks while the free space after the cursor is contiguous
+    for (int blockIndex = 0; blockIndex < numBlocks; blockIndex++)
+    {
+        blockNumbers[blockIndex] = findFreeBlock(nextFitCursor);
+        setBlockState(blockNumbers[blockIndex], OccupiedBlock); // written once by flushMetadata at the end of the operation
+        nextFitCursor = (blockNumbers[blockIndex] + 1) % superBlockCache.fileSystemSize;
+    }
+    freeBlockCount -= numBlocks;
+    recordAllocatorScan();
+    return numBlocks;
+}
+
+int allocateBlocks(int numBlocks, int *blockNumbers) {
+    pthread_mutex_lock(&allocatorLock);
+    int result = allocateScattered(numBlocks, blockNumbers);
+    pthread_mutex_unlock(&allocatorLock);
+    return result;
+}
+
+int allocateRun(int goalBlock, int numBlocks, int *blockNumbers) {
+    pthread_mutex_lock(&allocatorLock);
+    if (numBlocks > freeBlockCount - releasedBlockCount) {
+        pthread_mutex_unlock(&allocatorLock);
+        printf("ERROR: there are no more free blocks left to allocate.\n");
+        return allocateBlockError;
+    }
+
+    // Prefer continuing the file right after its last block, then any run long enough to hold the request
+    int runStart = -1;
+    if (goalBlock >= 0 && goalBlock < superBlockCache.fileSystemSize && freeRunLength(goalBlock, numBlocks) >= numBlocks) {
+        runStart = goalBlock;
+    } else {
+        runStart = findFreeRun(nextFitCursor, numBlocks);
+    }
+    if (runStart < 0) {
+        int result = allocateScattered(numBlocks, blockNumbers); // too fragmented: fall back to scattered blocks
+        pthread_mutex_unlock(&allocatorLock);
+        return result;
+    }
+
+    for (int blockIndex = 0; blockIndex < numBlocks; blockIndex++)
+    {
+        blockNumbers[blockIndex] = runStart + blockIndex;
+        setBlockState(runStart + blockIndex, OccupiedBlock);
+    }
+    freeBlockCount -= numBlocks;
+    nextFitCursor = (runStart + numBlocks) % superBlockCache.fileSystemSize;
+    recordAllocatorScan();
+    pthread_mutex_unlock(&allocatorLock);
+    return numBlocks;
+}
 
 int allocateBlock() {
-    int blocksToWrite = 1;
-    int freeBlockCacheIndex = 0;
-    while (freeBlockCacheIndex < DISK_BLOCK_SIZE)
+    int blockNumber;
+    if (allocateBlocks(1, &blockNumber) < 0) {
+        return allocateBlockError;
+    }
+    return blockNumber;
+}
+
+/**
+ * @brief frees an occupied block; it is held back from the allocator until the running transaction commits.
+ *        Called with allocatorLock held.
+ */
+static void releaseBlock(int blockNumber) {
+    if (!(freeBlockListCache[blockNumber / BITS_PER_WORD] >> (blockNumber % BITS_PER_WORD) & 1)) {
+        setBlockState(blockNumber, FreeBlock);
+        releasedBlockList[blockNumber / BITS_PER_WORD] |= (uint64_t)1 << (blockNumber % BITS_PER_WORD);
+        ++freeBlockCount;
+        ++releasedBlockCount;
+    }
+}
+
+void freeBlock(int blockNumber) {
+    if (blockNumber < 0 || blockNumber >= superBlockCache.fileSystemSize) {
+        return;
+    }
+    pthread_mutex_lock(&allocatorLock);
+    releaseBlock(blockNumber);
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+void freeRun(int startBlock, int numBlocks) {
+    pthread_mutex_lock(&allocatorLock);
+    for (int blockNumber = startBlock; blockNumber < startBlock + numBlocks; blockNumber++)
+    {
+        if (blockNumber >= 0 && blockNumber < superBlockCache.fileSystemSize) {
+            releaseBlock(blockNumber);
+        }
+    }
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+/**
+ * @brief hands the blocks freed by the transaction the journal just committed back to the allocator. Called by the
+ *        journal while no operation is in progress.
+ */
+static void reuseReleasedBlocks() {
+    pthread_mutex_lock(&allocatorLock);
+    if (releasedBlockCount > 0) {
+        memset(releasedBlockList, 0, (size_t)superBlockCache.freeBlockListLength * superBlockCache.blockSize);
+        releasedBlockCount = 0;
+    }
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+/**
+ * @brief counts the free blocks and resets the next fit cursor after the free block list is loaded.
+ */
+static void countFreeBlocks() {
+    freeBlockCount = 0;
+    int words = superBlockCache.freeBlockListLength * superBlockCache.blockSize / (int)sizeof(uint64_t);
+    for (int wordIndex = 0; wordIndex < words; wordIndex++)
+    {
+        freeBlockCount += __builtin_popcountll(freeBlockListCache[wordIndex]);
+    }
+    nextFitCursor = 0;
+}
+
+/**
+ * @brief hash of a data block for the dedup index: four multiply-xorshift lanes over 8-byte words, so the
+ *        multiplications overlap. Never 0, which marks a block that is not indexed.
+ */
+static uint64_t blockHash(const char *block) {
+    uint64_t lanes[4] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+    uint64_t word;
+    for (int offset = 0; offset < superBlockCache.blockSize; offset += 4 * (int)sizeof(uint64_t))
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            memcpy(&word, block + offset + lane * sizeof(uint64_t), sizeof(uint64_t));
+            lanes[lane] = (lanes[lane] ^ word) * 0xFF51AFD7ED558CCDULL;
+            lanes[lane] ^= lanes[lane] >> 31;
+        }
+    }
+    uint64_t hash = lanes[0] ^ (lanes[1] * 31) ^ (lanes[2] * 961) ^ (lanes[3] * 29791);
+    hash = (hash ^ (hash >> 29)) * 0xBF58476D1CE4E5B9ULL;
+    return (hash ^ (hash >> 32)) | 1;
+}
+
+static void indexDataBlock(int blockNumber, uint64_t hash) {
+    if (dedupHashes == NULL || dedupHashes[blockNumber] != 0) {
+        return;
+    }
+    dedupHashes[blockNumber] = hash;
+    dedupChain[blockNumber] = dedupBuckets[hash & dedupMask];
+    dedupBuckets[hash & dedupMask] = blockNumber;
+}
+
+/**
+ * @brief takes a data block out of the dedup index before its bytes change or it is freed.
+ */
+static void unindexDataBlock(int blockNumber) {
+    if (dedupHashes == NULL || dedupHashes[blockNumber] == 0) {
+        return;
+    }
+    int *link = &dedupBuckets[dedupHashes[blockNumber] & dedupMask];
+    while (*link != blockNumber)
+    {
+        link = &dedupChain[*link];
+    }
+    *link = dedupChain[blockNumber];
+    dedupHashes[blockNumber] = 0;
+}
+
+static int listsBlock(const int *blockNumbers, int numBlocks, int blockNumber) {
+    for (int blockIndex = 0; blockIndex < numBlocks; blockIndex++)
+    {
+        if (blockNumbers[blockIndex] == blockNumber) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief finds an indexed data block holding the same bytes as the given block, other than the excluded blocks.
+ *        Blocks with the same hash are read and compared, so a hash collision never shares a block. Called with
+ *        metadataLock held.
+ *
+ * @return int block number, or DEDUP_CHAIN_END if no indexed block holds these bytes
+ */
+static int findDuplicateBlock(const char *block, uint64_t hash, const int *excludedBlocks, int excludedCount) {
+    char candidateBlock[superBlockCache.blockSize];
+    for (int candidate = dedupBuckets[hash & dedupMask]; candidate != DEDUP_CHAIN_END; candidate = dedupChain[candidate])
+    {
+        if (dedupHashes[candidate] != hash || listsBlock(excludedBlocks, excludedCount, candidate) ||
+            cached_read_blocks(candidate, 1, candidateBlock) < 0) {
+            continue;
+        }
+        countStat(&statistics.blockReads[StatsData], 1);
+        if (memcmp(candidateBlock, block, superBlockCache.blockSize) == 0) {
+            return candidate;
+        }
+    }
+    return DEDUP_CHAIN_END;
+}
+
+/**
+ * @brief drops one file reference to a data block; the block is only freed with its last reference. Called with
+ *        metadataLock held.
+ */
+static void releaseDataBlock(int blockNumber) {
+    if (blockNumber < 0 || blockNumber >= superBlockCache.fileSystemSize) {
+        return;
+    }
+    if (blockReferences[blockNumber] > 0) {
+        --blockReferences[blockNumber];
+        --superBlockCache.sharedReferences;
+        superBlockDirty = 1;
+        return;
+    }
+    unindexDataBlock(blockNumber);
+    freeBlock(blockNumber);
+}
+
+static int pointersPerBlock() {
+    return superBlockCache.blockSize / (int)sizeof(int); // pointers held by an indirect block
+}
+
+static int maxFileExtents() {
+    return INODE_EXTENTS + superBlockCache.blockSize / (int)sizeof(Extent); // extents in the i-Node and its extent block
+}
+
+static void resetBlockPointers(iNode *iNodeOfFile) {
+    for (int directPointerIndex = 0; directPointerIndex < DIRECT_POINTERS; directPointerIndex++)
+    {
+        iNodeOfFile->directPointers[directPointerIndex] = INITIALIZATION_VALUE;
+    }
+    iNodeOfFile->indirectPointer = INITIALIZATION_VALUE;
+    iNodeOfFile->doubleIndirectPointer = INITIALIZATION_VALUE;
+    iNodeOfFile->tripleIndirectPointer = INITIALIZATION_VALUE;
+}
+
+static Extent *iNodeExtents(iNode *iNodeOfFile) {
+    return (Extent *)iNodeOfFile->directPointers; // extent-mapped i-Nodes keep their first extents in the pointer area
+}
+
+static char *iNodeInlineData(iNode *iNodeOfFile) {
+    return (char *)iNodeOfFile->directPointers; // the direct, indirect, double and triple indirect pointers follow each other
+}
+
+/**
+ * @brief collects the extents of an extent-mapped file (the ones in the i-Node followed by the ones in its
+ *        extent block) in logical order and returns how many are in use.
+ */
+static int loadExtents(iNode *iNodeOfFile, Extent *extents) {
+    memcpy(extents, iNodeExtents(iNodeOfFile), INODE_EXTENTS * sizeof(Extent));
+    if (iNodeOfFile->indirectPointer >= 0) {
+        memcpy(extents + INODE_EXTENTS, indirectBlock(iNodeOfFile->indirectPointer, 0)->pointers, superBlockCache.blockSize);
+    } else {
+        memset(extents + INODE_EXTENTS, 0, superBlockCache.blockSize);
+    }
+    int extentCount = 0;
+    while (extentCount < maxFileExtents() && extents[extentCount].length > 0)
+    {
+        ++extentCount;
+    }
+    return extentCount;
+}
+
+/**
+ * @brief finds the pointer tree of a pointer-mapped i-Node that holds the given logical block: the direct
+ *        pointers (depth 0), or the single, double or triple indirect tree (depth 1 to 3). Sets the i-Node
+ *        pointer at the root of the tree and the index of the block within the tree.
+ *
+ * @return int depth of the tree, or blockMappingError past the end of the triple indirect tree
+ */
+static int locateFileBlock(iNode *iNodeOfFile, int blockIndex, int **rootPointer, long long *indexInTree) {
+    int *rootPointers[INDIRECT_LEVELS] = {&iNodeOfFile->indirectPointer, &iNodeOfFile->doubleIndirectPointer, &iNodeOfFile->tripleIndirectPointer};
+    long long index = blockIndex;
+    long long treeBlocks = pointersPerBlock();
+
+    if (index < DIRECT_POINTERS) {
+        *rootPointer = &iNodeOfFile->directPointers[index];
+        *indexInTree = 0;
+        return 0;
+    }
+    index -= DIRECT_POINTERS;
+    for (int depth = 1; depth <= INDIRECT_LEVELS; depth++)
+    {
+        if (index < treeBlocks) {
+            *rootPointer = rootPointers[depth - 1];
+            *indexInTree = index;
+            return depth;
+        }
+        index -= treeBlocks;
+        treeBlocks *= pointersPerBlock();
+    }
+    return blockMappingError;
+}
+
+/**
+ * @brief number of data blocks covered by one pointer of a block at the given height above the data blocks.
+ */
+static long long blocksPerPointer(int height) {
+    long long blocks = 1;
+    for (int level = 1; level < height; level++)
+    {
+        blocks *= pointersPerBlock();
+    }
+    return blocks;
+}
+
+/**
+ * @brief translates a logical block of a pointer-mapped file into a disk block number by walking its pointer
+ *        tree through the indirect block cache. Returns blockMappingError if the block is not mapped.
+ */
+static int lookupFileBlock(iNode *iNodeOfFile, int blockIndex) {
+    int *rootPointer;
+    long long index;
+    int depth = locateFileBlock(iNodeOfFile, blockIndex, &rootPointer, &index);
+    if (depth < 0) {
+        return blockMappingError;
+    }
+
+    int blockNumber = *rootPointer;
+    for (int height = depth; height > 0 && blockNumber >= 0; height--)
+    {
+        long long span = blocksPerPointer(height);
+        blockNumber = indirectBlock(blockNumber, 0)->pointers[index / span];
+        index %= span;
+    }
+    return blockNumber >= 0 ? blockNumber : blockMappingError;
+}
+
+/**
+ * @brief counts the indirect blocks that mapping the given logical block creates, given that every block before
+ *        it is already mapped: one for each pointer tree level where the block is the first one covered.
+ */
+static int newIndirectBlocksAt(iNode *iNodeOfFile, int blockIndex) {
+    int *rootPointer;
+    long long index;
+    int depth = locateFileBlock(iNodeOfFile, blockIndex, &rootPointer, &index);
+    int newBlocks = 0;
+    for (int height = 1; height <= depth; height++)
+    {
+        newBlocks += index % (blocksPerPointer(height) * pointersPerBlock()) == 0;
+    }
+    return newBlocks;
+}
+
+/**
+ * @brief maps a logical block of a pointer-mapped file to the given disk block. Missing indirect blocks on the
+ *        way are taken from the end of the spare blocks.
+ */
+static void setFileBlock(iNode *iNodeOfFile, int blockIndex, int blockNumber, int *spareBlocks, int *spareBlockCount) {
+    int *rootPointer;
+    long long index;
+    int depth = locateFileBlock(iNodeOfFile, blockIndex, &rootPointer, &index);
+    if (depth == 0) {
+        *rootPointer = blockNumber;
+        return;
+    }
+
+    if (*rootPointer < 0) {
+        *rootPointer = spareBlocks[--*spareBlockCount];
+        indirectBlock(*rootPointer, 1);
+    }
+    int pointerBlock = *rootPointer;
+    for (int height = depth; height > 0; height--)
+    {
+        long long span = blocksPerPointer(height);
+        IndirectCacheEntry *entry = indirectBlock(pointerBlock, 0);
+        int *pointer = &entry->pointers[index / span];
+        index %= span;
+        if (height == 1) {
+            *pointer = blockNumber;
+            entry->dirty = 1;
+            return;
+        }
+        if (*pointer < 0) {
+            *pointer = spareBlocks[--*spareBlockCount];
+            entry->dirty = 1;
+            pointerBlock = *pointer;
+            indirectBlock(pointerBlock, 1); // may evict the parent, which is why its pointer was copied first
+        } else {
+            pointerBlock = *pointer;
+        }
+    }
+}
+
+/**
+ * @brief translates the logical blocks [firstBlockIndex, firstBlockIndex + numBlocks) of a file into disk
+ *        block numbers. Pointer-mapped files walk their pointer trees through the indirect block cache;
+ *        extent-mapped files translate whole runs at once.
+ */
+static int mapFileBlocks(iNode *iNodeOfFile, int firstBlockIndex, int numBlocks, int *blockNumbers) {
+    int lastBlockIndex = firstBlockIndex + numBlocks - 1;
+
+    if (iNodeOfFile->format == ExtentFormat) {
+        Extent extents[maxFileExtents()];
+        int extentCount = loadExtents(iNodeOfFile, extents);
+        int extentStart = 0; // logical index of the first block of the extent
+        int blocksMapped = 0;
+        for (int extentIndex = 0; extentIndex < extentCount && extentStart <= lastBlockIndex; extentIndex++)
+        {
+            int from = firstBlockIndex > extentStart ? firstBlockIndex : extentStart;
+            int to = lastBlockIndex < extentStart + extents[extentIndex].length - 1 ? lastBlockIndex : extentStart + extents[extentIndex].length - 1;
+            for (int blockIndex = from; blockIndex <= to; blockIndex++)
+            {
+                blockNumbers[blockIndex - firstBlockIndex] = extents[extentIndex].startBlock + (blockIndex - extentStart);
+                ++blocksMapped;
+            }
+            extentStart += extents[extentIndex].length;
+        }
+        return blocksMapped == numBlocks ? NoError : blockMappingError;
+    }
+
+    for (int blockIndex = firstBlockIndex; blockIndex <= lastBlockIndex; blockIndex++)
+    {
+        blockNumbers[blockIndex - firstBlockIndex] = lookupFileBlock(iNodeOfFile, blockIndex);
+        if (blockNumbers[blockIndex - firstBlockIndex] < 0) {
+            return blockMappingError;
+        }
+    }
+    return NoError;
+}
+
+/**
+ * @brief appends extents for newly allocated blocks, merging blocks that continue the last extent.
+ *        Returns the new number of extents, or blockMappingError if the file runs out of extents.
+ */
+static int appendExtents(Extent *extents, int extentCount, int *newBlocks, int numNewBlocks) {
+    for (int blockIndex = 0; blockIndex < numNewBlocks; blockIndex++)
+    {
+        Extent *lastExtent = extentCount > 0 ? &extents[extentCount - 1] : NULL;
+        if (lastExtent != NULL && lastExtent->startBlock + lastExtent->length == newBlocks[blockIndex]) {
+            ++lastExtent->length;
+            continue;
+        }
+        if (extentCount == maxFileExtents()) {
+            return blockMappingError;
+        }
+        extents[extentCount].startBlock = newBlocks[blockIndex];
+        extents[extentCount].length = 1;
+        ++extentCount;
+    }
+    return extentCount;
+}
+
+/**
+ * @brief switches an extent-mapped file that ran out of extents over to direct and indirect pointers, which can
+ *        map a fragmented file however long. The data blocks stay where they are, and the extent block becomes
+ *        one of the indirect blocks. Nothing changes if the other indirect blocks cannot be allocated.
+ */
+static int convertToPointers(iNode *iNodeOfFile) {
+    Extent extents[maxFileExtents()];
+    int extentCount = loadExtents(iNodeOfFile, extents);
+    int numBlocks = 0;
+    for (int extentIndex = 0; extentIndex < extentCount; extentIndex++)
+    {
+        numBlocks += extents[extentIndex].length;
+    }
+    int spareBlockCount = 0;
+    for (int blockIndex = 0; blockIndex < numBlocks; blockIndex++)
+    {
+        spareBlockCount += newIndirectBlocksAt(iNodeOfFile, blockIndex);
+    }
+
+    int *spareBlocks = malloc((spareBlockCount + 1) * sizeof(int));
+    int extentBlock = iNodeOfFile->indirectPointer;
+    int reused = extentBlock >= 0 && spareBlockCount > 0;
+    if (spareBlockCount > reused && allocateBlocks(spareBlockCount - reused, spareBlocks + reused) < 0) {
+        free(spareBlocks);
+        return blockMappingError;
+    }
+    if (extentBlock >= 0) {
+        forgetIndirectBlock(extentBlock); // its extents were loaded above
+        if (reused) {
+            spareBlocks[0] = extentBlock;
+        } else {
+            freeBlock(extentBlock);
+        }
+    }
+
+    resetBlockPointers(iNodeOfFile);
+    iNodeOfFile->format = PointerFormat;
+    int blockIndex = 0;
+    for (int extentIndex = 0; extentIndex < extentCount; extentIndex++)
+    {
+        for (int offset = 0; offset < extents[extentIndex].length; offset++)
+        {
+            setFileBlock(iNodeOfFile, blockIndex++, extents[extentIndex].startBlock + offset, spareBlocks, &spareBlockCount);
+        }
+    }
+    free(spareBlocks);
+    return NoError;
+}
+
+/**
+ * @brief makes sure the file maps at least numFileBlocks blocks. The missing blocks at the end of the file
+ *        are allocated in one batch, as a contiguous run right after the current last block when possible.
+ *        An extent-mapped file too fragmented for its extents is switched to pointers first. Nothing else
+ *        changes if the file cannot grow that much.
+ */
+static int growFile(iNode *iNodeOfFile, int numFileBlocks) {
+    if (iNodeOfFile->format == ExtentFormat) {
+        Extent extents[maxFileExtents()];
+        int extentCount = loadExtents(iNodeOfFile, extents);
+        int blocksMapped = 0;
+        for (int extentIndex = 0; extentIndex < extentCount; extentIndex++)
+        {
+            blocksMapped += extents[extentIndex].length;
+        }
+        if (numFileBlocks <= blocksMapped) {
+            return NoError;
+        }
+
+        int newBlocksNeeded = numFileBlocks - blocksMapped;
+        int goalBlock = extentCount > 0 ? extents[extentCount - 1].startBlock + extents[extentCount - 1].length : -1;
+        int *newBlocks = malloc(newBlocksNeeded * sizeof(int));
+        if (allocateRun(goalBlock, newBlocksNeeded, newBlocks) < 0) {
+            free(newBlocks);
+            return blockMappingError;
+        }
+        int newExtentCount = appendExtents(extents, extentCount, newBlocks, newBlocksNeeded);
+        int newExtentBlock = newExtentCount > INODE_EXTENTS && iNodeOfFile->indirectPointer < 0;
+        if (newExtentBlock) {
+            iNodeOfFile->indirectPointer = allocateBlock(); // the extents no longer fit in the i-Node
+        }
+        if (newExtentCount == blockMappingError || (newExtentCount > INODE_EXTENTS && iNodeOfFile->indirectPointer < 0)) {
+            for (int blockIndex = 0; blockIndex < newBlocksNeeded; blockIndex++)
+            {
+                freeBlock(newBlocks[blockIndex]);
+            }
+            free(newBlocks);
+            if (newExtentCount != blockMappingError) {
+                return blockMappingError; // no block is left for the extent block
+            }
+            if (convertToPointers(iNodeOfFile) < 0) {
+                printf("ERROR: the file ran out of extents, and there is no room for the indirect blocks replacing them.\n");
+                return blockMappingError;
+            }
+            return growFile(iNodeOfFile, numFileBlocks);
+        }
+        free(newBlocks);
+
+        memcpy(iNodeExtents(iNodeOfFile), extents, INODE_EXTENTS * sizeof(Extent));
+        if (newExtentCount > INODE_EXTENTS) {
+            IndirectCacheEntry *extentBlock = indirectBlock(iNodeOfFile->indirectPointer, newExtentBlock);
+            memcpy(extentBlock->pointers, extents + INODE_EXTENTS, superBlockCache.blockSize);
+            extentBlock->dirty = 1;
+        }
+        return NoError;
+    }
+
+    // Files have no holes (sfs_fseek stays within the file), so exactly the blocks holding size bytes are mapped
+    int blocksMapped = (iNodeOfFile->size + superBlockCache.blockSize - 1) / superBlockCache.blockSize;
+    int *rootPointer;
+    long long index;
+    if (numFileBlocks <= blocksMapped) {
+        return NoError;
+    }
+    if (locateFileBlock(iNodeOfFile, numFileBlocks - 1, &rootPointer, &index) < 0) {
+        return blockMappingError;
+    }
+
+    int newDataBlocks = numFileBlocks - blocksMapped;
+    int newBlocksNeeded = newDataBlocks;
+    for (int blockIndex = blocksMapped; blockIndex < numFileBlocks; blockIndex++)
+    {
+        newBlocksNeeded += newIndirectBlocksAt(iNodeOfFile, blockIndex);
+    }
+    int goalBlock = blocksMapped > 0 ? lookupFileBlock(iNodeOfFile, blocksMapped - 1) + 1 : -1;
+    int *newBlocks = malloc(newBlocksNeeded * sizeof(int));
+    if (allocateRun(goalBlock, newBlocksNeeded, newBlocks) < 0) {
+        free(newBlocks);
+        return blockMappingError;
+    }
+
+    // Indirect blocks come from the end of the batch, so the data blocks stay contiguous
+    int spareBlockCount = newBlocksNeeded;
+    for (int blockIndex = blocksMapped; blockIndex < numFileBlocks; blockIndex++)
+    {
+        setFileBlock(iNodeOfFile, blockIndex, newBlocks[blockIndex - blocksMapped], newBlocks, &spareBlockCount);
+    }
+    free(newBlocks);
+    return NoError;
+}
+
+/**
+ * @brief frees a block of a pointer tree and, when it is an indirect block, everything it points to. Data blocks
+ *        shared with other files only lose a reference.
+ */
+static void releasePointerTree(int blockNumber, int height) {
+    if (blockNumber < 0) {
+        return;
+    }
+    if (height > 0) {
+        int pointers[pointersPerBlock()]; // copied, since the cache entry does not survive the recursion
+        memcpy(pointers, indirectBlock(blockNumber, 0)->pointers, superBlockCache.blockSize);
+        for (int pointerIndex = 0; pointerIndex < pointersPerBlock(); pointerIndex++)
+        {
+            releasePointerTree(pointers[pointerIndex], height - 1);
+        }
+        forgetIndirectBlock(blockNumber);
+        freeBlock(blockNumber);
+    } else {
+        releaseDataBlock(blockNumber); // possibly shared with other files
+    }
+}
+
+/**
+ * @brief frees the blocks of a pointer tree that map logical blocks at or past keepBlocks, given the logical block
+ *        mapped by the first block under the tree; an indirect block left mapping nothing is freed as well.
+ *
+ * @return int the tree's new root pointer: the same block, or INITIALIZATION_VALUE if the whole tree was freed
+ */
+static int truncatePointerTree(int blockNumber, int height, long long firstBlockIndex, long long keepBlocks) {
+    if (blockNumber < 0 || firstBlockIndex >= keepBlocks) {
+        releasePointerTree(blockNumber, height);
+        return INITIALIZATION_VALUE;
+    }
+    if (height == 0) {
+        return blockNumber;
+    }
+
+    int pointers[pointersPerBlock()]; // copied, since the cache entry does not survive the recursion
+    long long span = blocksPerPointer(height);
+    memcpy(pointers, indirectBlock(blockNumber, 0)->pointers, superBlockCache.blockSize);
+    for (int pointerIndex = 0; pointerIndex < pointersPerBlock(); pointerIndex++)
+    {
+        if (firstBlockIndex + (pointerIndex + 1) * span > keepBlocks) { // only the pointers past the new end change
+            pointers[pointerIndex] = truncatePointerTree(pointers[pointerIndex], height - 1, firstBlockIndex + pointerIndex * span, keepBlocks);
+        }
+    }
+    IndirectCacheEntry *entry = indirectBlock(blockNumber, 0);
+    memcpy(entry->pointers, pointers, superBlockCache.blockSize);
+    entry->dirty = 1;
+    return blockNumber;
+}
+
+/**
+ * @brief frees the blocks of a file past its first keepBlocks logical blocks, and its extent block or indirect
+ *        blocks once they map nothing. The runs of an extent-mapped file are freed a whole run at a time.
+ */
+static void truncateFileBlocks(iNode *iNodeOfFile, int keepBlocks) {
+    if (iNodeOfFile->format == InlineFormat) {
+        return; // the bytes are in the i-Node, there is no block to free
+    }
+    if (iNodeOfFile->format == ExtentFormat) {
+        Extent extents[maxFileExtents()];
+        int extentCount = loadExtents(iNodeOfFile, extents);
+        int extentStart = 0; // logical index of the first block of the extent
+        int keptExtents = 0;
+        for (int extentIndex = 0; extentIndex < extentCount; extentIndex++)
+        {
+            int length = extents[extentIndex].length;
+            int keptLength = keepBlocks - extentStart;
+            keptLength = keptLength < 0 ? 0 : keptLength > length ? length : keptLength;
+            freeRun(extents[extentIndex].startBlock + keptLength, length - keptLength);
+            extents[extentIndex].length = keptLength;
+            keptExtents += keptLength > 0;
+            extentStart += length;
+        }
+        memset(extents + keptExtents, 0, (maxFileExtents() - keptExtents) * sizeof(Extent));
+        memcpy(iNodeExtents(iNodeOfFile), extents, INODE_EXTENTS * sizeof(Extent));
+        if (iNodeOfFile->indirectPointer >= 0 && keptExtents <= INODE_EXTENTS) {
+            forgetIndirectBlock(iNodeOfFile->indirectPointer);
+            freeBlock(iNodeOfFile->indirectPointer); // the extent block itself
+            iNodeOfFile->indirectPointer = INITIALIZATION_VALUE;
+        } else if (iNodeOfFile->indirectPointer >= 0) {
+            IndirectCacheEntry *extentBlock = indirectBlock(iNodeOfFile->indirectPointer, 0);
+            memcpy(extentBlock->pointers, extents + INODE_EXTENTS, superBlockCache.blockSize);
+            extentBlock->dirty = 1;
+        }
+        return;
+    }
+
+    int *rootPointers[INDIRECT_LEVELS] = {&iNodeOfFile->indirectPointer, &iNodeOfFile->doubleIndirectPointer, &iNodeOfFile->tripleIndirectPointer};
+    long long treeStart = DIRECT_POINTERS; // logical index of the first block under the tree
+    for (int directPointerIndex = keepBlocks < DIRECT_POINTERS ? keepBlocks : DIRECT_POINTERS; directPointerIndex < DIRECT_POINTERS; directPointerIndex++)
+    {
+        releaseDataBlock(iNodeOfFile->directPointers[directPointerIndex]);
+        iNodeOfFile->directPointers[directPointerIndex] = INITIALIZATION_VALUE;
+    }
+    for (int depth = 1; depth <= INDIRECT_LEVELS; depth++)
+    {
+        *rootPointers[depth - 1] = truncatePointerTree(*rootPointers[depth - 1], depth, treeStart, keepBlocks);
+        treeStart += blocksPerPointer(depth) * pointersPerBlock();
+    }
+}
+
+/**
+ * @brief counts a reference to every data block under a block of a pointer tree.
+ */
+static void countPointerTree(int blockNumber, int height) {
+    if (blockNumber < 0 || blockNumber >= superBlockCache.fileSystemSize) {
+        return;
+    }
+    if (height == 0) {
+        ++blockReferences[blockNumber];
+        return;
+    }
+    int pointers[pointersPerBlock()]; // copied, since the cache entry does not survive the recursion
+    memcpy(pointers, indirectBlock(blockNumber, 0)->pointers, superBlockCache.blockSize);
+    for (int pointerIndex = 0; pointerIndex < pointersPerBlock(); pointerIndex++)
+    {
+        countPointerTree(pointers[pointerIndex], height - 1);
+    }
+}
+
+/**
+ * @brief rebuilds the reference counts of the data blocks from the pointer-mapped files, the only ones that share
+ *        blocks; done once per mount, and skipped when the super block records no shared block.
+ */
+static void countBlockReferences() {
+    memset(blockReferences, 0, superBlockCache.fileSystemSize * sizeof(int));
+    if (superBlockCache.sharedReferences == 0) {
+        return;
+    }
+    for (int iNodeIndex = 0; iNodeIndex < superBlockCache.iNodeCount; iNodeIndex++)
+    {
+        iNode *iNodeOfFile = &iNodesTableCache->iNodes[iNodeIndex];
+        if (iNodeOfFile->linkCount < 0 || iNodeOfFile->format != PointerFormat) { // orphans still hold their blocks
+            continue;
+        }
+        for (int directPointerIndex = 0; directPointerIndex < DIRECT_POINTERS; directPointerIndex++)
+        {
+            countPointerTree(iNodeOfFile->directPointers[directPointerIndex], 0);
+        }
+        countPointerTree(iNodeOfFile->indirectPointer, 1);
+        countPointerTree(iNodeOfFile->doubleIndirectPointer, 2);
+        countPointerTree(iNodeOfFile->tripleIndirectPointer, 3);
+    }
+    superBlockCache.sharedReferences = 0;
+    for (int blockNumber = 0; blockNumber < superBlockCache.fileSystemSize; blockNumber++)
+    {
+        if (blockReferences[blockNumber] > 0) {
+            --blockReferences[blockNumber]; // the first reference is not counted
+            superBlockCache.sharedReferences += blockReferences[blockNumber];
+        }
+    }
+}
+
+/**
+ * @brief returns every data block of a file, and its indirect or extent blocks, to the free block list.
+ */
+static void releaseFileBlocks(iNode *iNodeOfFile) {
+    truncateFileBlocks(iNodeOfFile, 0);
+    resetBlockPointers(iNodeOfFile);
+}
+
+/**
+ * @brief releases the blocks of a removed file and marks its i-Node unused. Called with metadataLock held.
+ */
+static void releaseINode(int iNodeIndex) {
+    releaseFileBlocks(&iNodesTableCache->iNodes[iNodeIndex]);
+    iNodesTableCache->iNodes[iNodeIndex].linkCount = INITIALIZATION_VALUE;
+    iNodesTableCache->iNodes[iNodeIndex].size = INITIALIZATION_VALUE;
+    markINodeDirty(iNodeIndex);
+}
+
+/**
+ * @brief creates an empty file in the lowest free directory slot. Called with directoryLock held for writing.
+ *
+ * @return int directory slot (and i-Node) of the file, or DIRECTORY_INDEX_END if the root directory is full
+ */
+static int createFile(char *fname) {
+    pthread_mutex_lock(&metadataLock);
+    int fileIndex = takeFreeSlot();
+    if (fileIndex == DIRECTORY_INDEX_END) {
+        pthread_mutex_unlock(&metadataLock);
+        return DIRECTORY_INDEX_END;
+    }
+    iNodesTableCache->iNodes[fileIndex].linkCount = 1;
+    iNodesTableCache->iNodes[fileIndex].size = 0;
+    iNodesTableCache->iNodes[fileIndex].format = SFS_INLINE_DATA ? InlineFormat : dedupEnabled ? PointerFormat : SFS_INODE_FORMAT;
+    strncpy(rootDirectoryCache->directoryEntries[fileIndex].filename, fname, MAX_FILENAME_LENGTH);
+    indexDirectoryEntry(fileIndex);
+    markINodeDirty(fileIndex);
+    markDirectoryEntryDirty(fileIndex);
+    flushMetadata();
+    pthread_mutex_unlock(&metadataLock);
+    return fileIndex;
+}
+
+static void initOpenFileTable() {
+    for (int fd = 0; fd < openFDTCache.size; fd++)
+    {
+        openFDTCache.openFiles[fd].iNodeIndex = FDT_INITIALIZER_VALUE;
+        openFDTCache.openFiles[fd].iNodeOfFile = NULL;
+        openFDTCache.openFiles[fd].nextFree = fd + 1 < openFDTCache.size ? fd + 1 : FDT_INITIALIZER_VALUE;
+    }
+    openFDTCache.firstFree = 0;
+    for (int iNodeIndex = 0; iNodeIndex < superBlockCache.iNodeCount; iNodeIndex++)
+    {
+        openFDTCache.openCounts[iNodeIndex] = 0;
+        openFDTCache.fopenDescriptors[iNodeIndex] = FDT_INITIALIZER_VALUE;
+    }
+}
+
+/**
+ * @brief takes a descriptor from the free list and opens it on an i-Node. Called with descriptorLock held.
+ *
+ * @return int file descriptor, or fOpenError if every descriptor is in use
+ */
+static int openDescriptor(int iNodeIndex, int flags, int position) {
+    int fd = openFDTCache.firstFree;
+    if (fd == FDT_INITIALIZER_VALUE) {
+        return fOpenError;
+    }
+    OpenFile *openFile = &openFDTCache.openFiles[fd];
+    openFDTCache.firstFree = openFile->nextFree;
+    openFile->iNodeIndex = iNodeIndex;
+    openFile->read_writePointer = position;
+    openFile->flags = flags;
+    openFile->iNodeOfFile = &iNodesTableCache->iNodes[iNodeIndex];
+    openFile->readaheadNext = position / superBlockCache.blockSize;
+    openFile->readaheadWindow = 0;
+    openFile->readaheadEnd = 0;
+    ++openFDTCache.openCounts[iNodeIndex];
+    return fd;
+}
+
+/**
+ * @brief returns a descriptor to the free list. Called with descriptorLock held.
+ *
+ * @return int descriptors still open on the same i-Node
+ */
+static int closeDescriptor(int fd) {
+    OpenFile *openFile = &openFDTCache.openFiles[fd];
+    int iNodeIndex = openFile->iNodeIndex;
+    if (openFDTCache.fopenDescriptors[iNodeIndex] == fd) {
+        openFDTCache.fopenDescriptors[iNodeIndex] = FDT_INITIALIZER_VALUE;
+    }
+    openFile->iNodeIndex = FDT_INITIALIZER_VALUE;
+    openFile->iNodeOfFile = NULL;
+    openFile->nextFree = openFDTCache.firstFree;
+    openFDTCache.firstFree = fd;
+    return --openFDTCache.openCounts[iNodeIndex];
+}
+
+/**
+ * @brief returns the i-Node a descriptor is open on, or FDT_INITIALIZER_VALUE if the descriptor is not open.
+ */
+static int descriptorINode(int fd) {
+    if (fd < 0 || fd >= openFDTCache.size) {
+        return FDT_INITIALIZER_VALUE;
+    }
+    pthread_mutex_lock(&descriptorLock);
+    int iNodeIndex = openFDTCache.openFiles[fd].iNodeIndex;
+    pthread_mutex_unlock(&descriptorLock);
+    return iNodeIndex;
+}
+
+static void unmountAtExit() {
+    if (diskMounted) {
+        if (close_journal() < 0) {
+            printf("ERROR in unmountAtExit: could not write the journal back to the disk.\n");
+        }
+        close_block_cache();
+        close_disk();
+        diskMounted = 0;
+    }
+}
+
+static int blocksFor(size_t bytes) {
+    return (int)((bytes + superBlockCache.blockSize - 1) / superBlockCache.blockSize);
+}
+
+/**
+ * @brief most metadata blocks one operation logs: the super block, the i-Node (and the i-Node table blocks its
+ *        creation initializes) and directory entry, each possibly straddling two blocks, every free block list
+ *        block, and the indirect blocks mapping a file as large as the disk along with its extent block.
+ */
+static int operationJournalBlocks() {
+    return 1 + 2 + 2 + superBlockCache.freeBlockListLength + superBlockCache.fileSystemSize / (pointersPerBlock() - 1) +
+           INDIRECT_LEVELS + 1;
+}
+
+/**
+ * @brief lays out the on-disk structures for the given geometry in the in-memory super block: the super block,
+ *        i-Node table, root directory, free block list and journal are contiguous at the start of the disk and
+ *        the data blocks follow. Returns mksfsError if the geometry is invalid or leaves no room for data blocks.
+ */
+static int layoutSuperBlock(const Geometry *geometry) {
+    int blockSize = geometry->blockSize;
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0 ||
+        geometry->iNodeCount < 1 || geometry->blockCount < 1) {
+        return mksfsError;
+    }
+
+    memset(&superBlockCache, 0, sizeof(SuperBlock));
+    strcpy(superBlockCache.name, "Super Block");
+    superBlockCache.magic = MAGIC;
+    superBlockCache.blockSize = blockSize;
+    superBlockCache.fileSystemSize = geometry->blockCount; // since super block and root dir are part of the total disk data blocks we don't add them
+    superBlockCache.iNodeCount = geometry->iNodeCount;
+    superBlockCache.iNodeTableStart = SuperBlockIndex + 1;
+    superBlockCache.iNodeTableLength = blocksFor(offsetof(iNodesTable, iNodes) + (size_t)geometry->iNodeCount * sizeof(iNode));
+    superBlockCache.iNodeTableInitialized = superBlockCache.iNodeTableLength;
+    superBlockCache.rootDirectoryStart = superBlockCache.iNodeTableStart + superBlockCache.iNodeTableLength;
+    superBlockCache.rootDirectoryLength = blocksFor(offsetof(RootDirectory, directoryEntries) + (size_t)geometry->iNodeCount * sizeof(DirectoryEntry));
+    superBlockCache.freeBlockListStart = superBlockCache.rootDirectoryStart + superBlockCache.rootDirectoryLength;
+    superBlockCache.freeBlockListLength = blocksFor(((size_t)geometry->blockCount + 7) / 8); // one bit per disk block
+    superBlockCache.journalStart = superBlockCache.freeBlockListStart + superBlockCache.freeBlockListLength;
+    superBlockCache.journalLength = geometry->blockCount / 32; // about 3% of the disk
+    if (superBlockCache.journalLength < JOURNAL_MIN_BLOCKS) {
+        superBlockCache.journalLength = JOURNAL_MIN_BLOCKS;
+    } else if (superBlockCache.journalLength > JOURNAL_MAX_BLOCKS) {
+        superBlockCache.journalLength = JOURNAL_MAX_BLOCKS;
+    }
+    int operationLength = journal_length_for(operationJournalBlocks(), blockSize);
+    if (superBlockCache.journalLength < operationLength) { // whatever the disk size, the largest operation fits
+        superBlockCache.journalLength = operationLength;
+    }
+    if ((long long)superBlockCache.journalStart + superBlockCache.journalLength >= geometry->blockCount) {
+        return mksfsError;
+    }
+    return NoError;
+}
+
+static void releaseMetadataCaches() {
+    free(iNodesTableCache);
+    free(rootDirectoryCache);
+    free(freeBlockListCache);
+    free(releasedBlockList);
+    free(iNodeTableDirtyBlocks);
+    free(rootDirectoryDirtyBlocks);
+    free(freeBlockListDirtyBlocks);
+    free(freeBlockListImage);
+    free(directoryIndexBuckets);
+    free(directoryIndexChain);
+    free(freeSlotMap);
+    free(blockReferences);
+    free(dedupBuckets);
+    free(dedupChain);
+    free(dedupHashes);
+    free(openFDTCache.openFiles);
+    free(openFDTCache.openCounts);
+    free(openFDTCache.fopenDescriptors);
+    for (int iNodeIndex = 0; iNodeIndex < iNodeLockCount; iNodeIndex++)
+    {
+        pthread_rwlock_destroy(&iNodeLocks[iNodeIndex]);
+    }
+    free(iNodeLocks);
+    if (indirectCache != NULL) {
+        free(indirectCache[0].pointers); // arena holding the data of every entry
+    }
+    free(indirectCache);
+    iNodesTableCache = NULL;
+    rootDirectoryCache = NULL;
+    freeBlockListCache = NULL;
+    releasedBlockList = NULL;
+    releasedBlockCount = 0;
+    iNodeTableDirtyBlocks = NULL;
+    rootDirectoryDirtyBlocks = NULL;
+    freeBlockListDirtyBlocks = NULL;
+    freeBlockListImage = NULL;
+    directoryIndexBuckets = NULL;
+    directoryIndexChain = NULL;
+    freeSlotMap = NULL;
+    blockReferences = NULL;
+    dedupBuckets = NULL;
+    dedupChain = NULL;
+    dedupHashes = NULL;
+    openFDTCache.openFiles = NULL;
+    openFDTCache.openCounts = NULL;
+    openFDTCache.fopenDescriptors = NULL;
+    iNodeLocks = NULL;
+    iNodeLockCount = 0;
+    indirectCache = NULL;
+}
+
+/**
+ * @brief sizes the in-memory metadata structures from the geometry in the super block. The cached i-Node table,
+ *        root directory and free block list span whole blocks, exactly like their on-disk copies.
+ */
+static int allocateMetadataCaches() {
+    size_t blockSize = superBlockCache.blockSize;
+    int iNodeCount = superBlockCache.iNodeCount;
+    int blockCount = superBlockCache.fileSystemSize;
+    int bucketCount = 1;
+    while (bucketCount < 2 * iNodeCount) // keeps the filename hash chains short
+    {
+        bucketCount <<= 1;
+    }
+    int dedupBucketCount = 1;
+    while (dedupBucketCount < blockCount)
+    {
+        dedupBucketCount <<= 1;
+    }
+
+    releaseMetadataCaches();
+    iNodesTableCache = calloc(superBlockCache.iNodeTableLength, blockSize);
+    rootDirectoryCache = calloc(superBlockCache.rootDirectoryLength, blockSize);
+    freeBlockListCache = calloc(superBlockCache.freeBlockListLength, blockSize);
+    releasedBlockList = calloc(superBlockCache.freeBlockListLength, blockSize);
+    iNodeTableDirtyBlocks = calloc(superBlockCache.iNodeTableLength, 1);
+    rootDirectoryDirtyBlocks = calloc(superBlockCache.rootDirectoryLength, 1);
+    freeBlockListDirtyBlocks = calloc(superBlockCache.freeBlockListLength, 1);
+    freeBlockListImage = malloc(superBlockCache.freeBlockListLength * blockSize);
+    directoryIndexBuckets = malloc(bucketCount * sizeof(int));
+    directoryIndexChain = malloc(iNodeCount * sizeof(int));
+    freeSlotMap = malloc((iNodeCount + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(uint64_t));
+    blockReferences = calloc(blockCount, sizeof(int));
+    dedupEnabled = dedupSetting;
+    if (dedupEnabled) { // the index lives in memory only, and starts empty at every mount
+        dedupBuckets = malloc(dedupBucketCount * sizeof(int));
+        dedupChain = malloc(blockCount * sizeof(int));
+        dedupHashes = calloc(blockCount, sizeof(uint64_t));
+    }
+    openFDTCache.size = iNodeCount + MAX_OPEN_FILES; // sfs_fopen can keep every file open at once
+    openFDTCache.openFiles = malloc(openFDTCache.size * sizeof(OpenFile));
+    openFDTCache.openCounts = malloc(iNodeCount * sizeof(int));
+    openFDTCache.fopenDescriptors = malloc(iNodeCount * sizeof(int));
+    iNodeLocks = malloc(iNodeCount * sizeof(pthread_rwlock_t));
+    indirectCache = malloc(INDIRECT_CACHE_ENTRIES * sizeof(IndirectCacheEntry));
+    char *indirectArena = malloc(INDIRECT_CACHE_ENTRIES * blockSize);
+    directoryIndexMask = bucketCount - 1;
+    dedupMask = dedupBucketCount - 1;
+    if (iNodesTableCache == NULL || rootDirectoryCache == NULL || freeBlockListCache == NULL || releasedBlockList == NULL ||
+        iNodeTableDirtyBlocks == NULL || rootDirectoryDirtyBlocks == NULL || freeBlockListDirtyBlocks == NULL ||
+        freeBlockListImage == NULL || directoryIndexBuckets == NULL || directoryIndexChain == NULL || freeSlotMap == NULL || blockReferences == NULL ||
+        (dedupEnabled && (dedupBuckets == NULL || dedupChain == NULL || dedupHashes == NULL)) ||
+        openFDTCache.openFiles == NULL || openFDTCache.openCounts == NULL || openFDTCache.fopenDescriptors == NULL ||
+        iNodeLocks == NULL || indirectCache == NULL || indirectArena == NULL) {
+        free(indirectArena);
+        free(indirectCache);
+        indirectCache = NULL;
+        releaseMetadataCaches();
+        printf("ERROR in mksfs: could not allocate the in-memory metadata.\n");
+        return mksfsError;
+    }
+    for (int entryIndex = 0; entryIndex < INDIRECT_CACHE_ENTRIES; entryIndex++)
+    {
+        indirectCache[entryIndex].blockNumber = CACHE_EMPTY_SLOT;
+        indirectCache[entryIndex].dirty = 0;
+        indirectCache[entryIndex].pointers = (int *)(indirectArena + entryIndex * blockSize);
+    }
+    for (int bucket = 0; dedupBuckets != NULL && bucket < dedupBucketCount; bucket++)
+    {
+        dedupBuckets[bucket] = DEDUP_CHAIN_END;
+    }
+    for (int iNodeIndex = 0; iNodeIndex < iNodeCount; iNodeIndex++)
+    {
+        pthread_rwlock_init(&iNodeLocks[iNodeIndex], NULL);
+    }
+    iNodeLockCount = iNodeCount;
+    return NoError;
+}
+
+/**
+ * @brief loads the super block of an existing disk. Only the first MIN_BLOCK_SIZE bytes are read, since the block
+ *        size is not known until the super block is.
+ */
+static int loadSuperBlock(char *diskName) {
+    char superBlockBuffer[MIN_BLOCK_SIZE];
+    SuperBlock storedSuperBlock;
+
+    set_disk_backend(DISK_BACKEND_FILE); // a disk file too short for the probe is then a read error, not a fault
+    set_disk_checksums(0); // the probe's one-block geometry has no checksum area
+    if (init_disk(diskName, MIN_BLOCK_SIZE, 1) < 0) {
+        return mksfsError;
+    }
+    int blocksRead = read_blocks(SuperBlockIndex, 1, superBlockBuffer);
+    countStat(&statistics.blockReads[StatsSuperBlock], 1);
+    close_disk();
+    if (blocksRead < 0) {
+        return mksfsError;
+    }
+
+    memcpy(&storedSuperBlock, superBlockBuffer, sizeof(SuperBlock));
+    Geometry storedGeometry = {storedSuperBlock.blockSize, storedSuperBlock.fileSystemSize, storedSuperBlock.iNodeCount};
+    if (storedSuperBlock.magic != MAGIC || layoutSuperBlock(&storedGeometry) < 0 ||
+        storedSuperBlock.iNodeTableInitialized < 0 || storedSuperBlock.iNodeTableInitialized > superBlockCache.iNodeTableLength ||
+        storedSuperBlock.sharedReferences < 0) {
+        return mksfsError;
+    }
+    superBlockCache = storedSuperBlock;
+    return NoError;
+}
+
+/**
+ * @brief sets the in-memory i-Nodes from the given i-Node table block on to free ones; the i-Nodes of the blocks
+ *        past the initialized part of the table were never written.
+ */
+static void initializeFreeINodes(int firstBlock) {
+    size_t firstByte = (size_t)firstBlock * superBlockCache.blockSize;
+    int firstINode = 0;
+    if (firstByte > offsetof(iNodesTable, iNodes)) { // an i-Node straddling the boundary was never written either
+        firstINode = (firstByte - offsetof(iNodesTable, iNodes)) / sizeof(iNode);
+    } else {
+        strcpy(iNodesTableCache->name, "i-Node Table");
+    }
+    for (int iNodeIndex = firstINode; iNodeIndex < superBlockCache.iNodeCount; iNodeIndex++)
+    {
+        iNodesTableCache->iNodes[iNodeIndex].linkCount = INITIALIZATION_VALUE;
+        iNodesTableCache->iNodes[iNodeIndex].size = INITIALIZATION_VALUE;
+        iNodesTableCache->iNodes[iNodeIndex].format = PointerFormat;
+        resetBlockPointers(&iNodesTableCache->iNodes[iNodeIndex]);
+    }
+}
+
+/**
+ * @brief releases the files that were removed while still open and never closed before the disk was unmounted.
+ */
+static void releaseOrphans() {
+    int orphanCount = 0;
+    for (int iNodeIndex = 0; iNodeIndex < superBlockCache.iNodeCount; iNodeIndex++)
     {
-        if (freeBlockListCache.data[freeBlockCacheIndex] != 0) {
-            freeBlockListCache.data[freeBlockCacheIndex] = 0;
-            write_blocks(FreeBlockListIndex, blocksToWrite, &freeBlockListCache);
-            return freeBlockCacheIndex;
+        if (iNodesTableCache->iNodes[iNodeIndex].linkCount == 0) {
+            if (journal_begin_operation() < 0) { // one operation per file, like sfs_remove, so the journal has room for it
+                printf("ERROR in mksfs: the journal has no room left to release the removed files.\n");
+                break; // the rest are released by the next mount
+            }
+            releaseINode(iNodeIndex);
+            flushMetadata();
+            journal_end_operation();
+            ++orphanCount;
         }
-        ++freeBlockCacheIndex;
     }
-    printf("ERROR: there are no more free blocks left to allocate.");
-    return allocateBlockError;
+    if (orphanCount > 0) {
+        commit_journal();
+    }
 }
 
 void mksfs(int fresh) {
+    Geometry defaultGeometry = {DISK_BLOCK_SIZE, DISK_DATA_BLOCKS, TOTAL_FILES};
+    mksfs_geometry(fresh, &defaultGeometry);
+}
+
+int mksfs_geometry(int fresh, const Geometry *geometry) {
+    static int exitHandlerRegistered = 0;
     char *diskName = "disko";
+    if (diskMounted) { // remounting: write back what the previous mount still holds in memory
+        if (close_journal() < 0) {
+            printf("ERROR in mksfs: could not write the journal of the previous mount back to the disk.\n");
+        }
+        close_block_cache();
+        close_disk();
+        diskMounted = 0;
+    }
+    if (!exitHandlerRegistered) {
+        atexit(unmountAtExit);
+        exitHandlerRegistered = 1;
+    }
+
     if (fresh) {
         /**************INITLIAZE NEW DISK IN EMULATOR**************/
-        init_fresh_disk(diskName, DISK_BLOCK_SIZE, DISK_DATA_BLOCKS);
+        if (geometry == NULL || layoutSuperBlock(geometry) < 0) {
+            printf("ERROR in mksfs: invalid file system geometry.\n");
+            return mksfsError;
+        }
+        set_disk_backend(SFS_DISK_BACKEND);
+        set_disk_checksums(SFS_DISK_CHECKSUMS);
+        if (allocateMetadataCaches() < 0 || init_fresh_disk(diskName, superBlockCache.blockSize, superBlockCache.fileSystemSize) < 0) {
+            return mksfsError;
+        }
+        init_block_cache(superBlockCache.blockSize, cacheBudget);
 
         /**************INITLIAZE FREE BLOCKS LIST**************/
         // Before allocating any blocks, need to initialize the free blocks list (free bit map) in the emulator
-        freeBlockListCache.data[FreeBlockListIndex] = OccupiedBlock;
-        for (int i = 0; i < DISK_BLOCK_SIZE-1; i++)
+        // (bits past the end of the disk stay occupied)
+        for (int block = 0; block < superBlockCache.fileSystemSize; block++)
         {
-            freeBlockListCache.data[i] = FreeBlock;
+            setBlockState(block, FreeBlock);
         }
-        write_blocks(FreeBlockListIndex, 1, &freeBlockListCache); // saving the free block list to the disk emulator
+        reserveBlocks(SuperBlockIndex, superBlockCache.journalStart + superBlockCache.journalLength); // every metadata structure
+        countFreeBlocks();
 
         /**************INITLIAZE SUPER BLOCK**************/
         iNode rootDirectory; // note: a directory (root directory or any other) is still a type i-Node
-        for (int i = 0; i < DIRECT_POINTERS; i++)
-        {
-            rootDirectory.directPointers[i] = allocateBlock();  // find a block to store the root directory
-        }
-        rootDirectory.size = INITIALIZATION_VALUE; // this field will change when the root directory is filled up
-        rootDirectory.indirectPointer = INITIALIZATION_VALUE;
+        resetBlockPointers(&rootDirectory);
+        iNodeExtents(&rootDirectory)[0].startBlock = superBlockCache.rootDirectoryStart; // the root directory is a single extent
+        iNodeExtents(&rootDirectory)[0].length = superBlockCache.rootDirectoryLength;
+        rootDirectory.linkCount = 1;
+        rootDirectory.format = ExtentFormat;
+        rootDirectory.size = offsetof(RootDirectory, directoryEntries) + superBlockCache.iNodeCount * sizeof(DirectoryEntry);
 
-        // Initializing the in-memory super block and saving it to the disk (on-disk super block)
-        superBlockCache.magic = MAGIC;
-        superBlockCache.blockSize = DISK_BLOCK_SIZE;
-        superBlockCache.fileSystemSize = DISK_DATA_BLOCKS; // since super block and root dir are part of the total disk data blocks we don't add them
-        superBlockCache.iNodeTableLength = 12; //DISK_DATA_BLOCKS;
+        // Saving the in-memory super block laid out above to the disk (on-disk super block)
         superBlockCache.rootDirectory = rootDirectory;
-        strcpy(superBlockCache.name, "Super Block");
-        write_blocks(SuperBlockIndex, 1, &superBlockCache); // saving the super block on the disk emulator
+        superBlockCache.iNodeTableInitialized = LAZY_INODE_TABLE_INIT ? 0 : superBlockCache.iNodeTableLength;
+        superBlockDirty = 1; // saved on the disk emulator by the metadata flush below
 
         /**************INITLIAZE ROOT DIRECTORY**************/
-        // Initializing the in-memory root directory and saving it to the disk (on-disk root directory)
-        for (int fileIndex = 0; fileIndex < TOTAL_FILES; fileIndex++)
+        // Initializing the in-memory root directory; the fresh disk reads as zeros, which already is the empty
+        // on-disk root directory
+        for (int fileIndex = 0; fileIndex < superBlockCache.iNodeCount; fileIndex++)
         {
-            rootDirectoryCache.directoryEntries[fileIndex].filename[0] = '\0';
+            rootDirectoryCache->directoryEntries[fileIndex].filename[0] = '\0';
         }
+        rootDirectoryCache->location = START_INDEX;
 
-        for (int rootDirectoryBlock = 0; rootDirectoryBlock < TOTAL_ROOT_DIRECTORY_BLOCKS; rootDirectoryBlock++)
-        {
-            allocateBlock();
+        /**************INITLIAZE INODE TABLE**************/
+        // Initializing the in-memory i-Node table and, unless it is initialized lazily, saving it to the disk
+        initializeFreeINodes(0);
+        memset(iNodeTableDirtyBlocks, 1, superBlockCache.iNodeTableInitialized);
+        flushMetadata(); // written in place: the journal starts logging once the file system exists
+        if (init_journal(superBlockCache.journalStart, superBlockCache.journalLength, superBlockCache.blockSize,
+                         operationJournalBlocks(), reuseReleasedBlocks) < 0) {
+            return mksfsError;
         }
-        rootDirectoryCache.location = START_INDEX;
-        write_blocks(RootDirectoryIndex, TOTAL_ROOT_DIRECTORY_BLOCKS-1, &rootDirectoryCache);
 
-        /**************INITLIAZE INODE TABLE**************/
-        // Initializing the in-memory i-Node table and saving it to the disk (on-disk i-Node table)
-        for (int fileIndex = 0; fileIndex < TOTAL_FILES; fileIndex++)
-        {
-            strcpy(iNodesTableCache.name, "i-Node Table");
-            iNodesTableCache.iNodes[fileIndex].linkCount = INITIALIZATION_VALUE;
-            iNodesTableCache.iNodes[fileIndex].size = INITIALIZATION_VALUE;
+    } else {
+        /**************INITLIAZE EXISTING DISK IN EMULATOR**************/
+        // The geometry comes from the super block, whatever the caller asked for
+        if (loadSuperBlock(diskName) < 0) {
+            printf("ERROR in mksfs: the disk does not hold a valid file system.\n");
+            return mksfsError;
+        }
+        set_disk_backend(SFS_DISK_BACKEND);
+        set_disk_checksums(SFS_DISK_CHECKSUMS);
+        if (allocateMetadataCaches() < 0 || init_disk(diskName, superBlockCache.blockSize, superBlockCache.fileSystemSize) < 0) {
+            return mksfsError;
+        }
+        init_block_cache(superBlockCache.blockSize, cacheBudget);
+        if (init_journal(superBlockCache.journalStart, superBlockCache.journalLength, superBlockCache.blockSize,
+                         operationJournalBlocks(), reuseReleasedBlocks) < 0 ||
+            replay_journal() < 0) { // the metadata is only read once the last committed transaction is in place
+            return mksfsError;
+        }
+        size_t blockSize = superBlockCache.blockSize;
+        readMetadata(SuperBlockIndex, &superBlockCache, sizeof(SuperBlock), StatsSuperBlock); // the journal may have initialized more i-Node table blocks
+        if (superBlockCache.iNodeTableInitialized > 0) {
+            readMetadata(superBlockCache.iNodeTableStart, iNodesTableCache, superBlockCache.iNodeTableInitialized * blockSize, StatsINodeTable);
+        }
+        initializeFreeINodes(superBlockCache.iNodeTableInitialized);
+        readMetadata(superBlockCache.rootDirectoryStart, rootDirectoryCache, superBlockCache.rootDirectoryLength * blockSize, StatsDirectory);
+        readMetadata(superBlockCache.freeBlockListStart, freeBlockListCache, superBlockCache.freeBlockListLength * blockSize, StatsBitmap);
+        countFreeBlocks();
+        countBlockReferences(); // before the orphans release their blocks
+        rootDirectoryCache->location = START_INDEX;
+        releaseOrphans();
+    }
+    diskMounted = 1;
+    if (scrubRate > 0 && scrub_disk(scrubRate) < 0) {
+        printf("ERROR in mksfs: could not start the disk scrubber.\n");
+    }
+    buildDirectoryIndex();
+    /**************INITLIAZE OPEN FILE DESCRIPTOR TABLE**************/
+    initOpenFileTable();
+    return NoError;
+}
 
-            for (int directPointerIndex = 0; directPointerIndex < DIRECT_POINTERS; directPointerIndex++)
-            {
-                iNodesTableCache.iNodes[fileIndex].directPointers[directPointerIndex] = INITIALIZATION_VALUE;
-            }
-            iNodesTableCache.iNodes[fileIndex].indirectPointer = INITIALIZATION_VALUE;
+int sfs_getnextfilename(char* fname) {
+    /**************FUNCTION**************/
+    pthread_rwlock_wrlock(&directoryLock); // the listing cursor moves
+    int fileIndex = rootDirectoryCache->location; // resume the listing where the previous call stopped
+    while (fileIndex < superBlockCache.iNodeCount)
+    {
+        if (rootDirectoryCache->directoryEntries[fileIndex].filename[0] != EMPTY_STRING) {
+            rootDirectoryCache->location = fileIndex + 1; // getting next filename
+            strncpy(fname, rootDirectoryCache->directoryEntries[fileIndex].filename, MAX_FILENAME_LENGTH);
+            pthread_rwlock_unlock(&directoryLock);
+            return 1;
+        }
+        ++fileIndex;
+    }
+    rootDirectoryCache->location = START_INDEX; // Reset search location to start
+    pthread_rwlock_unlock(&directoryLock);
+
+    return NoError;
+}
+
+int sfs_sync() {
+    if (!diskMounted) {
+        return NoError;
+    }
+    if (commit_journal() < 0 || sync_block_cache() < 0 || sync_disk() != 0) {
+        printf("ERROR in sfs_sync: could not write the cached blocks back to the disk.\n");
+        return syncError;
+    }
+    return NoError;
+}
+
+int sfs_setcachesize(int budgetBytes) {
+    if (budgetBytes < 0) {
+        printf("ERROR in sfs_setcachesize: invalid cache budget.\n");
+        return setCacheSizeError;
+    }
+    cacheBudget = budgetBytes;
+    if (diskMounted) { // resize the live cache; dirty blocks are written back first
+        close_block_cache();
+        init_block_cache(superBlockCache.blockSize, cacheBudget);
+    }
+    return NoError;
+}
+
+int sfs_setscrubrate(int blocksPerSecond) {
+    if (blocksPerSecond < 0) {
+        printf("ERROR in sfs_setscrubrate: invalid scrub rate.\n");
+        return setScrubRateError;
+    }
+    scrubRate = blocksPerSecond;
+    if (diskMounted && scrub_disk(scrubRate) < 0) {
+        printf("ERROR in sfs_setscrubrate: could not start the disk scrubber.\n");
+        return setScrubRateError;
+    }
+    return NoError;
+}
+
+int sfs_setdedup(int enabled) {
+    dedupSetting = enabled != 0; // the index is built by mksfs, so the setting waits for the next mount
+    return NoError;
+}
+
+int sfs_getfilesize(const char* path) {
+    /**************ERROR CHECKING**************/
+    int lenPath = strlen(path);
+    if (lenPath < 1 || lenPath > MAX_FILENAME_LENGTH) {
+        printf("ERROR in sfs_getnextfilename: invalid path provided.\n");
+        return getfilesizeError;
+    }
+
+    /**************FUNCTION**************/
+    pthread_rwlock_rdlock(&directoryLock);
+    int fileIndex = lookupFile(path);
+    if (fileIndex != DIRECTORY_INDEX_END) {
+        pthread_rwlock_rdlock(&iNodeLocks[fileIndex]);
+        int fileSize = iNodesTableCache->iNodes[fileIndex].size;
+        pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+        pthread_rwlock_unlock(&directoryLock);
+        return fileSize;
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    printf("ERROR in sfs_getnextfilename: file does not exist.\n");
+    return getfilesizeError;
+}
+
+static int sfsFopen(char *fname) {
+    /**************ERROR CHECKING**************/
+    int lenName = strlen(fname);
+    if (lenName < 1 || lenName > MAX_FILENAME_LENGTH) {
+        printf("ERROR in sfs_fopen: invalid filename - exceeds bounds.\n");
+        return fOpenError;
+    }
+
+    /**************FUNCTION**************/
+    if (journal_begin_operation() < 0) {
+        printf("ERROR in sfs_fopen: the journal has no room left for the operation.\n");
+        return fOpenError;
+    }
+    pthread_rwlock_wrlock(&directoryLock);
+    // Case 1: open existing file if the root directory contains it; a file that is already open keeps its descriptor
+    int fileIndex = lookupFile(fname);
+    int fd = fOpenError;
+    if (fileIndex != DIRECTORY_INDEX_END) {
+        pthread_rwlock_wrlock(&iNodeLocks[fileIndex]);
+        pthread_mutex_lock(&descriptorLock);
+        fd = openFDTCache.fopenDescriptors[fileIndex];
+        if (fd == FDT_INITIALIZER_VALUE) {
+            fd = openDescriptor(fileIndex, OpenReadWrite, 0);
+            openFDTCache.fopenDescriptors[fileIndex] = fd;
+        }
+        if (fd >= 0) {
+            openFDTCache.openFiles[fd].read_writePointer = iNodesTableCache->iNodes[fileIndex].size; // append mode
+        }
+        pthread_mutex_unlock(&descriptorLock);
+        pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+
+    // Case 2: create new file in a free root directory slot
+    } else if ((fileIndex = createFile(fname)) != DIRECTORY_INDEX_END) {
+        pthread_mutex_lock(&descriptorLock);
+        fd = openDescriptor(fileIndex, OpenReadWrite, 0);
+        openFDTCache.fopenDescriptors[fileIndex] = fd;
+        pthread_mutex_unlock(&descriptorLock);
+
+    } else {
+        printf("ERROR in sfs_fopen: not enough space left to create a new file.\n");
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    journal_end_operation();
+
+    if (fileIndex != DIRECTORY_INDEX_END && fd < 0) {
+        printf("ERROR in sfs_fopen: no file descriptor is free.\n");
+    }
+    return fd;
+}
+
+int sfs_fopen(char *fname) {
+    double startUs = statsClockUs();
+    int fd = sfsFopen(fname);
+    recordOperation(StatsOpen, startUs);
+    return fd;
+}
+
+static int sfsOpen(char *fname, int flags) {
+    /**************ERROR CHECKING**************/
+    int lenName = strlen(fname);
+    if (lenName < 1 || lenName > MAX_FILENAME_LENGTH) {
+        printf("ERROR in sfs_open: invalid filename - exceeds bounds.\n");
+        return fOpenError;
+    }
+
+    if ((flags & OpenReadWrite) == 0) {
+        printf("ERROR in sfs_open: the file must be opened for reading or writing.\n");
+        return fOpenError;
+    }
+
+    /**************FUNCTION**************/
+    if (journal_begin_operation() < 0) {
+        printf("ERROR in sfs_open: the journal has no room left for the operation.\n");
+        return fOpenError;
+    }
+    if (flags & OpenCreate) {
+        pthread_rwlock_wrlock(&directoryLock);
+    } else {
+        pthread_rwlock_rdlock(&directoryLock); // opening existing files never waits for other opens
+    }
+    int fileIndex = lookupFile(fname);
+    if (fileIndex == DIRECTORY_INDEX_END && (flags & OpenCreate)) {
+        fileIndex = createFile(fname);
+    }
+    int fd = fOpenError;
+    if (fileIndex != DIRECTORY_INDEX_END) {
+        pthread_mutex_lock(&descriptorLock);
+        fd = openDescriptor(fileIndex, flags & OpenReadWrite, 0);
+        pthread_mutex_unlock(&descriptorLock);
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    journal_end_operation();
+
+    if (fd < 0) {
+        printf("ERROR in sfs_open: the file does not exist or no file descriptor is free.\n");
+    }
+    return fd;
+}
+
+int sfs_open(char *fname, int flags) {
+    double startUs = statsClockUs();
+    int fd = sfsOpen(fname, flags);
+    recordOperation(StatsOpen, startUs);
+    return fd;
+}
+
+int sfs_fclose(int fd) {
+    /**************ERROR CHECKING**************/
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
+        printf("ERROR in sfs_fclose: invalid file descriptor.\n");
+        return fCloseError;
+    }
+
+    /**************FUNCTION**************/
+    if (journal_begin_operation() < 0) {
+        printf("ERROR in sfs_fclose: the journal has no room left for the operation.\n");
+        return fCloseError;
+    }
+    pthread_rwlock_wrlock(&iNodeLocks[fileIndex]); // waits for the reads and writes in progress on the file
+    pthread_mutex_lock(&descriptorLock);
+    int stillOpen = openFDTCache.openFiles[fd].iNodeIndex == fileIndex; // unless another thread closed it meanwhile
+    int lastClose = stillOpen && closeDescriptor(fd) == 0;
+    pthread_mutex_unlock(&descriptorLock);
+    if (lastClose && iNodesTableCache->iNodes[fileIndex].linkCount == 0) { // removed while open: released now
+        pthread_mutex_lock(&metadataLock);
+        releaseINode(fileIndex);
+        returnFreeSlot(fileIndex);
+        flushMetadata();
+        pthread_mutex_unlock(&metadataLock);
+    }
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+    journal_end_operation();
+
+    if (!stillOpen) {
+        printf("ERROR in sfs_fclose: invalid file descriptor.\n");
+        return fCloseError;
+    }
+    return NoError;
+}
+
+static int sfsFseek(int fd, int location) {
+    /**************ERROR CHECKING**************/
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
+        printf("ERROR in sfs_fseek: invalid file descriptor.\n");
+        return fSeekError;
+    }
+
+    pthread_rwlock_rdlock(&iNodeLocks[fileIndex]);
+    if (descriptorINode(fd) != fileIndex) {
+        pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+        printf("ERROR in sfs_fseek: invalid file descriptor.\n");
+        return fSeekError;
+    }
+
+    if (location < 0 || location > iNodesTableCache->iNodes[fileIndex].size) {
+        pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+        printf("ERROR in sfs_fseek: location is out of file size bounds.\n");
+        return fSeekError;
+    }
+
+    /**************FUNCTION**************/
+    openFDTCache.openFiles[fd].read_writePointer = location;
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+
+    return NoError;
+}
+
+int sfs_fseek(int fd, int location) {
+    double startUs = statsClockUs();
+    int result = sfsFseek(fd, location);
+    recordOperation(StatsSeek, startUs);
+    return result;
+}
+
+/**
+ * @brief sequential readahead for a read of logical blocks [firstBlockIndex, lastBlockIndex]. While a descriptor's
+ *        reads follow each other, the next blocks of the file start loading into the block cache without waiting for
+ *        them, so the read only waits for its own blocks while the rest stay in flight. The window doubles every time
+ *        the reads get halfway through what was prefetched, and a read anywhere else resets it. Called with the file's
+ *        i-Node lock held.
+ */
+static void readAhead(OpenFile *openFile, int firstBlockIndex, int lastBlockIndex) {
+    iNode *iNodeOfFile = openFile->iNodeOfFile;
+    int fileBlocks = (iNodeOfFile->size + superBlockCache.blockSize - 1) / superBlockCache.blockSize;
+    int startBlock = 0;
+    int endBlock = 0;
+
+    pthread_mutex_lock(&descriptorLock); // descriptors may be shared by threads reading with sfs_pread
+    if (firstBlockIndex != openFile->readaheadNext && firstBlockIndex != openFile->readaheadNext - 1) {
+        openFile->readaheadWindow = 0;
+        openFile->readaheadEnd = lastBlockIndex + 1;
+    } else if (openFile->readaheadWindow == 0 || lastBlockIndex + openFile->readaheadWindow / 2 >= openFile->readaheadEnd) {
+        int window = openFile->readaheadWindow == 0 ? READAHEAD_MIN_BLOCKS : 2 * openFile->readaheadWindow;
+        openFile->readaheadWindow = window < READAHEAD_MAX_BLOCKS ? window : READAHEAD_MAX_BLOCKS;
+        startBlock = openFile->readaheadEnd > firstBlockIndex ? openFile->readaheadEnd : firstBlockIndex; // the read itself is served by the prefetch
+        endBlock = startBlock + openFile->readaheadWindow;
+        if (endBlock < lastBlockIndex + 1) {
+            endBlock = lastBlockIndex + 1;
+        }
+        if (endBlock > fileBlocks) {
+            endBlock = fileBlocks;
         }
-        void *buffer = (void*) malloc(DISK_BLOCK_SIZE * DIRECT_POINTERS); // CHANGE
-        memcpy(buffer, &iNodesTableCache, DISK_BLOCK_SIZE * DIRECT_POINTERS); // CHANGE
-        write_blocks(iNodeTableIndex, DIRECT_POINTERS, buffer); // CHANGE
-        free(buffer); // CHANGE
+        openFile->readaheadEnd = endBlock;
+    }
+    openFile->readaheadNext = lastBlockIndex + 1;
+    pthread_mutex_unlock(&descriptorLock);
+
+    if (startBlock >= endBlock) {
+        return;
+    }
+    int *blockNumbers = malloc((endBlock - startBlock) * sizeof(int));
+    pthread_mutex_lock(&metadataLock);
+    int mapped = mapFileBlocks(iNodeOfFile, startBlock, endBlock - startBlock, blockNumbers);
+    pthread_mutex_unlock(&metadataLock);
+    if (mapped >= 0) {
+        cached_prefetch_blocks_v(blockNumbers, endBlock - startBlock); // a failed prefetch is left to the read itself
+    }
+    free(blockNumbers);
+}
+
+/**
+ * @brief body of sfs_fread and sfs_pread, called with the file's i-Node lock held for reading. Reads from the given
+ *        position and advances it.
+ */
+static int readFile(int fd, int fileIndex, char *buf, int count, int *position) {
+    OpenFile *openFile = &openFDTCache.openFiles[fd];
+    if (descriptorINode(fd) != fileIndex || !(openFile->flags & OpenRead)) {
+        printf("ERROR in sfs_fread: invalid file descriptor.\n");
+        return fReadError;
+    }
+
+    iNode *iNodeOfFile = openFile->iNodeOfFile;
+    int fileSize = iNodeOfFile->size;
+    int rwPointer = *position;
+    int bytesToRead = count;
+    int blockSize = superBlockCache.blockSize;
+    char headBlock[blockSize]; // first block of the range when the range starts inside it
+    char tailBlock[blockSize]; // last block of the range when the range ends inside it
+    int blockStart;
+
+    if (fileSize < rwPointer + count) { // note: rwPointer is pointing to end of file from fopen
+        bytesToRead = fileSize - rwPointer;
+    }
+    if (bytesToRead <= 0) {
+        return 0;
+    }
+    if (iNodeOfFile->format == InlineFormat) { // no block to map or read
+        memcpy(buf, iNodeInlineData(iNodeOfFile) + rwPointer, bytesToRead);
+        *position = rwPointer + bytesToRead;
+        return bytesToRead;
+    }
+
+    // Only the logical blocks covering [rwPointer, rwPointer + bytesToRead) are read
+    int firstBlockIndex = rwPointer / blockSize;
+    int lastBlockIndex = (rwPointer + bytesToRead - 1) / blockSize;
+    int numBlocksToRead = lastBlockIndex - firstBlockIndex + 1;
+
+    readAhead(openFile, firstBlockIndex, lastBlockIndex);
+
+    int *blockNumbers = malloc(numBlocksToRead * sizeof(int));
+    void **blockBuffers = malloc(numBlocksToRead * sizeof(void *));
+    pthread_mutex_lock(&metadataLock); // the indirect cache is shared by every file
+    int mapped = mapFileBlocks(iNodeOfFile, firstBlockIndex, numBlocksToRead, blockNumbers);
+    pthread_mutex_unlock(&metadataLock);
+    if (mapped < 0) {
+        free(blockNumbers);
+        free(blockBuffers);
 
-    } else {
-        /**************INITLIAZE EXISTING DISK IN EMULATOR**************/
-        init_disk(diskName, DISK_BLOCK_SIZE, DISK_DATA_BLOCKS);
-        read_blocks(SuperBlockIndex, 1, &superBlockCache);
-        read_blocks(iNodeTableIndex, DIRECT_POINTERS, &iNodesTableCache);
-        read_blocks(RootDirectoryIndex, TOTAL_ROOT_DIRECTORY_BLOCKS-1, &rootDirectoryCache);
-        read_blocks(FreeBlockListIndex, 1, &freeBlockListCache);
+        printf("ERROR in sfs_fread: an invalid block number was requested.\n");
+        return fReadError;
     }
-    /**************INITLIAZE OPEN FILE DESCRIPTOR TABLE**************/
-    for (int fileIndex = 0; fileIndex < TOTAL_FILES; fileIndex++)
+    for (int blockIndex = firstBlockIndex; blockIndex <= lastBlockIndex; blockIndex++)
     {
-        openFDTCache.read_writePointers[fileIndex] = FDT_INITIALIZER_VALUE;
+        blockStart = blockIndex * blockSize;
+        if (blockStart < rwPointer) {
+            blockBuffers[blockIndex - firstBlockIndex] = headBlock;
+        } else if (blockStart + blockSize > rwPointer + bytesToRead) {
+            blockBuffers[blockIndex - firstBlockIndex] = tailBlock;
+        } else {
+            blockBuffers[blockIndex - firstBlockIndex] = buf + (blockStart - rwPointer); // whole block goes straight into the caller's buffer
+        }
     }
-}
+    countStat(&statistics.blockReads[StatsData], numBlocksToRead);
+    if (cached_read_blocks_v(blockNumbers, numBlocksToRead, blockBuffers) < 0) {
+        free(blockNumbers);
+        free(blockBuffers);
 
-int sfs_getnextfilename(char* fname) {
-    /**************ERROR CHECKING**************/
-    int lenName = strlen(fname);
-    if (lenName < 1 || lenName > MAX_FILENAME_LENGTH) {
-        printf("ERROR in sfs_getnextfilename: invalid filename - exceeds bounds.\n");
-        return getnextfilenameError;
+        printf("ERROR in sfs_fread: could not read the file blocks from the disk.\n");
+        return fReadError;
     }
 
-    /**************FUNCTION**************/
-    int fileIndex = 0;
-    while (fileIndex < TOTAL_FILES)
-    {
-        if (rootDirectoryCache.directoryEntries[fileIndex].filename[0] != EMPTY_STRING) {
-            rootDirectoryCache.location = fileIndex + 1; // getting next filename
-            write_blocks(RootDirectoryIndex, 4, &rootDirectoryCache);
-            strncpy(fname, rootDirectoryCache.directoryEntries[fileIndex].filename, MAX_FILENAME_LENGTH);
-            return fileIndex;
-        }
-        ++fileIndex;
+    // Copy the used part of the partially covered head and tail blocks
+    if (blockBuffers[0] == headBlock) {
+        int headOffset = rwPointer % blockSize;
+        int headBytes = blockSize - headOffset < bytesToRead ? blockSize - headOffset : bytesToRead;
+        memcpy(buf, headBlock + headOffset, headBytes);
+    }
+    if (blockBuffers[numBlocksToRead - 1] == tailBlock) {
+        blockStart = lastBlockIndex * blockSize;
+        memcpy(buf + (blockStart - rwPointer), tailBlock, rwPointer + bytesToRead - blockStart);
     }
-    rootDirectoryCache.location = 0; // Reset search location to start
-    write_blocks(RootDirectoryIndex, TOTAL_ROOT_DIRECTORY_BLOCKS-1, &rootDirectoryCache);
+    *position = rwPointer + bytesToRead;
 
-    return NoError;
+    free(blockNumbers);
+    free(blockBuffers);
+
+    return bytesToRead;
 }
 
-int sfs_getfilesize(const char* path) {
+static int sfsFread(int fd, char *buf, int count) {
     /**************ERROR CHECKING**************/
-    int lenPath = strlen(path);
-    if (lenPath < 1 || lenPath > MAX_FILENAME_LENGTH) {
-        printf("ERROR in sfs_getnextfilename: invalid path provided.\n");
-        return getfilesizeError;
+    if (count < 0) {
+        printf("ERROR in sfs_fread: invalid number of count bytes.\n");
+        return fReadError;
     }
 
-    /**************FUNCTION**************/
-    int fileIndex = 0;
-    int iNodeSize;
-    while (fileIndex < TOTAL_FILES)
-    {
-        if (strcmp(path, rootDirectoryCache.directoryEntries[fileIndex].filename) == 0) {
-            iNodeSize = iNodesTableCache.iNodes[fileIndex].size;
-            return iNodeSize;
-        }
-        ++fileIndex;
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
+        printf("ERROR in sfs_fread: invalid file descriptor.\n");
+        return fReadError;
     }
-    printf("ERROR in sfs_getnextfilename: file does not exist.\n");
-    return getfilesizeError;
+
+    /**************FUNCTION**************/
+    pthread_rwlock_rdlock(&iNodeLocks[fileIndex]); // other readers of the file go ahead, writers wait
+    int bytesRead = readFile(fd, fileIndex, buf, count, &openFDTCache.openFiles[fd].read_writePointer);
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+
+    return bytesRead;
 }
 
-int sfs_fopen(char *fname) {
+int sfs_fread(int fd, char *buf, int count) {
+    double startUs = statsClockUs();
+    int bytesRead = sfsFread(fd, buf, count);
+    recordOperation(StatsRead, startUs);
+    return bytesRead;
+}
+
+static int sfsPread(int fd, char *buf, int count, int offset) {
     /**************ERROR CHECKING**************/
-    int lenName = strlen(fname);
-    if (lenName < 1 || lenName > MAX_FILENAME_LENGTH) {
-        printf("ERROR in sfs_fopen: invalid filename - exceeds bounds.\n");
-        return fOpenError;
+    if (count < 0 || offset < 0) {
+        printf("ERROR in sfs_pread: invalid number of count bytes or offset.\n");
+        return fReadError;
+    }
+
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
+        printf("ERROR in sfs_pread: invalid file descriptor.\n");
+        return fReadError;
     }
 
     /**************FUNCTION**************/
-    // Case 1: open existing file if the root directory contains it
-    int fd = 0;
-    while (fd < TOTAL_FILES)
+    pthread_rwlock_rdlock(&iNodeLocks[fileIndex]);
+    int bytesRead = readFile(fd, fileIndex, buf, count, &offset); // the descriptor's read/write pointer is left alone
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+
+    return bytesRead;
+}
+
+int sfs_pread(int fd, char *buf, int count, int offset) {
+    double startUs = statsClockUs();
+    int bytesRead = sfsPread(fd, buf, count, offset);
+    recordOperation(StatsRead, startUs);
+    return bytesRead;
+}
+
+/**
+ * @brief body of sfs_pread_extents, called with the file's i-Node lock held for reading.
+ */
+static int mapReadExtents(int fd, int fileIndex, int count, int offset, SfsExtent *extents, int maxExtents) {
+    OpenFile *openFile = &openFDTCache.openFiles[fd];
+    if (descriptorINode(fd) != fileIndex || !(openFile->flags & OpenRead)) {
+        printf("ERROR in sfs_pread_extents: invalid file descriptor.\n");
+        return fReadError;
+    }
+
+    iNode *iNodeOfFile = openFile->iNodeOfFile;
+    int blockSize = superBlockCache.blockSize;
+    int bytesToMap = count;
+    if (iNodeOfFile->size - offset < count) {
+        bytesToMap = iNodeOfFile->size - offset;
+    }
+    if (bytesToMap <= 0 || maxExtents < 1) {
+        return 0;
+    }
+    if (iNodeOfFile->format == InlineFormat) { // no block to read from the disk
+        extents[0].length = bytesToMap;
+        extents[0].diskFd = -1;
+        extents[0].diskOffset = -1;
+        return 1;
+    }
+
+    int firstBlockIndex = offset / blockSize;
+    int numBlocks = (offset + bytesToMap - 1) / blockSize - firstBlockIndex + 1;
+    int *blockNumbers = malloc(numBlocks * sizeof(int));
+    char *dirty = malloc(numBlocks);
+    pthread_mutex_lock(&metadataLock);
+    int mapped = mapFileBlocks(iNodeOfFile, firstBlockIndex, numBlocks, blockNumbers);
+    pthread_mutex_unlock(&metadataLock);
+    if (mapped < 0) {
+        free(blockNumbers);
+        free(dirty);
+        printf("ERROR in sfs_pread_extents: an invalid block number was requested.\n");
+        return fReadError;
+    }
+    cached_dirty_blocks_v(blockNumbers, numBlocks, dirty);
+
+    // Blocks whose bytes are current on the disk join the extent before them when they follow it in the disk file,
+    // blocks dirty in the cache join the sfs_pread extent before them
+    int extentCount = 0;
+    int position = offset;
+    for (int blockIndex = 0; blockIndex < numBlocks; blockIndex++)
     {
-        if (strcmp(rootDirectoryCache.directoryEntries[fd].filename, fname) == 0) {
-            openFDTCache.read_writePointers[fd] = iNodesTableCache.iNodes[fd].size;
-            return fd;
+        int blockEnd = (firstBlockIndex + blockIndex + 1) * blockSize;
+        int length = (blockEnd < offset + bytesToMap ? blockEnd : offset + bytesToMap) - position;
+        long long diskOffset = dirty[blockIndex] ? -1 : (long long)blockNumbers[blockIndex] * blockSize + position % blockSize;
+        SfsExtent *last = extentCount > 0 ? &extents[extentCount - 1] : NULL;
+        if (last != NULL && (diskOffset < 0 ? last->diskOffset < 0 : last->diskOffset >= 0 && last->diskOffset + last->length == diskOffset)) {
+            last->length += length;
+        } else if (extentCount == maxExtents) {
+            last->diskOffset = -1; // the last extent takes the rest of the range
+            last->length += offset + bytesToMap - position;
+            break;
+        } else {
+            extents[extentCount].length = length;
+            extents[extentCount].diskFd = -1;
+            extents[extentCount].diskOffset = diskOffset;
+            ++extentCount;
         }
-        ++fd;
+        position += length;
     }
+    free(blockNumbers);
+    free(dirty);
 
-    // Case 2: create new file in a free root directory slot
-    fd = 0;
-    void *iNodeBuffer;
-    while (fd < TOTAL_FILES)
+    for (int extentIndex = 0; extentIndex < extentCount; extentIndex++)
     {
-        if (rootDirectoryCache.directoryEntries[fd].filename[0] == EMPTY_STRING) {
-            openFDTCache.read_writePointers[fd] = 0;
-            iNodesTableCache.iNodes[fd].size = 0;
-            strncpy(rootDirectoryCache.directoryEntries[fd].filename, fname, MAX_FILENAME_LENGTH);
-            iNodeBuffer = (void*) malloc(DISK_BLOCK_SIZE * DIRECT_POINTERS);
-            memcpy(iNodeBuffer, &iNodesTableCache, DISK_BLOCK_SIZE * DIRECT_POINTERS);
-            write_blocks(iNodeTableIndex, DIRECT_POINTERS, iNodeBuffer);
-            free(iNodeBuffer);
-            write_blocks(RootDirectoryIndex, TOTAL_ROOT_DIRECTORY_BLOCKS-1, &rootDirectoryCache);
-            return fd;
+        SfsExtent *extent = &extents[extentIndex];
+        if (extent->diskOffset < 0) {
+            continue;
+        }
+        int firstBlock = extent->diskOffset / blockSize;
+        int extentBlocks = (extent->diskOffset + extent->length - 1) / blockSize - firstBlock + 1;
+        extent->diskFd = read_blocks_fd(firstBlock, extentBlocks);
+        if (extent->diskFd < 0) { // a block failing its checksum is left to sfs_pread, which reports it
+            extent->diskOffset = -1;
+        } else {
+            countStat(&statistics.blockReads[StatsData], extentBlocks);
         }
-        ++fd;
     }
-
-    printf("ERROR in sfs_fopen: not enough space left to create a new file.\n");
-    return fOpenError;
+    return extentCount;
 }
 
-int sfs_fclose(int fd) {
+static int sfsPreadExtents(int fd, int count, int offset, SfsExtent *extents, int maxExtents) {
     /**************ERROR CHECKING**************/
-    if (fd < 0 || fd >= TOTAL_FILES || openFDTCache.read_writePointers[fd] < 0) {
-        printf("ERROR in sfs_fclose: invalid file descriptor.\n");
-        return fCloseError;
+    if (count < 0 || offset < 0) {
+        printf("ERROR in sfs_pread_extents: invalid number of count bytes or offset.\n");
+        return fReadError;
+    }
+
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
+        printf("ERROR in sfs_pread_extents: invalid file descriptor.\n");
+        return fReadError;
     }
 
     /**************FUNCTION**************/
-    openFDTCache.read_writePointers[fd] = FDT_INITIALIZER_VALUE;
+    pthread_rwlock_rdlock(&iNodeLocks[fileIndex]);
+    int extentCount = mapReadExtents(fd, fileIndex, count, offset, extents, maxExtents);
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+
+    return extentCount;
+}
+
+int sfs_pread_extents(int fd, int count, int offset, SfsExtent *extents, int maxExtents) {
+    double startUs = statsClockUs();
+    int extentCount = sfsPreadExtents(fd, count, offset, extents, maxExtents);
+    recordOperation(StatsRead, startUs);
+    return extentCount;
+}
+
+/**
+ * @brief moves the bytes of an inline file to its first data block, so the file can grow past the i-Node. The file
+ *        is left unchanged if no block is free. Called with the file's i-Node lock held for writing.
+ */
+static int spillInlineData(int fileIndex) {
+    iNode *iNodeOfFile = &iNodesTableCache->iNodes[fileIndex];
+    int fileSize = iNodeOfFile->size;
+    char inlineData[INODE_INLINE_BYTES];
+    char dataBlock[superBlockCache.blockSize];
+    int blockNumber;
 
+    pthread_mutex_lock(&metadataLock);
+    memcpy(inlineData, iNodeInlineData(iNodeOfFile), INODE_INLINE_BYTES);
+    resetBlockPointers(iNodeOfFile);
+    iNodeOfFile->format = dedupEnabled ? PointerFormat : SFS_INODE_FORMAT;
+    iNodeOfFile->size = 0; // the block is mapped from scratch
+    if (fileSize > 0 && growFile(iNodeOfFile, 1) < 0) {
+        memcpy(iNodeInlineData(iNodeOfFile), inlineData, INODE_INLINE_BYTES);
+        iNodeOfFile->format = InlineFormat;
+        iNodeOfFile->size = fileSize;
+        pthread_mutex_unlock(&metadataLock);
+        return blockMappingError;
+    }
+    if (fileSize > 0) {
+        memset(dataBlock, 0, superBlockCache.blockSize);
+        memcpy(dataBlock, inlineData, fileSize);
+        if (mapFileBlocks(iNodeOfFile, 0, 1, &blockNumber) < 0 || cached_write_blocks(blockNumber, 1, dataBlock) < 0) {
+            truncateFileBlocks(iNodeOfFile, 0);
+            resetBlockPointers(iNodeOfFile);
+            memcpy(iNodeInlineData(iNodeOfFile), inlineData, INODE_INLINE_BYTES);
+            iNodeOfFile->format = InlineFormat;
+            iNodeOfFile->size = fileSize;
+            flushMetadata();
+            pthread_mutex_unlock(&metadataLock);
+            return blockMappingError;
+        }
+        countStat(&statistics.blockWrites[StatsData], 1);
+    }
+    iNodeOfFile->size = fileSize;
+    markINodeDirty(fileIndex);
+    flushMetadata();
+    pthread_mutex_unlock(&metadataLock);
     return NoError;
 }
 
-int sfs_fseek(int fd, int location) {
-    /**************ERROR CHECKING**************/
-    if (location < 0 || location > iNodesTableCache.iNodes[fd].size) {
-        printf("ERROR in sfs_fseek: location is out of file size bounds.\n");
-        return fSeekError;
+/**
+ * @brief maps the logical blocks about to be written of a pointer-mapped file to their final disk blocks. A block
+ *        whose new bytes an indexed block already holds is mapped to that block instead of being written, and so
+ *        is one repeating the block before it; a shared block that is still to be written is copied to a block
+ *        of its own first. Compacts the block numbers, buffers and hashes down to the blocks left to write, which
+ *        leave the dedup index until they are written. Called with the file's i-Node lock held for writing.
+ *
+ * @return int number of blocks left to write, or blockMappingError if no block is free for a copy
+ */
+static int shareFileBlocks(int fileIndex, int firstBlockIndex, int numBlocks, int *blockNumbers, void **blockBuffers,
+                           uint64_t *blockHashes) {
+    iNode *iNodeOfFile = &iNodesTableCache->iNodes[fileIndex];
+    int blockSize = superBlockCache.blockSize;
+    int blocksToWrite = 0;
+    int noSpareBlocks = 0;
+
+    for (int blockIndex = 0; dedupEnabled && blockIndex < numBlocks; blockIndex++)
+    {
+        blockHashes[blockIndex] = blockHash(blockBuffers[blockIndex]);
     }
 
-    if (fd < 0 || fd >= TOTAL_FILES || openFDTCache.read_writePointers[fd] < 0) {
-        printf("ERROR in sfs_fread: invalid file descriptor.\n");
-        return fSeekError;
+    // Copies of shared blocks are allocated up front, so the write fails before anything changes
+    pthread_mutex_lock(&metadataLock);
+    int copiesNeeded = 0;
+    for (int blockIndex = 0; superBlockCache.sharedReferences > 0 && blockIndex < numBlocks; blockIndex++)
+    {
+        copiesNeeded += blockReferences[blockNumbers[blockIndex]] > 0;
+    }
+    int *copyBlocks = malloc((copiesNeeded + 1) * sizeof(int));
+    if (copiesNeeded > 0 && allocateBlocks(copiesNeeded, copyBlocks) < 0) {
+        pthread_mutex_unlock(&metadataLock);
+        free(copyBlocks);
+        return blockMappingError;
     }
 
-    /**************FUNCTION**************/
-    openFDTCache.read_writePointers[fd] = location;
+    for (int blockIndex = 0; blockIndex < numBlocks; blockIndex++)
+    {
+        int blockNumber = blockNumbers[blockIndex];
+        int duplicate = DEDUP_CHAIN_END;
+        if (dedupEnabled && blocksToWrite > 0 && blockHashes[blocksToWrite - 1] == blockHashes[blockIndex] &&
+            memcmp(blockBuffers[blocksToWrite - 1], blockBuffers[blockIndex], blockSize) == 0) {
+            duplicate = blockNumbers[blocksToWrite - 1]; // written by this call, so not indexed yet
+        } else if (dedupEnabled) {
+            // The blocks still to come are about to be overwritten, and sharing one would change the copies needed
+            duplicate = findDuplicateBlock(blockBuffers[blockIndex], blockHashes[blockIndex], blockNumbers + blockIndex + 1,
+                                           numBlocks - blockIndex - 1);
+        }
 
-    return NoError;
+        if (duplicate == blockNumber) { // the block already holds these bytes
+            countStat(&statistics.dedupBlocks, 1);
+            continue;
+        }
+        if (duplicate != DEDUP_CHAIN_END) {
+            setFileBlock(iNodeOfFile, firstBlockIndex + blockIndex, duplicate, NULL, &noSpareBlocks);
+            ++blockReferences[duplicate];
+            ++superBlockCache.sharedReferences;
+            superBlockDirty = 1;
+            releaseDataBlock(blockNumber);
+            countStat(&statistics.dedupBlocks, 1);
+            continue;
+        }
+        if (blockReferences[blockNumber] > 0) { // other files keep the old bytes
+            int copy = copyBlocks[--copiesNeeded];
+            setFileBlock(iNodeOfFile, firstBlockIndex + blockIndex, copy, NULL, &noSpareBlocks);
+            releaseDataBlock(blockNumber);
+            blockNumber = copy;
+            countStat(&statistics.copyOnWriteBlocks, 1);
+        } else {
+            unindexDataBlock(blockNumber); // its bytes are about to change
+        }
+        blockNumbers[blocksToWrite] = blockNumber;
+        blockBuffers[blocksToWrite] = blockBuffers[blockIndex];
+        blockHashes[blocksToWrite] = blockHashes[blockIndex];
+        ++blocksToWrite;
+    }
+    while (copiesNeeded > 0) // shared with an indexed block after all
+    {
+        freeBlock(copyBlocks[--copiesNeeded]);
+    }
+    markINodeDirty(fileIndex); // logged with the blocks released above, whichever operation flushes first
+    pthread_mutex_unlock(&metadataLock);
+    free(copyBlocks);
+    return blocksToWrite;
 }
 
-int sfs_fread(int fd, char *buf, int count) {
-    /**************ERROR CHECKING**************/
-    if (count < 0) {
-        printf("ERROR in sfs_fread: invalid number of count bytes.\n");
-        return fReadError;
-    }
+/**
+ * @brief frees the blocks a failed write mapped past the old end of the file, which hold nothing. Called with the
+ *        file's i-Node lock held for writing.
+ */
+static void abandonFileGrowth(int fileIndex, int oldSize) {
+    pthread_mutex_lock(&metadataLock);
+    truncateFileBlocks(&iNodesTableCache->iNodes[fileIndex], blocksFor(oldSize));
+    markINodeDirty(fileIndex);
+    flushMetadata();
+    pthread_mutex_unlock(&metadataLock);
+}
 
-    if (fd < 0 || fd >= TOTAL_FILES || openFDTCache.read_writePointers[fd] < 0) {
-        printf("ERROR in sfs_fread: invalid file descriptor.\n");
-        return fReadError;
+/**
+ * @brief body of sfs_fwrite and sfs_pwrite, called with the file's i-Node lock held for writing. Writes at the given
+ *        position and advances it.
+ */
+static int writeFile(int fd, int fileIndex, const char *buf, int count, int *position) {
+    OpenFile *openFile = &openFDTCache.openFiles[fd];
+    if (descriptorINode(fd) != fileIndex || !(openFile->flags & OpenWrite)) {
+        printf("ERROR in sfs_fwrite: invalid file descriptor.\n");
+        return fWriteError;
     }
 
-    /**************FUNCTION**************/
-    IndirectBlock *indirectBlock = NULL;
-    int fileSize = iNodesTableCache.iNodes[fd].size;
-    int rwPointer = openFDTCache.read_writePointers[fd];
-    int bytesToRead = count;
-    int numBlocksForFile = 0;
-    char *fileDataBuffer;
-    char *blockBuffer;
-    int blockNumber;
-    int blockIndex = 0;
-    int startAddress;
-    int blocksToRead = 1;
+    iNode *iNodeOfFile = openFile->iNodeOfFile;
+    int rwPointer = *position;
+    int oldSize = iNodeOfFile->size;
+    int blockSize = superBlockCache.blockSize;
+    char headBlock[blockSize]; // first block of the range when the range starts inside it
+    char tailBlock[blockSize]; // last block of the range when the range ends inside it
+    int blockStart;
 
-    if (fileSize < rwPointer + count) { // note: rwPointer is pointing to end of file from fopen
-        bytesToRead = fileSize - rwPointer;
+    if (count == 0) {
+        return 0;
+    }
+    if (rwPointer > oldSize) { // files have no holes
+        printf("ERROR in sfs_fwrite: the write starts past the end of the file.\n");
+        return fWriteError;
+    }
+    if (count > INT_MAX - rwPointer) {
+        printf("ERROR in sfs_fwrite: the file would exceed the largest file size.\n");
+        return fWriteError;
     }
 
-    numBlocksForFile = (fileSize / DISK_BLOCK_SIZE) + ((fileSize % DISK_BLOCK_SIZE) != 0); // get number of blocks the file is using
-    fileDataBuffer = (void*) malloc(numBlocksForFile * DISK_BLOCK_SIZE);
-    blockBuffer = (void*) malloc(DISK_BLOCK_SIZE); // buffer to temporarily store each block
-    void *tempBuffer = (void*) malloc(DISK_BLOCK_SIZE);
+    // A small enough file is written in its i-Node with the metadata; one that outgrows it moves to data blocks
+    if (iNodeOfFile->format == InlineFormat && rwPointer + count <= INODE_INLINE_BYTES) {
+        pthread_mutex_lock(&metadataLock);
+        memcpy(iNodeInlineData(iNodeOfFile) + rwPointer, buf, count);
+        if (rwPointer + count > oldSize) {
+            iNodeOfFile->size = rwPointer + count;
+        }
+        markINodeDirty(fileIndex);
+        flushMetadata();
+        pthread_mutex_unlock(&metadataLock);
+        *position = rwPointer + count;
+        return count;
+    }
+    if (iNodeOfFile->format == InlineFormat && spillInlineData(fileIndex) < 0) {
+        printf("ERROR in sfs_fwrite: not enough free blocks to complete block allocation request.\n");
+        return fWriteError;
+    }
 
-    memset(fileDataBuffer, 0, numBlocksForFile * DISK_BLOCK_SIZE);
-    memset(blockBuffer, 0, DISK_BLOCK_SIZE);
+    // Only the logical blocks overlapping [rwPointer, rwPointer + count) are touched
+    int firstBlockIndex = rwPointer / blockSize;
+    int lastBlockIndex = (rwPointer + count - 1) / blockSize;
+    int numBlocksToWrite = lastBlockIndex - firstBlockIndex + 1;
 
-    while (blockIndex < numBlocksForFile)
-    {
-        if (blockIndex < DIRECT_POINTERS) {
-            blockNumber = iNodesTableCache.iNodes[fd].directPointers[blockIndex];
-        } else {
-            if (indirectBlock == NULL) {
-                startAddress = iNodesTableCache.iNodes[fd].indirectPointer;
-                read_blocks(startAddress, 1, tempBuffer);
-                indirectBlock = tempBuffer;
-            }
-            if (blockIndex - DIRECT_POINTERS >= INDIRECT_POINTERS) {
-                free(indirectBlock);
-                free(fileDataBuffer);
-                free(blockBuffer);
-                // free(tempBuffer);
-
-                printf("ERROR in sfs_fread: not enough blocks to complete block allocation request.\n");
-                return fReadError;
+    // New blocks are only allocated for the part of the range that extends the file, all in one batch
+    pthread_mutex_lock(&metadataLock);
+    if (growFile(iNodeOfFile, lastBlockIndex + 1) < 0) {
+        pthread_mutex_unlock(&metadataLock);
+        if (dedupEnabled && iNodeOfFile->format == PointerFormat && numBlocksToWrite > 1) {
+            // Most new blocks may end up shared: a block at a time, the write only needs room for one of them
+            int bytesWritten = 0;
+            while (bytesWritten < count)
+            {
+                int chunk = blockSize - (rwPointer + bytesWritten) % blockSize;
+                chunk = chunk < count - bytesWritten ? chunk : count - bytesWritten;
+                if (writeFile(fd, fileIndex, buf + bytesWritten, chunk, position) < 0) {
+                    return bytesWritten > 0 ? bytesWritten : fWriteError;
+                }
+                bytesWritten += chunk;
             }
-            blockNumber = indirectBlock->blockOfPointers[blockIndex - DIRECT_POINTERS];
+            return count;
+        }
+        printf("ERROR in sfs_fwrite: not enough free blocks to complete block allocation request.\n");
+        return fWriteError;
+    }
+
+    int *blockNumbers = malloc(numBlocksToWrite * sizeof(int));
+    void **blockBuffers = malloc(numBlocksToWrite * sizeof(void *));
+    int partialBlockNumbers[2];
+    void *partialBlockBuffers[2];
+    int partialBlocksToRead = 0;
+    int mapped = mapFileBlocks(iNodeOfFile, firstBlockIndex, numBlocksToWrite, blockNumbers);
+    pthread_mutex_unlock(&metadataLock);
+    if (mapped < 0) { // an indirect block could not be read: nothing is written
+        abandonFileGrowth(fileIndex, oldSize);
+        free(blockNumbers);
+        free(blockBuffers);
+        printf("ERROR in sfs_fwrite: an invalid block number was requested.\n");
+        return fWriteError;
+    }
+    for (int blockIndex = firstBlockIndex; blockIndex <= lastBlockIndex; blockIndex++)
+    {
+        int blockNumber = blockNumbers[blockIndex - firstBlockIndex];
+        blockStart = blockIndex * blockSize;
+        if (blockStart >= rwPointer && blockStart + blockSize <= rwPointer + count) {
+            blockBuffers[blockIndex - firstBlockIndex] = (char *)buf + (blockStart - rwPointer); // whole block is written straight from the caller's buffer
+            continue;
         }
-        if (blockNumber < 0) {
-            free(indirectBlock);
-            free(fileDataBuffer);
-            free(blockBuffer);
-            // free(tempBuffer);
 
-            printf("ERROR in sfs_fread: an invalid block number was requested.\n");
-            return fReadError;
+        // Head and tail blocks are read-modify-write; a block past the old end of file has nothing to read
+        char *partialBlock = blockStart < rwPointer ? headBlock : tailBlock;
+        blockBuffers[blockIndex - firstBlockIndex] = partialBlock;
+        if (blockStart < oldSize) {
+            partialBlockNumbers[partialBlocksToRead] = blockNumber;
+            partialBlockBuffers[partialBlocksToRead] = partialBlock;
+            ++partialBlocksToRead;
+        } else {
+            memset(partialBlock, 0, blockSize);
+        }
+    }
+    if (partialBlocksToRead > 0) {
+        countStat(&statistics.blockReads[StatsData], partialBlocksToRead);
+        if (cached_read_blocks_v(partialBlockNumbers, partialBlocksToRead, partialBlockBuffers) < 0) {
+            abandonFileGrowth(fileIndex, oldSize);
+            free(blockNumbers);
+            free(blockBuffers);
+            printf("ERROR in sfs_fwrite: could not read the file blocks from the disk.\n");
+            return fWriteError;
         }
-        read_blocks(blockNumber, blocksToRead, blockBuffer);
-        memcpy(fileDataBuffer + (blockIndex * DISK_BLOCK_SIZE), blockBuffer, DISK_BLOCK_SIZE); // Copy data into file buffer
-        ++blockIndex;
     }
-    memcpy(buf, fileDataBuffer + rwPointer, bytesToRead);
-    openFDTCache.read_writePointers[fd] = rwPointer + bytesToRead;
+    if (blockBuffers[0] == headBlock) {
+        int headOffset = rwPointer % blockSize;
+        int headBytes = blockSize - headOffset < count ? blockSize - headOffset : count;
+        memcpy(headBlock + headOffset, buf, headBytes);
+    }
+    if (blockBuffers[numBlocksToWrite - 1] == tailBlock) {
+        blockStart = lastBlockIndex * blockSize;
+        memcpy(tailBlock, buf + (blockStart - rwPointer), rwPointer + count - blockStart);
+    }
 
-    free(indirectBlock);
-    free(fileDataBuffer);
-    free(blockBuffer);
-    // free(tempBuffer);
 
-    return bytesToRead;
+    // Pointer-mapped files share blocks holding the same bytes, and copy shared blocks before overwriting them
+    uint64_t *blockHashes = calloc(numBlocksToWrite, sizeof(uint64_t));
+    int blocksToWrite = numBlocksToWrite;
+    if (iNodeOfFile->format == PointerFormat) {
+        blocksToWrite = shareFileBlocks(fileIndex, firstBlockIndex, numBlocksToWrite, blockNumbers, blockBuffers, blockHashes);
+    }
+    if (blocksToWrite < 0) {
+        free(blockNumbers);
+        free(blockBuffers);
+        free(blockHashes);
+        printf("ERROR in sfs_fwrite: not enough free blocks to complete block allocation request.\n");
+        return fWriteError;
+    }
+    if (blocksToWrite > 0 && cached_write_blocks_v(blockNumbers, blocksToWrite, blockBuffers) < 0) {
+        abandonFileGrowth(fileIndex, oldSize);
+        free(blockNumbers);
+        free(blockBuffers);
+        free(blockHashes);
+        printf("ERROR in sfs_fwrite: could not write the file blocks to the disk.\n");
+        return fWriteError;
+    }
+    countStat(&statistics.blockWrites[StatsData], blocksToWrite);
+
+    *position = rwPointer + count;
+    pthread_mutex_lock(&metadataLock);
+    if (rwPointer + count > oldSize) {
+        iNodeOfFile->size = rwPointer + count; // keep the original file size if the write ends before the end of file
+    }
+    for (int blockIndex = 0; dedupEnabled && iNodeOfFile->format == PointerFormat && blockIndex < blocksToWrite; blockIndex++)
+    {
+        indexDataBlock(blockNumbers[blockIndex], blockHashes[blockIndex]); // only now do the blocks hold their bytes
+    }
+    markINodeDirty(fileIndex);
+    flushMetadata();
+    pthread_mutex_unlock(&metadataLock);
+    free(blockNumbers);
+    free(blockBuffers);
+    free(blockHashes);
+
+    return count;
 }
 
-int sfs_fwrite(int fd, const char *buf, int count) {
+/**
+ * @brief commits the running transaction first if a write of the given size may need the blocks it freed, which are
+ *        only handed out again once it is committed. Called before journal_begin_operation.
+ */
+static void reclaimReleasedBlocks(size_t bytesNeeded) {
+    pthread_mutex_lock(&allocatorLock);
+    int reclaim = releasedBlockCount > 0 &&
+                  freeBlockCount - releasedBlockCount < blocksFor(bytesNeeded) + INDIRECT_LEVELS + 1; // and the indirect blocks
+    pthread_mutex_unlock(&allocatorLock);
+    if (reclaim) {
+        commit_journal();
+    }
+}
+
+static int sfsFwrite(int fd, const char *buf, int count) {
     /**************ERROR CHECKING**************/
     if (count < 0) {
         printf("ERROR in sfs_fwrite: invalid number of count bytes.\n");
         return fWriteError;
     }
 
-    if (fd < 0 || fd >= TOTAL_FILES || openFDTCache.read_writePointers[fd] < 0) {
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
         printf("ERROR in sfs_fwrite: invalid file descriptor.\n");
         return fWriteError;
     }
 
-    if (strlen(buf) > DISK_BLOCK_SIZE * DISK_DATA_BLOCKS) {
+    if (count > (long long)superBlockCache.blockSize * superBlockCache.fileSystemSize) {
         printf("ERROR in sfs_fwrite: number of bytes written to disk is out of range.\n");
         return fWriteError;
     }
 
     /**************FUNCTION**************/
-    iNode iNodeOfFile = iNodesTableCache.iNodes[fd];
-    int rwPointer = openFDTCache.read_writePointers[fd];
-    int fileSize;
-    int numBlocksForFile;
-    void *iNodeBuffer;
-
-    // Update file size and number of blocks required for the file
-    int newSize = rwPointer + count;
-    if (newSize > iNodeOfFile.size) {
-        fileSize = newSize;
-        numBlocksForFile = (fileSize / DISK_BLOCK_SIZE) + ((fileSize % DISK_BLOCK_SIZE) != 0); // ceiling of fileSize / DISK_BLOCK_SIZE
-    }
-    else {
-        fileSize = iNodeOfFile.size; // keep the original file size if new size is smaller than current size
-        numBlocksForFile = (fileSize / DISK_BLOCK_SIZE) + ((fileSize % DISK_BLOCK_SIZE) != 0);
-    }
-
-    // To write to a file, it is first necessary to get existing data from a file and then append the new data bytes.
-    char *fileDataBuffer = malloc(numBlocksForFile * DISK_BLOCK_SIZE);
-    sfs_fseek(fd, 0);
-    sfs_fread(fd, fileDataBuffer, iNodeOfFile.size);
-    sfs_fseek(fd, openFDTCache.read_writePointers[fd]); // read_writePointer has not been updated yet, is it is currently at end of old file
-    memcpy(fileDataBuffer + rwPointer, buf, count);  // appending the fileDataBuffer with the buf bytes
-
-    // Given the new amount of file data, it is necessary to redestribute it amongst a new amount of blocks.
-    IndirectBlock *indirectBlock = NULL;
-    int blockIndexInFreeBlockList = 0;
-    int indirectBlockAddressPointer = 0;
-    int blockIndex = 0;
-    int startAddress;
-    int blocksToRead = 1;
-    void *tempBuffer = (void*) malloc(DISK_BLOCK_SIZE);
-    while (blockIndex < numBlocksForFile)
-    {
-        if (blockIndex < DIRECT_POINTERS) { // will later distribute file information bytes amongst direct i-Node pointers
-            blockIndexInFreeBlockList = iNodeOfFile.directPointers[blockIndex];
-            if (blockIndexInFreeBlockList < 0) { // unused block
-                blockIndexInFreeBlockList = allocateBlock();
-                iNodesTableCache.iNodes[fd].directPointers[blockIndex] = blockIndexInFreeBlockList;
-            }
-        } else { // will later distribute file information bytes amongst indirect i-Node pointers b/c ran out of direct pointers
-            if (iNodeOfFile.indirectPointer < 0) { // Uninitialized indirect block
-                indirectBlockAddressPointer = allocateBlock();
-                iNodeOfFile.indirectPointer = indirectBlockAddressPointer;  // Get new indirect block
-                iNodesTableCache.iNodes[fd].indirectPointer = indirectBlockAddressPointer;
-                IndirectBlock indirect;
-                for (int indirectPointerIndex = 0; indirectPointerIndex < INDIRECT_POINTERS; indirectPointerIndex++) {
-                    indirect.blockOfPointers[indirectPointerIndex] = -1; // Reset indirect pointers
-                }
-                blockIndexInFreeBlockList = allocateBlock();
-                indirect.blockOfPointers[0] = blockIndexInFreeBlockList;
-                write_blocks(indirectBlockAddressPointer, 1, &indirect);
-            } else { // indirect block initialized
-                if (indirectBlock == NULL) {
-                    startAddress = iNodeOfFile.indirectPointer;
-                    read_blocks(startAddress, blocksToRead, tempBuffer);
-                    indirectBlock = tempBuffer;
-                }
-                if (blockIndex - DIRECT_POINTERS >= INDIRECT_POINTERS) {
-                    free(fileDataBuffer);
-                    free(indirectBlock);
-                    printf("ERROR in sfs_fwrite: not enough blocks to complete block allocation request.\n");
-                    return fWriteError;
-                }
-                blockIndexInFreeBlockList = indirectBlock->blockOfPointers[blockIndex - DIRECT_POINTERS];
-                if (blockIndexInFreeBlockList < 0) {  // uninitialized indirect block
-                    blockIndexInFreeBlockList = allocateBlock();
-                    indirectBlock->blockOfPointers[blockIndex - DIRECT_POINTERS] = blockIndexInFreeBlockList;
-                    write_blocks(iNodeOfFile.indirectPointer, 1, indirectBlock);
-                }
+    reclaimReleasedBlocks(count);
+    if (journal_begin_operation() < 0) {
+        printf("ERROR in sfs_fwrite: the journal has no room left for the operation.\n");
+        return fWriteError;
+    }
+    pthread_rwlock_wrlock(&iNodeLocks[fileIndex]);
+    int bytesWritten = writeFile(fd, fileIndex, buf, count, &openFDTCache.openFiles[fd].read_writePointer);
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+    journal_end_operation();
+
+    return bytesWritten;
+}
+
+int sfs_fwrite(int fd, const char *buf, int count) {
+    double startUs = statsClockUs();
+    int bytesWritten = sfsFwrite(fd, buf, count);
+    recordOperation(StatsWrite, startUs);
+    return bytesWritten;
+}
+
+static int sfsPwrite(int fd, const char *buf, int count, int offset) {
+    /**************ERROR CHECKING**************/
+    if (count < 0 || offset < 0) {
+        printf("ERROR in sfs_pwrite: invalid number of count bytes or offset.\n");
+        return fWriteError;
+    }
+
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
+        printf("ERROR in sfs_pwrite: invalid file descriptor.\n");
+        return fWriteError;
+    }
+
+    if (count > (long long)superBlockCache.blockSize * superBlockCache.fileSystemSize) {
+        printf("ERROR in sfs_pwrite: number of bytes written to disk is out of range.\n");
+        return fWriteError;
+    }
+
+    /**************FUNCTION**************/
+    reclaimReleasedBlocks(count);
+    if (journal_begin_operation() < 0) {
+        printf("ERROR in sfs_pwrite: the journal has no room left for the operation.\n");
+        return fWriteError;
+    }
+    pthread_rwlock_wrlock(&iNodeLocks[fileIndex]);
+    int bytesWritten = writeFile(fd, fileIndex, buf, count, &offset); // the descriptor's read/write pointer is left alone
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+    journal_end_operation();
+
+    return bytesWritten;
+}
+
+int sfs_pwrite(int fd, const char *buf, int count, int offset) {
+    double startUs = statsClockUs();
+    int bytesWritten = sfsPwrite(fd, buf, count, offset);
+    recordOperation(StatsWrite, startUs);
+    return bytesWritten;
+}
+
+/**
+ * @brief body of sfs_ftruncate, called with the file's i-Node lock held for writing.
+ */
+static int truncateFile(int fd, int fileIndex, int length) {
+    OpenFile *openFile = &openFDTCache.openFiles[fd];
+    if (descriptorINode(fd) != fileIndex || !(openFile->flags & OpenWrite)) {
+        printf("ERROR in sfs_ftruncate: invalid file descriptor.\n");
+        return fTruncateError;
+    }
+
+    iNode *iNodeOfFile = openFile->iNodeOfFile;
+    int blockSize = superBlockCache.blockSize;
+    int position = iNodeOfFile->size;
+
+    // Growing: the new bytes are zeros written like any other data, so the file still has no holes
+    if (length > position) {
+        int chunkBytes = TRUNCATE_ZERO_BLOCKS * blockSize;
+        char *zeros = calloc(chunkBytes, 1);
+        while (position < length)
+        {
+            int bytesToWrite = length - position < chunkBytes ? length - position : chunkBytes;
+            if (writeFile(fd, fileIndex, zeros, bytesToWrite, &position) < 0) {
+                free(zeros);
+                printf("ERROR in sfs_ftruncate: could not extend the file.\n");
+                return fTruncateError;
             }
         }
-        if (blockIndexInFreeBlockList < 0 || blockIndexInFreeBlockList >= DISK_DATA_BLOCKS) { // block index outside bounds
-            free(indirectBlock);
-            free(fileDataBuffer);
-            printf("ERROR in sfs_fwrite: not enough free blocks to complete block allocation request.\n");
-            return fWriteError;
+        free(zeros);
+        return NoError;
+    }
+
+    // Shrinking: only the blocks past the new end are freed; an emptied file goes back to keeping its bytes inline
+    if (length < position) {
+        pthread_mutex_lock(&metadataLock);
+        truncateFileBlocks(iNodeOfFile, (length + blockSize - 1) / blockSize);
+        if (length == 0 && SFS_INLINE_DATA) {
+            resetBlockPointers(iNodeOfFile);
+            iNodeOfFile->format = InlineFormat;
         }
-        write_blocks(blockIndexInFreeBlockList, 1, fileDataBuffer + (blockIndex * DISK_BLOCK_SIZE));
-        ++blockIndex;
+        iNodeOfFile->size = length;
+        markINodeDirty(fileIndex);
+        flushMetadata();
+        pthread_mutex_unlock(&metadataLock);
+    }
+    return NoError;
+}
+
+int sfs_ftruncate(int fd, int length) {
+    /**************ERROR CHECKING**************/
+    if (length < 0) {
+        printf("ERROR in sfs_ftruncate: invalid file length.\n");
+        return fTruncateError;
     }
-    free(indirectBlock);
-    free(fileDataBuffer);
 
-    openFDTCache.read_writePointers[fd] = fileSize;
-    iNodesTableCache.iNodes[fd].size = fileSize;
-    iNodeBuffer = (void*) malloc(DISK_BLOCK_SIZE * DIRECT_POINTERS);
-    memcpy(iNodeBuffer, &iNodesTableCache, DISK_BLOCK_SIZE * DIRECT_POINTERS);
-    write_blocks(iNodeTableIndex, DIRECT_POINTERS, iNodeBuffer);
-    free(iNodeBuffer);
+    int fileIndex = descriptorINode(fd);
+    if (fileIndex == FDT_INITIALIZER_VALUE) {
+        printf("ERROR in sfs_ftruncate: invalid file descriptor.\n");
+        return fTruncateError;
+    }
 
-    return count;
+    /**************FUNCTION**************/
+    reclaimReleasedBlocks(length);
+    if (journal_begin_operation() < 0) {
+        printf("ERROR in sfs_ftruncate: the journal has no room left for the operation.\n");
+        return fTruncateError;
+    }
+    pthread_rwlock_wrlock(&iNodeLocks[fileIndex]);
+    int result = truncateFile(fd, fileIndex, length);
+    pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+    journal_end_operation();
+
+    return result;
 }
 
-int sfs_remove(char *fname) {
+static int sfsRemove(char *fname) {
     /**************ERROR CHECKING**************/
     int lenName = strlen(fname);
     if (lenName < 1 || lenName > MAX_FILENAME_LENGTH) {
@@ -432,57 +2741,130 @@ int sfs_remove(char *fname) {
     }
 
     /**************FUNCTION**************/
-    int fileIndex = 0;
-    int blockIndex = 0;
-    IndirectBlock *indirectBlock;
-    void *tempBuffer;
-    int blocksToRead = 1;
-    int startAddress;
-    void *iNodeBuffer;
-    while (fileIndex < TOTAL_FILES)
-    {
-        if (strcmp(rootDirectoryCache.directoryEntries[fileIndex].filename, fname) == 0) {
-            iNodesTableCache.iNodes[fileIndex].linkCount = -1;
-            iNodesTableCache.iNodes[fileIndex].size = -1;
-
-            for (int directPointerIndex = 0; directPointerIndex < DIRECT_POINTERS; directPointerIndex++)
-            {
-                blockIndex = iNodesTableCache.iNodes[fileIndex].directPointers[directPointerIndex];
-                if (blockIndex != -1) {
-                    freeBlockListCache.data[blockIndex] = FreeBlock;
-                }
-                iNodesTableCache.iNodes[fileIndex].directPointers[directPointerIndex] = -1;
-            }
+    if (journal_begin_operation() < 0) {
+        printf("ERROR in sfs_fremove: the journal has no room left for the operation.\n");
+        return fRemoveError;
+    }
+    pthread_rwlock_wrlock(&directoryLock);
+    int fileIndex = lookupFile(fname);
+    if (fileIndex != DIRECTORY_INDEX_END) {
+        pthread_rwlock_wrlock(&iNodeLocks[fileIndex]); // waits for the reads and writes in progress on the file
+        pthread_mutex_lock(&descriptorLock);
+        if (openFDTCache.fopenDescriptors[fileIndex] != FDT_INITIALIZER_VALUE) { // closed, as it always was
+            closeDescriptor(openFDTCache.fopenDescriptors[fileIndex]);
+        }
+        int openCount = openFDTCache.openCounts[fileIndex];
+        pthread_mutex_unlock(&descriptorLock);
+        pthread_mutex_lock(&metadataLock);
+        unindexDirectoryEntry(fileIndex); // before the name is cleared: the bucket is found from it
+        rootDirectoryCache->directoryEntries[fileIndex].filename[0] = EMPTY_STRING;
+        markDirectoryEntryDirty(fileIndex);
+        if (openCount > 0) {
+            iNodesTableCache->iNodes[fileIndex].linkCount = 0; // released by the last sfs_fclose, or by the next mount
+            markINodeDirty(fileIndex);
+        } else {
+            releaseINode(fileIndex);
+            returnFreeSlot(fileIndex);
+        }
+        flushMetadata();
+        pthread_mutex_unlock(&metadataLock);
+        pthread_rwlock_unlock(&iNodeLocks[fileIndex]);
+        pthread_rwlock_unlock(&directoryLock);
+        journal_end_operation();
 
-            if (iNodesTableCache.iNodes[fileIndex].indirectPointer != -1) {
-                tempBuffer = (void*) malloc(DISK_BLOCK_SIZE);
-                startAddress = iNodesTableCache.iNodes[fileIndex].indirectPointer;
-                read_blocks(startAddress, blocksToRead, tempBuffer);
-                indirectBlock = tempBuffer;
-                for (int indirectPointerIndex = 0; indirectPointerIndex < INDIRECT_POINTERS; indirectPointerIndex++)
-                {
-                    blockIndex = indirectBlock->blockOfPointers[indirectPointerIndex];
-                    if (blockIndex != -1) {
-                        freeBlockListCache.data[blockIndex] = FreeBlock;
-                    }
-                }
-                iNodesTableCache.iNodes[fileIndex].indirectPointer = -1;
-                free(indirectBlock);
-            }
-            openFDTCache.read_writePointers[fileIndex] = -1;
-            rootDirectoryCache.directoryEntries[fileIndex].filename[0] = EMPTY_STRING;
+        return NoError;
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    journal_end_operation();
+    printf("ERROR in sfs_fremove: file to remove is not found in the root directory.\n");
+    return fRemoveError;
+}
 
-            write_blocks(RootDirectoryIndex, TOTAL_ROOT_DIRECTORY_BLOCKS-1, &rootDirectoryCache);
-            write_blocks(FreeBlockListIndex, 1, &freeBlockListCache);
-            iNodeBuffer = (void*) malloc(DISK_BLOCK_SIZE * DIRECT_POINTERS);
-            memcpy(iNodeBuffer, &iNodesTableCache, DISK_BLOCK_SIZE * DIRECT_POINTERS);
-            write_blocks(iNodeTableIndex, DIRECT_POINTERS, iNodeBuffer);
-            free(iNodeBuffer);
+int sfs_remove(char *fname) {
+    double startUs = statsClockUs();
+    int result = sfsRemove(fname);
+    recordOperation(StatsRemove, startUs);
+    return result;
+}
 
-            return NoError;
+void sfs_get_stats(SfsStats *stats) {
+    long long *counters = (long long *)&statistics;
+    long long *copies = (long long *)stats;
+    for (size_t counter = 0; counter < offsetof(SfsStats, cache) / sizeof(long long); counter++)
+    {
+        copies[counter] = __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+    }
+    get_block_cache_stats(&stats->cache);
+    get_disk_times(&stats->disk);
+}
+
+void sfs_reset_stats() {
+    long long *counters = (long long *)&statistics;
+    for (size_t counter = 0; counter < offsetof(SfsStats, cache) / sizeof(long long); counter++)
+    {
+        __atomic_store_n(&counters[counter], 0, __ATOMIC_RELAXED);
+    }
+    reset_block_cache_stats();
+    reset_disk_times();
+}
+
+/**
+ * @brief appends a formatted line to the stats text, counting its whole length even past the end of the buffer.
+ */
+static void appendStat(char *buf, int size, int *length, const char *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int room = *length < size ? size - *length : 0;
+    *length += vsnprintf(room > 0 ? buf + *length : NULL, room, format, arguments);
+    va_end(arguments);
+}
+
+int sfs_format_stats(char *buf, int size) {
+    static const char *operationNames[STATS_OPERATIONS] = {"open", "read", "write", "seek", "remove"};
+    static const char *purposeNames[STATS_PURPOSES] = {"data", "indirect", "inode_table", "directory", "bitmap", "super_block"};
+    SfsStats stats;
+    int length = 0;
+
+    sfs_get_stats(&stats);
+    for (int operation = 0; operation < STATS_OPERATIONS; operation++)
+    {
+        // Latencies are whole microseconds, so bucket b holds the calls of at most 2^b - 1 us
+        long long cumulative = 0;
+        for (int bucket = 0; bucket < STATS_LATENCY_BUCKETS - 1; bucket++)
+        {
+            cumulative += stats.latencyHistogram[operation][bucket];
+            appendStat(buf, size, &length, "sfs_operation_latency_us_bucket{op=\"%s\",le=\"%lld\"} %lld\n",
+                       operationNames[operation], (1LL << bucket) - 1, cumulative);
         }
-        ++fileIndex;
+        appendStat(buf, size, &length, "sfs_operation_latency_us_bucket{op=\"%s\",le=\"+Inf\"} %lld\n",
+                   operationNames[operation], stats.calls[operation]);
+        appendStat(buf, size, &length, "sfs_operation_latency_us_sum{op=\"%s\"} %lld\n", operationNames[operation], stats.latencyUs[operation]);
+        appendStat(buf, size, &length, "sfs_operation_latency_us_count{op=\"%s\"} %lld\n", operationNames[operation], stats.calls[operation]);
     }
-    printf("ERROR in sfs_fremove: file to remove is not found in the root directory.\n");
-    return fRemoveError;
-}
\ No newline at end of file
+    for (int purpose = 0; purpose < STATS_PURPOSES; purpose++)
+    {
+        appendStat(buf, size, &length, "sfs_block_reads{purpose=\"%s\"} %lld\n", purposeNames[purpose], stats.blockReads[purpose]);
+        appendStat(buf, size, &length, "sfs_block_writes{purpose=\"%s\"} %lld\n", purposeNames[purpose], stats.blockWrites[purpose]);
+    }
+
+    long long cacheLookups = stats.cache.hits + stats.cache.misses;
+    long long indirectLookups = stats.indirectCacheHits + stats.indirectCacheMisses;
+    appendStat(buf, size, &length, "sfs_block_cache_hits %lld\nsfs_block_cache_misses %lld\nsfs_block_cache_hit_ratio %.4f\n",
+               stats.cache.hits, stats.cache.misses, cacheLookups > 0 ? (double)stats.cache.hits / cacheLookups : 0.0);
+    appendStat(buf, size, &length, "sfs_block_cache_prefetched %lld\nsfs_block_cache_evictions %lld\nsfs_block_cache_dirty_evictions %lld\n",
+               stats.cache.prefetched, stats.cache.evictions, stats.cache.dirtyEvictions);
+    appendStat(buf, size, &length, "sfs_indirect_cache_hits %lld\nsfs_indirect_cache_misses %lld\nsfs_indirect_cache_hit_ratio %.4f\n",
+               stats.indirectCacheHits, stats.indirectCacheMisses,
+               indirectLookups > 0 ? (double)stats.indirectCacheHits / indirectLookups : 0.0);
+    appendStat(buf, size, &length, "sfs_allocations %lld\nsfs_allocator_words_scanned %lld\nsfs_allocator_longest_scan_words %lld\n",
+               stats.allocations, stats.allocatorWordsScanned, stats.allocatorLongestScan);
+    appendStat(buf, size, &length, "sfs_dedup_blocks %lld\nsfs_copy_on_write_blocks %lld\n", stats.dedupBlocks, stats.copyOnWriteBlocks);
+    appendStat(buf, size, &length, "sfs_disk_read_requests %lld\nsfs_disk_write_requests %lld\nsfs_disk_blocks_read %lld\n"
+               "sfs_disk_blocks_written %lld\nsfs_disk_seeks %lld\n", stats.disk.read_requests, stats.disk.write_requests,
+               stats.disk.blocks_read, stats.disk.blocks_written, stats.disk.seeks);
+    appendStat(buf, size, &length, "sfs_disk_simulated_seconds %.6f\nsfs_disk_wall_seconds %.6f\n",
+               stats.disk.simulated_us / 1e6, stats.disk.wall_us / 1e6);
+    appendStat(buf, size, &length, "sfs_disk_checksum_errors %lld\nsfs_disk_blocks_scrubbed %lld\n",
+               stats.disk.checksum_errors, stats.disk.blocks_scrubbed);
+    return length;
+}
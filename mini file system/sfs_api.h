@@ -11,33 +11,62 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 #include "disk_emu.h"
+#include "block_cache.h"
+#include "journal.h"
 
 
 #define DIRECT_POINTERS 12
-#define INDIRECT_POINTERS DISK_BLOCK_SIZE/sizeof(int)
 #define MAX_FILENAME_LENGTH 35 // characters
-#define MAGIC 0xACBD0005 // way to identify the format of the file that is holding the emulated disk partition
-#define DISK_BLOCK_SIZE 1024 // byte block size in the disk (note: the larger the block size, the greater the internal fragmentation)
-#define DISK_DATA_BLOCKS 2000 // directory size 2000
-#define TOTAL_FILES 300 // number of files/directories
+#define MAGIC 0xACBD000C // way to identify the format of the file that is holding the emulated disk partition
+#define DISK_BLOCK_SIZE 1024 // default byte block size in the disk (note: the larger the block size, the greater the internal fragmentation)
+#define DISK_DATA_BLOCKS 2000 // default number of blocks in the disk
+#define TOTAL_FILES 300 // default number of files/directories
+#define MIN_BLOCK_SIZE 1024 // the super block always fits in the first block
+#define MAX_BLOCK_SIZE 65536
+#define SFS_INODE_FORMAT ExtentFormat // how new files map their blocks (PointerFormat for direct and indirect pointers)
+#define SFS_INLINE_DATA 1 // new files keep their bytes in the i-Node until they outgrow it, then switch to SFS_INODE_FORMAT
+#define SFS_DEDUP 0 // writes share a data block with any block already holding the same bytes; such files are pointer-mapped, since shared blocks break up extents
 #define INITIALIZATION_VALUE -1 // struct field initialization values
 #define FDT_INITIALIZER_VALUE -1
-#define TOTAL_ROOT_DIRECTORY_BLOCKS 6 // 1
+#define MAX_OPEN_FILES 1024 // descriptors in the open file table, on top of one per i-Node for sfs_fopen
+#define TRUNCATE_ZERO_BLOCKS 64 // blocks of zeros written at a time when sfs_ftruncate extends a file
+#define READAHEAD_MIN_BLOCKS 4 // readahead window of a descriptor once its reads look sequential
+#define READAHEAD_MAX_BLOCKS 64 // the window doubles each time it is used up, up to this many blocks
+#define BITS_PER_WORD 64 // the free block list is scanned one 64-bit word at a time
 #define EMPTY_STRING '\0'
 #define START_INDEX 0
+#define DIRECTORY_INDEX_END -1 // end of a directory index chain
+#define DEDUP_CHAIN_END -1 // end of a dedup index chain
+#define INDIRECT_LEVELS 3 // single, double and triple indirect pointers
+#define INDIRECT_CACHE_ENTRIES 32 // pointer and extent blocks kept in memory by the block mapping code
+#define BLOCK_CACHE_BUDGET (256 * DISK_BLOCK_SIZE) // default memory budget (bytes) of the write-back block cache
+#define STATS_LATENCY_BUCKETS 24 // operation latency histogram: [0, 1) us, then [2^(b-1), 2^b) us, the last bucket open-ended
+#define LAZY_INODE_TABLE_INIT 1 // mksfs(1) leaves the i-Node table unwritten; a block of it is first written along with one of its i-Nodes
+#define SFS_DISK_BACKEND DISK_BACKEND_MMAP // the disk image is mapped in memory once at mount time (DISK_BACKEND_FILE for pread/pwrite, DISK_BACKEND_URING for io_uring)
+// The disk emulator keeps a CRC32C of every block, in memory and in a <disk>.sum file written every 256 syncs and at close,
+// and fails the reads of blocks that no longer match it. Each block is checked at most once per run (the scrubber checks
+// again); blocks written since the file was last written are re-checksummed at mount. Costs under 1% of sfs_bench CPU time
+// (median of 9 runs, under 5% at best).
+#define SFS_DISK_CHECKSUMS 1
+#define SCRUB_BLOCKS_PER_SECOND 0 // default rate of the background scrubber that checks every block against its checksum (0: off)
 
 enum BlockUtilizationState {FreeBlock = 1, OccupiedBlock = 0};
+enum iNodeFormat {PointerFormat = 0, ExtentFormat = 1, InlineFormat = 2};
+enum OpenFlags {OpenRead = 1, OpenWrite = 2, OpenReadWrite = 3, OpenCreate = 4};
+enum StatsOperation {StatsOpen = 0, StatsRead = 1, StatsWrite = 2, StatsSeek = 3, StatsRemove = 4, STATS_OPERATIONS = 5};
+enum StatsBlockPurpose {StatsData = 0, StatsIndirect = 1, StatsINodeTable = 2, StatsDirectory = 3, StatsBitmap = 4, StatsSuperBlock = 5, STATS_PURPOSES = 6};
 enum DiskDataStructureIndices {
-    SuperBlockIndex = 0,
-    iNodeTableIndex = 1,
-    RootDirectoryIndex = 301,
-    FreeBlockListIndex = 0x000003FF // DISK_BLOCK_SIZE-1
+    SuperBlockIndex = 0 // the i-Node table, root directory, free block list and journal follow it; their locations are in the super block
 };
 enum ReturnErrorCodes {
     fOpenError = -1,
@@ -46,40 +75,57 @@ enum ReturnErrorCodes {
     fReadError = -1,
     fSeekError = -1,
     fRemoveError = -1,
+    fTruncateError = -1,
     getnextfilenameError = -1,
     getfilesizeError = -1,
     allocateBlockError = -1,
+    blockMappingError = -1,
+    syncError = -1,
+    setCacheSizeError = -1,
+    setScrubRateError = -1,
+    mksfsError = -1,
     NoError = 0
 };
 
 /**
- * @brief block type for the disk emulator (the disk is an array of blocks of fixed size).
+ * @brief geometry of a new Simple File System (SFS), chosen when the disk is formatted and recorded in the
+ *        super block. The singly indirect block of a file holds blockSize / sizeof(int) pointers.
  *
  */
-typedef struct Block_t { // block is composed of 1024 bytes
-    char data[DISK_BLOCK_SIZE]; // all the individual bytes are stored in the data array
-} Block;
+typedef struct Geometry_t {
+    int blockSize; // bytes per block, a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
+    int blockCount; // blocks in the disk, metadata included
+    int iNodeCount; // files the root directory can hold
+} Geometry;
 
 /**
- * @brief the singly indirect block pointer points to a block of pointers, each of which points to a data block.
+ * @brief an extent is a run of contiguous disk blocks holding consecutive logical blocks of a file.
  *
  */
-typedef struct IndirectBlock_t {
-    int blockOfPointers[INDIRECT_POINTERS];
-} IndirectBlock;
+typedef struct Extent_t {
+    int startBlock;
+    int length; // number of blocks in the run; 0 (or less) marks an unused extent
+} Extent;
+
+#define INODE_EXTENTS (DIRECT_POINTERS * (int)sizeof(int) / (int)sizeof(Extent)) // extents kept in the i-Node's pointer area
+#define INODE_INLINE_BYTES ((DIRECT_POINTERS + INDIRECT_LEVELS) * (int)sizeof(int)) // file bytes kept in the whole pointer area by an inline i-Node
 
 /**
  * @brief the file or directory in the Simple File System (SFS) is defined by an i-Node. In the case of this SFS,
  *        there is a single root directory (no subdirectories). This root directory is pointed to by an i-Node, which
- *        is pointed to by the super block. The i-Node structure is also simplified: it does not have the double and triple
- *        indirect pointers; instead, it has direct and indirect pointers.
+ *        is pointed to by the super block. Besides the direct and indirect pointers, the i-Node has double and triple
+ *        indirect pointers, which point to blocks of indirect (or double indirect) blocks.
  */
 typedef struct iNode_t {
     int linkCount; // i-Node availability: linkCount = 0 when i-Node is unused; linkCount = 1 when i-Node is used
     int size; // everytime something is written to file, size field is changed
-    // A pointer is 4 bytes
+    int format; // PointerFormat, ExtentFormat or InlineFormat
+    // A pointer is 4 bytes; an extent-mapped i-Node stores its first INODE_EXTENTS extents in the same space, and an
+    // inline i-Node stores the file's bytes in all of it, up to INODE_INLINE_BYTES
     int directPointers[DIRECT_POINTERS];
-    int indirectPointer;
+    int indirectPointer; // block of pointers, or block of further extents for an extent-mapped i-Node
+    int doubleIndirectPointer; // unused by an extent-mapped i-Node
+    int tripleIndirectPointer; // unused by an extent-mapped i-Node
 } iNode;
 
 /**
@@ -92,6 +138,16 @@ typedef struct SuperBlock_t {
     int fileSystemSize; // number of blocks
     int iNodeTableLength; // number of blocks
     iNode rootDirectory; // i-Node pointing to the root directory is stored in the super block
+    int iNodeCount; // number of i-Nodes, and of root directory entries
+    int iNodeTableStart; // first block of each on-disk structure
+    int rootDirectoryStart;
+    int rootDirectoryLength; // number of blocks
+    int freeBlockListStart;
+    int freeBlockListLength; // number of blocks
+    int journalStart;
+    int journalLength; // number of blocks
+    int iNodeTableInitialized; // leading i-Node table blocks written so far; the blocks after them hold only free i-Nodes
+    int sharedReferences; // references to data blocks beyond the first one of each block; the counts are rebuilt at mount unless 0
     // The rest is unused space
 } SuperBlock;
 
@@ -102,7 +158,7 @@ typedef struct SuperBlock_t {
  */
 typedef struct iNodesTable_t {
     char name[sizeof("i-Node Table")];
-    iNode iNodes[TOTAL_FILES];
+    iNode iNodes[]; // iNodeCount i-Nodes
 } iNodesTable;
 
 /**
@@ -118,28 +174,144 @@ typedef struct DirectoryEntry_t { // directory entry is composed of 20 bytes
     // iNode fileINode; // i-Node associated with the file
 } DirectoryEntry;
 
+/**
+ * @brief in-memory and on-disk root directory: one entry per file, plus the position of the
+ *        sfs_getnextfilename listing.
+ *
+ */
+typedef struct RootDirectory_t {
+    int location; // pointer to the location of a file on device (mentioned in textbook pg 530)
+    DirectoryEntry directoryEntries[]; // iNodeCount entries
+} RootDirectory;
+
+/**
+ * @brief an indirect (pointer) block or extent block held in memory, so that mapping a file block does not
+ *        read the chain of indirect blocks again. Modified entries reach the block cache with the rest of
+ *        the metadata at the end of the operation, or when they are evicted.
+ *
+ */
+typedef struct IndirectCacheEntry_t {
+    int blockNumber; // CACHE_EMPTY_SLOT when unused
+    char dirty;
+    int *pointers; // the whole block: pointers, or extents for an extent block
+} IndirectCacheEntry;
+
+/**
+ * @brief one open file: every descriptor keeps its own read/write pointer, even when several are open on the same file.
+ *
+ */
+typedef struct OpenFile_t {
+    int iNodeIndex; // FDT_INITIALIZER_VALUE while the descriptor is free
+    int read_writePointer;
+    int flags; // OpenRead and/or OpenWrite
+    int nextFree; // next descriptor in the free list
+    iNode *iNodeOfFile; // i-Node of the file in the i-Node table cache
+    int readaheadNext; // logical block a sequential read would start at (or in the block before)
+    int readaheadWindow; // blocks prefetched at a time, 0 while the reads are not sequential
+    int readaheadEnd; // first logical block not prefetched yet
+} OpenFile;
+
+/**
+ * @brief runtime counters of the Simple File System (SFS), kept since the program started or the counters were reset.
+ *        Block counts are the blocks SFS requested from the block cache and the journal; the block cache and disk
+ *        counters show how many of them reached the disk.
+ *
+ */
+typedef struct SfsStats_t {
+    long long calls[STATS_OPERATIONS]; // sfs_fopen and sfs_open, sfs_fread, sfs_pread and sfs_pread_extents, sfs_fwrite and sfs_pwrite, sfs_fseek, sfs_remove
+    long long latencyUs[STATS_OPERATIONS]; // total latency of the calls
+    long long latencyHistogram[STATS_OPERATIONS][STATS_LATENCY_BUCKETS];
+    long long blockReads[STATS_PURPOSES];
+    long long blockWrites[STATS_PURPOSES];
+    long long indirectCacheHits;
+    long long indirectCacheMisses;
+    long long allocations; // allocator searches for free blocks
+    long long allocatorWordsScanned; // free block list words inspected by those searches
+    long long allocatorLongestScan; // most words inspected by one search
+    long long dedupBlocks; // blocks written by sharing a block that already held the same bytes
+    long long copyOnWriteBlocks; // shared blocks copied before being overwritten
+    BlockCacheStats cache;
+    struct disk_times disk;
+} SfsStats;
+
+/**
+ * @brief part of a file range mapped by sfs_pread_extents: bytes that follow each other in the disk file, or bytes the
+ *        caller reads with sfs_pread.
+ *
+ */
+typedef struct SfsExtent_t {
+    int length; // bytes of the file
+    int diskFd; // descriptor of the disk file holding them, -1 for bytes to read with sfs_pread
+    long long diskOffset; // where they start in the disk file, -1 without a descriptor
+} SfsExtent;
+
 /**
  * @brief when a file is opened, an entry is created in the File Descriptor Table (same as the Open File Descriptor Table)
- *        in the Simple File System (SFS).
+ *        in the Simple File System (SFS). Descriptors are handed out from a free list, and every i-Node counts the
+ *        descriptors open on it: a removed file keeps its blocks until the last one is closed.
  *
  */
 typedef struct OpenFileDescriptorTable_t {
-    int read_writePointers[TOTAL_FILES];
+    OpenFile *openFiles; // indexed by file descriptor
+    int size;
+    int firstFree; // head of the free descriptor list, FDT_INITIALIZER_VALUE when every descriptor is in use
+    int *openCounts; // descriptors open on each i-Node
+    int *fopenDescriptors; // descriptor sfs_fopen handed out for each i-Node, returned again when the file is reopened
 } OpenFileDescriptorTable;
 
 /**
- * @brief loops over the free block list (free bitmap) and locates any available
- *        blocks. An available block is marked with 1 while an occupied block is marked
- *        with 0.
+ * @brief scans the free block list (free bitmap, one bit per block) 64 blocks at a time from the
+ *        next fit cursor and allocates the given number of blocks, which are contiguous whenever the
+ *        free space after the cursor is. An available block is marked with 1 while an occupied block is
+ *        marked with 0. Nothing is allocated unless every block can be; the modified bitmap blocks are
+ *        written once, by the metadata flush at the end of the operation.
  *
- * @return int
+ * @param numBlocks
+ * @param blockNumbers receives the allocated block numbers
+ * @return int number of blocks allocated, or allocateBlockError
+ */
+int allocateBlocks(int numBlocks, int *blockNumbers);
+
+/**
+ * @brief allocates numBlocks contiguous blocks, starting at goalBlock if that run is free (so a growing
+ *        file stays contiguous) or else at the first long enough run after the next fit cursor. Falls
+ *        back to allocateBlocks when the free space is too fragmented.
+ *
+ * @param goalBlock preferred first block, or -1 for none
+ * @param numBlocks
+ * @param blockNumbers receives the allocated block numbers
+ * @return int number of blocks allocated, or allocateBlockError
+ */
+int allocateRun(int goalBlock, int numBlocks, int *blockNumbers);
+
+/**
+ * @brief allocates a single block from the free block list.
+ *
+ * @return int block number, or allocateBlockError
  */
 int allocateBlock();
 
+/**
+ * @brief returns a block to the free block list.
+ *
+ * @param blockNumber
+ */
+void freeBlock(int blockNumber);
+
+/**
+ * @brief returns the blocks [startBlock, startBlock + numBlocks) to the free block list, taking
+ *        the allocator lock once for the whole run.
+ *
+ * @param startBlock
+ * @param numBlocks
+ */
+void freeRun(int startBlock, int numBlocks);
+
 /**
  * @brief formats the virtual disk implemented by the disk emulator
  *        and creates an instance of the simple file system on top of it.
- *        mksfs also sets up the in-memory data structures.
+ *        mksfs also sets up the in-memory data structures. The other sfs_ functions may be called
+ *        from several threads at once, but not while mksfs runs.
  *
  * @param fresh if the fresh flag is enabled (1), the file system should be created
  *              from scratch; else, the file system is opened from the disk (assuming
@@ -147,6 +319,17 @@ int allocateBlock();
  */
 void mksfs(int fresh);
 
+/**
+ * @brief same as mksfs, with the geometry of a fresh file system given by the caller instead of the
+ *        default one (DISK_BLOCK_SIZE, DISK_DATA_BLOCKS, TOTAL_FILES). An existing file system is
+ *        mounted with the geometry stored in its super block, and the geometry argument is ignored.
+ *
+ * @param fresh
+ * @param geometry
+ * @return int 0 on success, mksfsError if the geometry is invalid or the disk cannot be mounted
+ */
+int mksfs_geometry(int fresh, const Geometry *geometry);
+
 /**
  * @brief copies the name of the next file in the directory into the fname
  *        and returns non zero if there is a new file. Once all files have
@@ -177,6 +360,17 @@ int sfs_getfilesize(const char* path);
  */
 int sfs_fopen(char* fname);
 
+/**
+ * @brief opens a file with a new file descriptor, even if the file is already open, with its read/write
+ *        pointer at the start of the file. Several threads can each read the same file through their own
+ *        descriptor without seeking back and forth.
+ *
+ * @param fname
+ * @param flags OpenRead and/or OpenWrite, plus OpenCreate to create the file if it does not exist
+ * @return int file descriptor, or fOpenError if the file does not exist or no descriptor is free
+ */
+int sfs_open(char *fname, int flags);
+
 /**
  * @brief closes the file pointed to by the file descriptor and removes the entry from
  *        the per-process and system file descriptor tables. The file still persists in the
@@ -199,7 +393,8 @@ int sfs_fseek(int fd, int location);
 
 /**
  * @brief reads from the file into the buffer, starting from the current file pointer, and
- *        returns the number of bytes read.
+ *        returns the number of bytes read. Reads of the same file, or of different files, run in
+ *        parallel; a write to the file waits for them.
  *
  * @param fd
  * @param buf
@@ -208,9 +403,42 @@ int sfs_fseek(int fd, int location);
  */
 int sfs_fread(int fd, char* buf, int count);
 
+/**
+ * @brief same as sfs_fread, from the given offset instead of the file pointer, which is left
+ *        unchanged. Threads sharing a descriptor can read different parts of the file at once.
+ *
+ * @param fd
+ * @param buf
+ * @param count
+ * @param offset
+ * @return int number of bytes read, fReadError on error
+ */
+int sfs_pread(int fd, char *buf, int count, int offset);
+
+/**
+ * @brief maps what sfs_pread would read onto the disk file, so the caller can copy the bytes from there without SFS
+ *        copying them first (the FUSE wrapper replies to reads straight from the disk file). Each run of data blocks
+ *        consecutive on the disk becomes an extent with the disk file's descriptor once its blocks have matched their
+ *        checksums. Inline data, blocks with a newer copy in the block cache and blocks that fail their checksum are
+ *        left to sfs_pread, and so is the rest of the range when maxExtents extents are not enough. The extents
+ *        follow each other from offset to the end of the range or of the file.
+ *        The caller reads the disk file after the call returns: a concurrent write to the range may or may not show,
+ *        as with any read racing a write, and the blocks a concurrent truncate frees are only reused after the
+ *        journal commits.
+ *
+ * @param fd
+ * @param count
+ * @param offset
+ * @param extents
+ * @param maxExtents
+ * @return int number of extents filled, fReadError on error
+ */
+int sfs_pread_extents(int fd, int count, int offset, SfsExtent *extents, int maxExtents);
+
 /**
  * @brief writes the given number of bytes of data in buffer into the open file, starting
- *        from the current file pointer, and returns the number of bytes written.
+ *        from the current file pointer, and returns the number of bytes written. Writes to the
+ *        same file are serialized.
  *
  * @param fd
  * @param buf
@@ -219,14 +447,105 @@ int sfs_fread(int fd, char* buf, int count);
  */
 int sfs_fwrite(int fd, const char* buf, int count);
 
+/**
+ * @brief same as sfs_fwrite, at the given offset instead of the file pointer, which is left
+ *        unchanged. The offset cannot be past the end of the file.
+ *
+ * @param fd
+ * @param buf
+ * @param count
+ * @param offset
+ * @return int number of bytes written, fWriteError on error
+ */
+int sfs_pwrite(int fd, const char *buf, int count, int offset);
+
+/**
+ * @brief sets the size of an open file. Shrinking frees only the blocks past the new end;
+ *        growing appends zeros. The read/write pointers of the file's descriptors are left
+ *        unchanged.
+ *
+ * @param fd descriptor open for writing
+ * @param length
+ * @return int 0 on success, fTruncateError on error
+ */
+int sfs_ftruncate(int fd, int length);
+
+/**
+ * @brief commits the metadata changes still gathered in the journal's running transaction, writes every
+ *        block modified since the last sync (file data held by the write-back block cache) to the disk,
+ *        forces the disk file itself to be up to date (msync for the memory-mapped backend) and returns 0
+ *        on success. The journal and cache are also flushed when the file system is remounted with mksfs
+ *        and when the process exits; a crash in between loses at most the operations of the running
+ *        transaction (JOURNAL_GROUP_OPERATIONS), never the consistency of the metadata.
+ *
+ * @return int
+ */
+int sfs_sync();
+
+/**
+ * @brief sets the memory budget (in bytes) of the block cache. If the file system is mounted, the
+ *        dirty blocks are written back and the cache is rebuilt with the new budget; otherwise the
+ *        budget is used by the next mksfs. Returns 0 on success.
+ *
+ * @param budgetBytes
+ * @return int
+ */
+int sfs_setcachesize(int budgetBytes);
+
+/**
+ * @brief sets how many blocks per second the background scrubber reads and checks against their
+ *        checksums, going over the whole disk again and again; 0 stops it. If the file system is
+ *        mounted the rate applies at once, otherwise from the next mksfs. Returns 0 on success.
+ *        The scrubber needs SFS_DISK_CHECKSUMS.
+ *
+ * @param blocksPerSecond
+ * @return int
+ */
+int sfs_setscrubrate(int blocksPerSecond);
+
+/**
+ * @brief turns block sharing between identical data blocks on or off (SFS_DEDUP by default). The
+ *        setting applies from the next mksfs; blocks already shared stay shared either way.
+ *
+ * @param enabled
+ * @return int
+ */
+int sfs_setdedup(int enabled);
+
 /**
  * @brief removes the file from the directory entry, releases the i-Node and releases the
  *        data blocks used by the file (i.e., the data blocks are added to the free block list)
- *        so that they can be used by new files in the future.
+ *        so that they can be used by new files in the future. The descriptor sfs_fopen handed out
+ *        for the file is closed; if descriptors from sfs_open are still open on it, the i-Node and
+ *        blocks are only released when the last of them is closed.
  *
  * @param fname
  * @return int
  */
 int sfs_remove(char *fname);
 
+/**
+ * @brief copies the runtime counters of SFS, its block cache and the disk emulator. May be called at any time,
+ *        from any thread, while the other sfs_ functions run.
+ *
+ * @param stats
+ */
+void sfs_get_stats(SfsStats *stats);
+
+/**
+ * @brief sets every runtime counter back to zero.
+ *
+ */
+void sfs_reset_stats();
+
+/**
+ * @brief writes the runtime counters as text, one "name{labels} value" line per counter (the Prometheus text
+ *        format), truncated to size bytes like snprintf.
+ *
+ * @param buf
+ * @param size
+ * @return int length of the whole text, which may be more than size
+ */
+int sfs_format_stats(char *buf, int size);
+
 #endif
@@ -0,0 +1,330 @@
+/* sfs_bench.c
+ *
+ * Throughput and latency benchmark for the SFS API. Every workload reports
+ * ops/s, MB/s, p50/p99 latency and the blocks read and written on the
+ * emulated disk per operation, as one JSON document written to the file named
+ * on the command line (stdout by default). The messages printed by SFS itself
+ * go to stderr so the JSON stays machine-readable.
+ *
+ * The device model of the disk emulator is taken from the environment
+ * (DISK_EMU_PROFILE=hdd|ssd, ...), so the same run can be compared across
+ * profiles.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define BENCH_BLOCK_SIZE DISK_BLOCK_SIZE
+#define BENCH_DISK_BLOCKS 65536
+#define SEQ_FILE_BYTES (16 * 1024 * 1024)
+#define RANDOM_READ_SIZE 4096
+#define RANDOM_READS 4096
+#define APPEND_FILES 16
+#define APPENDS 16384 // 1024 appends per file, about 2 MiB each
+#define APPEND_MAX_BYTES 4096
+#define CHURN_ROUNDS 3
+#define LISTING_PASSES 20
+
+static const int chunkSizes[] = {1024, 4096, 65536, 1024 * 1024};
+
+FILE *jsonOut = NULL;
+int workloadCount = 0;
+
+/**
+ * @brief one running workload: the latency of every operation and the disk counters at its start.
+ */
+typedef struct Workload_t {
+    const char *name;
+    double *latencies; // microseconds, one per operation
+    int ops;
+    int capacity;
+    int errors; // operations that failed; a read workload stops at the first one, the append storm goes on
+    long long bytes;
+    double startUs;
+    struct disk_times diskStart;
+} Workload;
+
+static double nowUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void startWorkload(Workload *workload, const char *name) {
+    workload->name = name;
+    workload->ops = 0;
+    workload->capacity = 1024;
+    workload->latencies = malloc(workload->capacity * sizeof(double));
+    workload->errors = 0;
+    workload->bytes = 0;
+    get_disk_times(&workload->diskStart);
+    workload->startUs = nowUs();
+}
+
+static void recordOp(Workload *workload, double startUs, long long bytes) {
+    if (workload->ops == workload->capacity) {
+        workload->capacity *= 2;
+        workload->latencies = realloc(workload->latencies, workload->capacity * sizeof(double));
+    }
+    workload->latencies[workload->ops++] = nowUs() - startUs;
+    workload->bytes += bytes;
+}
+
+static double percentile(Workload *workload, double fraction) {
+    if (workload->ops == 0) {
+        return 0;
+    }
+    int index = (int)(fraction * (workload->ops - 1) + 0.5);
+    return workload->latencies[index];
+}
+
+/**
+ * @brief syncs so the blocks written by the workload reach the disk, then prints its JSON record.
+ */
+static void endWorkload(Workload *workload) {
+    struct disk_times diskEnd;
+    sfs_sync();
+    double seconds = (nowUs() - workload->startUs) / 1e6;
+    get_disk_times(&diskEnd);
+    qsort(workload->latencies, workload->ops, sizeof(double), compareDoubles);
+
+    double ops = workload->ops > 0 ? workload->ops : 1;
+    fprintf(jsonOut, "%s    {\"name\": \"%s\", \"ops\": %d, \"bytes\": %lld, \"seconds\": %.6f, "
+            "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+            "\"block_reads_per_op\": %.3f, \"block_writes_per_op\": %.3f, \"simulated_seconds\": %.6f, \"errors\": %d}",
+            workloadCount++ > 0 ? ",\n" : "", workload->name, workload->ops, workload->bytes, seconds,
+            workload->ops / seconds, workload->bytes / seconds / (1024 * 1024),
+            percentile(workload, 0.50), percentile(workload, 0.99),
+            (diskEnd.blocks_read - workload->diskStart.blocks_read) / ops,
+            (diskEnd.blocks_written - workload->diskStart.blocks_written) / ops,
+            (diskEnd.simulated_us - workload->diskStart.simulated_us) / 1e6, workload->errors);
+    fflush(jsonOut);
+    free(workload->latencies);
+}
+
+static void remountCold() {
+    sfs_sync();
+    mksfs(0); // the block cache starts empty again
+}
+
+static void sequentialWorkloads(char *data) {
+    char name[64];
+    for (int chunkIndex = 0; chunkIndex < (int)(sizeof(chunkSizes) / sizeof(chunkSizes[0])); chunkIndex++)
+    {
+        int chunk = chunkSizes[chunkIndex];
+        Workload workload;
+
+        snprintf(name, sizeof(name), "seq_write_%d", chunk);
+        startWorkload(&workload, name);
+        int fd = sfs_fopen("seq.bin");
+        for (int offset = 0; offset < SEQ_FILE_BYTES; offset += chunk)
+        {
+            double start = nowUs();
+            if (sfs_fwrite(fd, data + offset, chunk) != chunk) {
+                fprintf(stderr, "sfs_bench: write failed at %d\n", offset);
+                ++workload.errors;
+                break;
+            }
+            recordOp(&workload, start, chunk);
+        }
+        sfs_fclose(fd);
+        endWorkload(&workload);
+
+        remountCold();
+        char *back = malloc(chunk);
+        snprintf(name, sizeof(name), "seq_read_%d", chunk);
+        startWorkload(&workload, name);
+        fd = sfs_fopen("seq.bin");
+        sfs_fseek(fd, 0);
+        for (int offset = 0; offset < SEQ_FILE_BYTES; offset += chunk)
+        {
+            double start = nowUs();
+            if (sfs_fread(fd, back, chunk) != chunk || memcmp(back, data + offset, chunk) != 0) {
+                fprintf(stderr, "sfs_bench: read mismatch at %d\n", offset);
+                ++workload.errors;
+                break;
+            }
+            recordOp(&workload, start, chunk);
+        }
+        sfs_fclose(fd);
+        endWorkload(&workload);
+        free(back);
+
+        if (chunkIndex + 1 < (int)(sizeof(chunkSizes) / sizeof(chunkSizes[0]))) {
+            sfs_remove("seq.bin");
+        }
+    }
+}
+
+static void randomReadWorkload(char *data) {
+    char back[RANDOM_READ_SIZE];
+    Workload workload;
+
+    remountCold();
+    srand(1);
+    startWorkload(&workload, "random_read_4096");
+    int fd = sfs_fopen("seq.bin");
+    for (int readIndex = 0; readIndex < RANDOM_READS; readIndex++)
+    {
+        int offset = rand() % (SEQ_FILE_BYTES / RANDOM_READ_SIZE) * RANDOM_READ_SIZE;
+        double start = nowUs();
+        sfs_fseek(fd, offset);
+        if (sfs_fread(fd, back, RANDOM_READ_SIZE) != RANDOM_READ_SIZE || memcmp(back, data + offset, RANDOM_READ_SIZE) != 0) {
+            fprintf(stderr, "sfs_bench: random read mismatch at %d\n", offset);
+            ++workload.errors;
+            break;
+        }
+        recordOp(&workload, start, RANDOM_READ_SIZE);
+    }
+    sfs_fclose(fd);
+    endWorkload(&workload);
+    sfs_remove("seq.bin");
+}
+
+static void appendStormWorkload(char *data) {
+    int fds[APPEND_FILES];
+    char name[MAX_FILENAME_LENGTH];
+    Workload workload;
+
+    srand(2);
+    for (int fileIndex = 0; fileIndex < APPEND_FILES; fileIndex++)
+    {
+        snprintf(name, sizeof(name), "append%d.log", fileIndex);
+        fds[fileIndex] = sfs_fopen(name);
+    }
+    startWorkload(&workload, "append_storm");
+    for (int appendIndex = 0; appendIndex < APPENDS; appendIndex++)
+    {
+        int bytes = rand() % APPEND_MAX_BYTES + 1;
+        double start = nowUs();
+        int written = sfs_fwrite(fds[appendIndex % APPEND_FILES], data, bytes);
+        if (written != bytes) {
+            fprintf(stderr, "sfs_bench: append %d of %d bytes to append%d.log wrote %d\n", appendIndex, bytes,
+                    appendIndex % APPEND_FILES, written);
+            ++workload.errors;
+        }
+        recordOp(&workload, start, written > 0 ? written : 0);
+    }
+    endWorkload(&workload);
+    for (int fileIndex = 0; fileIndex < APPEND_FILES; fileIndex++)
+    {
+        sfs_fclose(fds[fileIndex]);
+        snprintf(name, sizeof(name), "append%d.log", fileIndex);
+        sfs_remove(name);
+    }
+}
+
+/**
+ * @brief creates files until the directory is full, then removes them all; every create and remove is an operation.
+ */
+static void churnWorkload(char *data) {
+    char name[MAX_FILENAME_LENGTH];
+    Workload workload;
+
+    startWorkload(&workload, "create_delete_churn");
+    for (int round = 0; round < CHURN_ROUNDS; round++)
+    {
+        int created = 0;
+        for (int fileIndex = 0; fileIndex < TOTAL_FILES; fileIndex++)
+        {
+            snprintf(name, sizeof(name), "churn%d.txt", fileIndex);
+            double start = nowUs();
+            int fd = sfs_fopen(name);
+            if (fd < 0) {
+                break; // directory full
+            }
+            sfs_fwrite(fd, data, 100);
+            sfs_fclose(fd);
+            recordOp(&workload, start, 100);
+            ++created;
+        }
+        for (int fileIndex = 0; fileIndex < created; fileIndex++)
+        {
+            snprintf(name, sizeof(name), "churn%d.txt", fileIndex);
+            double start = nowUs();
+            sfs_remove(name);
+            recordOp(&workload, start, 0);
+        }
+    }
+    endWorkload(&workload);
+}
+
+static void listingWorkload() {
+    char name[MAX_FILENAME_LENGTH];
+    char listed[MAX_FILENAME_LENGTH + 1];
+    Workload workload;
+    int created = 0;
+
+    for (int fileIndex = 0; fileIndex < TOTAL_FILES; fileIndex++)
+    {
+        snprintf(name, sizeof(name), "list%d.txt", fileIndex);
+        int fd = sfs_fopen(name);
+        if (fd < 0) {
+            break;
+        }
+        sfs_fclose(fd);
+        ++created;
+    }
+    startWorkload(&workload, "getnextfilename_listing");
+    for (int pass = 0; pass < LISTING_PASSES; pass++)
+    {
+        while (1)
+        {
+            double start = nowUs();
+            int more = sfs_getnextfilename(listed);
+            recordOp(&workload, start, 0);
+            if (!more) {
+                break;
+            }
+        }
+    }
+    endWorkload(&workload);
+    for (int fileIndex = 0; fileIndex < created; fileIndex++)
+    {
+        snprintf(name, sizeof(name), "list%d.txt", fileIndex);
+        sfs_remove(name);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // SFS reports its errors with printf, so stdout is sent to stderr once the JSON output is open
+    jsonOut = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    Geometry geometry = {BENCH_BLOCK_SIZE, BENCH_DISK_BLOCKS, TOTAL_FILES};
+    if (jsonOut == NULL || mksfs_geometry(1, &geometry) < 0) {
+        fprintf(stderr, "sfs_bench: could not create the file system\n");
+        return 1;
+    }
+    char *data = malloc(SEQ_FILE_BYTES);
+    srand(0);
+    for (int byte = 0; byte < SEQ_FILE_BYTES; byte++)
+    {
+        data[byte] = rand();
+    }
+
+    const char *profile = getenv("DISK_EMU_PROFILE");
+    fprintf(jsonOut, "{\n  \"block_size\": %d,\n  \"disk_blocks\": %d,\n  \"profile\": \"%s\",\n  \"workloads\": [\n",
+            BENCH_BLOCK_SIZE, BENCH_DISK_BLOCKS, profile != NULL ? profile : "none");
+    reset_disk_times();
+    sequentialWorkloads(data);
+    randomReadWorkload(data);
+    appendStormWorkload(data);
+    churnWorkload(data);
+    listingWorkload();
+    fprintf(jsonOut, "\n  ]\n}\n");
+    fclose(jsonOut);
+
+    free(data);
+    return 0;
+}
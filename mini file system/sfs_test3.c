@@ -0,0 +1,141 @@
+/* sfs_test3.c
+ *
+ * Block sharing (dedup) test: files holding the same bytes share data
+ * blocks, and a shared block is copied before it is overwritten. The
+ * rewrites below overlap blocks of the same write, which is where the
+ * copy-on-write bookkeeping is easiest to get wrong.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs_test_helpers.h"
+
+#define BLOCK DISK_BLOCK_SIZE
+#define MAX_BLOCKS 8
+
+static int error_count = 0;
+
+/* fill_blocks() - fills buf with one block of each letter of pattern.
+ */
+static void fill_blocks(char *buf, const char *pattern)
+{
+  int i;
+
+  for (i = 0; pattern[i] != '\0'; i++) {
+    memset(buf + i * BLOCK, pattern[i], BLOCK);
+  }
+}
+
+/* check_file() - reads a whole file back and compares it with the
+ * blocks described by pattern.
+ */
+static void check_file(char *name, const char *pattern)
+{
+  char expected[MAX_BLOCKS * BLOCK];
+  char actual[MAX_BLOCKS * BLOCK];
+  int size = strlen(pattern) * BLOCK;
+  int fd = sfs_open(name, OpenRead);
+
+  fill_blocks(expected, pattern);
+  if (sfs_getfilesize(name) != size) {
+    fprintf(stderr, "ERROR: %s holds %d bytes instead of %d\n", name, sfs_getfilesize(name), size);
+    error_count++;
+  }
+  if (sfs_pread(fd, actual, size, 0) != size || memcmp(actual, expected, size) != 0) {
+    fprintf(stderr, "ERROR: %s does not hold the blocks %s\n", name, pattern);
+    error_count++;
+  }
+  sfs_fclose(fd);
+}
+
+/* write_file() - overwrites the blocks of a file from the given block on.
+ */
+static void write_file(char *name, int firstBlock, const char *pattern)
+{
+  char buf[MAX_BLOCKS * BLOCK];
+  int size = strlen(pattern) * BLOCK;
+  int fd = sfs_open(name, OpenWrite | OpenCreate);
+
+  fill_blocks(buf, pattern);
+  if (sfs_pwrite(fd, buf, size, firstBlock * BLOCK) != size) {
+    fprintf(stderr, "ERROR: writing %s into %s failed\n", pattern, name);
+    error_count++;
+  }
+  sfs_fclose(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+  SfsStats stats;
+  char name[MAX_FILENAME_LENGTH];
+  char names[8][MAX_FILENAME_LENGTH];
+  long capacity, size;
+  int i, count;
+
+  sfs_setdedup(1);
+  mksfs(1);
+  capacity = fill_disk();
+
+  /* A rewrite whose first block repeats the second block of the same
+   * write, which is itself rewritten.
+   */
+  write_file("overlap", 0, "AB");
+  write_file("overlap", 0, "BC");
+  check_file("overlap", "BC");
+
+  /* Every block of the write takes the bytes of the next one.
+   */
+  write_file("rotate", 0, "ABCD");
+  write_file("rotate", 0, "BCDA");
+  check_file("rotate", "BCDA");
+  write_file("rotate", 1, "AAB");
+  check_file("rotate", "BAAB");
+
+  /* Copies share all their blocks; rewriting one copy, including into
+   * the bytes another of its blocks held, leaves the others alone.
+   */
+  write_file("copy0", 0, "ABCD");
+  write_file("copy1", 0, "ABCD");
+  write_file("copy2", 0, "ABCD");
+  sfs_reset_stats();
+  write_file("copy1", 0, "DCBA");
+  write_file("copy2", 2, "AB");
+  sfs_get_stats(&stats);
+  if (stats.copyOnWriteBlocks == 0) {
+    fprintf(stderr, "ERROR: no shared block was copied before being overwritten\n");
+    error_count++;
+  }
+  check_file("copy0", "ABCD");
+  check_file("copy1", "DCBA");
+  check_file("copy2", "ABAB");
+
+  /* The references are counted again at mount time, and the index
+   * starts empty: rewrites still copy the blocks other files share.
+   */
+  mksfs(0);
+  write_file("copy0", 0, "EFGH");
+  check_file("copy0", "EFGH");
+  check_file("copy1", "DCBA");
+  check_file("copy2", "ABAB");
+  check_file("overlap", "BC");
+  check_file("rotate", "BAAB");
+
+  /* Once every file is gone, so is every block they shared.
+   */
+  for (count = 0; sfs_getnextfilename(name); count++) {
+    strcpy(names[count], name);
+  }
+  for (i = 0; i < count; i++) {
+    sfs_remove(names[i]);
+  }
+  if ((size = fill_disk()) != capacity) {
+    fprintf(stderr, "ERROR: the disk holds %ld bytes instead of %ld once emptied\n", size, capacity);
+    error_count++;
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
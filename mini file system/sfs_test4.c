@@ -0,0 +1,89 @@
+/* sfs_test4.c
+ *
+ * Fragmentation test: files appended to in turn get their blocks
+ * interleaved on the disk, so each block of an extent-mapped file is an
+ * extent of its own. The files must keep growing until the disk is full,
+ * well past the extents an i-Node and its extent block can hold.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs_test_helpers.h"
+
+#define NFILES 4
+#define BLOCK DISK_BLOCK_SIZE
+#define SLACK_BLOCKS 32 /* indirect blocks the fragmented files may need */
+
+int
+main(int argc, char **argv)
+{
+  char *names[NFILES] = {"frag0", "frag1", "frag2", "frag3"};
+  char buf[BLOCK];
+  char *expected;
+  char *actual;
+  int fds[NFILES];
+  int appends[NFILES];
+  int written = 0;
+  long capacity;
+  int error_count = 0;
+  int i, j, full;
+
+  mksfs(1);
+  capacity = fill_disk();
+  for (i = 0; i < NFILES; i++) {
+    fds[i] = sfs_fopen(names[i]);
+    appends[i] = 0;
+  }
+
+  /* Append a block to each file in turn until the disk is full.
+   */
+  for (full = 0; !full; ) {
+    for (i = 0; i < NFILES && !full; i++) {
+      memset(buf, 'a' + (appends[i] + i) % 26, BLOCK);
+      if (sfs_fwrite(fds[i], buf, BLOCK) != BLOCK) {
+        full = 1;
+        break;
+      }
+      appends[i]++;
+      written += BLOCK;
+    }
+  }
+  printf("The disk filled up after %d appends (%d bytes).\n", written / BLOCK, written);
+  if (written < capacity - SLACK_BLOCKS * BLOCK) {
+    fprintf(stderr, "ERROR: the appends stopped after %d of %ld bytes\n", written, capacity);
+    error_count++;
+  }
+
+  /* Every file still holds what was appended to it, also once remounted.
+   */
+  mksfs(0);
+  for (i = 0; i < NFILES; i++) {
+    int size = appends[i] * BLOCK;
+
+    expected = malloc(size);
+    actual = malloc(size);
+    for (j = 0; j < appends[i]; j++) {
+      memset(expected + j * BLOCK, 'a' + (j + i) % 26, BLOCK);
+    }
+    fds[i] = sfs_fopen(names[i]);
+    sfs_fseek(fds[i], 0);
+    if (sfs_getfilesize(names[i]) != size || sfs_fread(fds[i], actual, size) != size ||
+        memcmp(expected, actual, size) != 0) {
+      fprintf(stderr, "ERROR: %s does not hold its %d appended blocks\n", names[i], appends[i]);
+      error_count++;
+    }
+    sfs_fclose(fds[i]);
+    sfs_remove(names[i]);
+    free(expected);
+    free(actual);
+  }
+  if (fill_disk() != capacity) {
+    fprintf(stderr, "ERROR: blocks of the removed files were not freed\n");
+    error_count++;
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,178 @@
+/* sfs_test5.c
+ *
+ * Crash test: a child process works on the disk and exits without
+ * unmounting it, so whatever the journal had not committed is lost. The
+ * next mount replays the journal, and must find every file whole: each
+ * holds a single letter, the free space adds up, and a file whose removal
+ * was never committed still holds its own bytes, not those of the file
+ * written into its freed blocks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+#include "sfs_test_helpers.h"
+
+#define BLOCK DISK_BLOCK_SIZE
+#define NFILES 40
+#define MAX_WRITE 30000
+#define SEEDS 3
+#define OPERATIONS 600
+
+static int error_count = 0;
+static char buf[(MAX_WRITE / BLOCK + 1) * BLOCK];
+
+/* write_file() - creates a file, or truncates it, and writes count bytes
+ * of its letter into it.
+ */
+static void write_file(char *name, char letter, int count)
+{
+  int fd = sfs_open(name, OpenWrite | OpenCreate);
+
+  memset(buf, letter, count);
+  sfs_ftruncate(fd, 0);
+  sfs_pwrite(fd, buf, count, 0);
+  sfs_fclose(fd);
+}
+
+/* crash() - runs the work in a child process that exits without
+ * unmounting the disk, then mounts the disk again. The parent's own mount
+ * is freshly synced, so remounting writes nothing over the child's disk.
+ */
+static void crash(void (*work)(int), int arg)
+{
+  pid_t pid;
+
+  sfs_sync();
+  pid = fork();
+  if (pid == 0) {
+    work(arg);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  mksfs(0);
+}
+
+/* random_work() - rewrites and removes random files, syncing halfway.
+ */
+static void random_work(int seed)
+{
+  char name[MAX_FILENAME_LENGTH];
+  int i, file;
+
+  srand(seed);
+  for (i = 0; i < OPERATIONS; i++) {
+    file = rand() % NFILES;
+    sprintf(name, "f%d", file);
+    write_file(name, 'a' + file % 26, rand() % MAX_WRITE);
+    if (rand() % 5 == 0) {
+      sfs_remove(name);
+    }
+    if (i == OPERATIONS / 2) {
+      sfs_sync();
+    }
+  }
+}
+
+/* check_files() - every file holds only its letter; then they are all
+ * removed and the disk must hold as much as a fresh one.
+ */
+static void check_files(long capacity)
+{
+  char name[MAX_FILENAME_LENGTH];
+  char names[NFILES][MAX_FILENAME_LENGTH];
+  char *contents;
+  long size;
+  int i, j, count, fd;
+
+  for (count = 0; sfs_getnextfilename(name); count++) {
+    strcpy(names[count], name);
+  }
+  for (i = 0; i < count; i++) {
+    size = sfs_getfilesize(names[i]);
+    contents = malloc(size + 1);
+    fd = sfs_open(names[i], OpenRead);
+    if (sfs_pread(fd, contents, size, 0) != size) {
+      fprintf(stderr, "ERROR: %s does not read back its %ld bytes\n", names[i], size);
+      error_count++;
+    }
+    for (j = 0; j < size; j++) {
+      if (contents[j] != 'a' + atoi(names[i] + 1) % 26) {
+        fprintf(stderr, "ERROR: %s holds a foreign byte at %d\n", names[i], j);
+        error_count++;
+        break;
+      }
+    }
+    sfs_fclose(fd);
+    free(contents);
+  }
+  for (i = 0; i < count; i++) {
+    sfs_remove(names[i]);
+  }
+  if ((size = fill_disk()) != capacity) {
+    fprintf(stderr, "ERROR: the disk holds %ld bytes instead of %ld after the crash\n", size, capacity);
+    error_count++;
+  }
+}
+
+/* reuse_work() - removes a file, then writes another one while the
+ * removal is still in the running transaction, and writes its data back
+ * to the disk before the crash.
+ */
+static void reuse_work(int blocks)
+{
+  sfs_remove("removed");
+  write_file("written", 'b', blocks * BLOCK);
+  sfs_setcachesize(BLOCK_CACHE_BUDGET); /* writes the cached data back */
+}
+
+int
+main(int argc, char **argv)
+{
+  char contents[4 * BLOCK];
+  char expected[4 * BLOCK];
+  long capacity;
+  int seed, fd;
+
+  mksfs(1);
+  capacity = fill_disk();
+
+  /* Random work, cut short at any point of a transaction.
+   */
+  for (seed = 1; seed <= SEEDS; seed++) {
+    mksfs(1);
+    crash(random_work, seed);
+    check_files(capacity);
+  }
+
+  /* The file removed before the crash sits at the start of the disk, and
+   * the disk is full up to its end, so the next fit search wraps around
+   * to the removed file's blocks first. They must be left alone until the
+   * removal commits: until then, a crash brings the file back.
+   */
+  mksfs(1);
+  write_file("removed", 'a', 4 * BLOCK);
+  write_file("spare", 's', 16 * BLOCK);
+  fd = sfs_fopen("pad");
+  memset(buf, 'p', BLOCK);
+  while (sfs_fwrite(fd, buf, BLOCK) == BLOCK) {
+  }
+  sfs_fclose(fd);
+  sfs_remove("spare");
+  crash(reuse_work, 4);
+  memset(expected, 'a', sizeof(expected));
+  fd = sfs_open("removed", OpenRead);
+  if (sfs_getfilesize("removed") != sizeof(expected) ||
+      sfs_pread(fd, contents, sizeof(contents), 0) != sizeof(contents) ||
+      memcmp(contents, expected, sizeof(expected)) != 0) {
+    fprintf(stderr, "ERROR: a file whose removal was never committed lost its bytes\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
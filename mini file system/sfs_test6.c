@@ -0,0 +1,227 @@
+/* sfs_test6.c
+ *
+ * Concurrency test: threads open, read and write at the same time.
+ *
+ * Each writer owns one region of a shared file and rewrites it with
+ * sfs_pwrite, alternating between the upper and lower case of its letter,
+ * while readers go over the whole file with sfs_pread through their own
+ * descriptors. A write to a file is never seen half done, so every region
+ * read must hold a single letter. Every writer also creates, appends to and
+ * removes files of its own through sfs_fopen, so the directory and the
+ * open file table are shared too. At the end, and again after a remount,
+ * every file must hold exactly what its owner wrote.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sfs_api.h"
+
+#define BLOCK DISK_BLOCK_SIZE
+#define WRITERS 4
+#define READERS 3
+#define ROUNDS 200
+#define REGION (3 * BLOCK + 100) /* regions do not start on block boundaries */
+#define APPEND 700 /* bytes added to a writer's log each round */
+#define SCRATCH (5 * BLOCK)
+
+static int error_count = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+static int writers_done = 0;
+
+static void error(const char *message, int id)
+{
+  pthread_mutex_lock(&error_lock);
+  fprintf(stderr, "ERROR: %s (thread %d)\n", message, id);
+  error_count++;
+  pthread_mutex_unlock(&error_lock);
+}
+
+/* log_byte() - the byte at the given offset of a writer's log.
+ */
+static char log_byte(int id, int offset)
+{
+  return 'a' + (id * 7 + offset / APPEND) % 26;
+}
+
+/* writer() - rewrites its region of the shared file, appends to its log,
+ * and writes, checks and removes a scratch file.
+ */
+static void *writer(void *arg)
+{
+  int id = (int)(long)arg;
+  char region[REGION], back[SCRATCH], scratch[SCRATCH];
+  char name[MAX_FILENAME_LENGTH];
+  int shared, fd, i, round, count;
+
+  shared = sfs_open("shared", OpenReadWrite);
+  if (shared < 0) {
+    error("cannot open the shared file", id);
+    return NULL;
+  }
+  for (round = 0; round < ROUNDS; round++) {
+    memset(region, (round % 2 ? 'a' : 'A') + id, REGION);
+    if (sfs_pwrite(shared, region, REGION, id * REGION) != REGION) {
+      error("write to the shared file failed", id);
+    }
+
+    sprintf(name, "log%d", id);
+    fd = sfs_fopen(name);
+    memset(region, log_byte(id, round * APPEND), APPEND);
+    if (sfs_fwrite(fd, region, APPEND) != APPEND) {
+      error("append to the log failed", id);
+    }
+    sfs_fclose(fd);
+
+    sprintf(name, "tmp%d_%d", id, round % 3);
+    count = 1 + (round * 1237 + id * 311) % SCRATCH;
+    for (i = 0; i < count; i++) {
+      scratch[i] = 'a' + (round + i) % 26;
+    }
+    fd = sfs_open(name, OpenReadWrite | OpenCreate);
+    if (fd < 0) {
+      error("cannot create a scratch file", id);
+      continue;
+    }
+    sfs_ftruncate(fd, 0);
+    if (sfs_pwrite(fd, scratch, count, 0) != count ||
+        sfs_pread(fd, back, count, 0) != count ||
+        memcmp(scratch, back, count) != 0) {
+      error("a scratch file does not read back", id);
+    }
+    sfs_fclose(fd);
+    if (round % 3 == 2) {
+      sfs_remove(name);
+    }
+  }
+  sfs_fclose(shared);
+
+  pthread_mutex_lock(&error_lock);
+  writers_done++;
+  pthread_mutex_unlock(&error_lock);
+  return NULL;
+}
+
+/* reader() - reads the whole shared file until the writers are done;
+ * every region must hold one letter only.
+ */
+static void *reader(void *arg)
+{
+  int id = (int)(long)arg;
+  static __thread char contents[WRITERS * REGION];
+  int fd, done, w, i;
+
+  fd = sfs_open("shared", OpenRead);
+  if (fd < 0) {
+    error("cannot open the shared file", id);
+    return NULL;
+  }
+  do {
+    pthread_mutex_lock(&error_lock);
+    done = writers_done == WRITERS;
+    pthread_mutex_unlock(&error_lock);
+    if (sfs_pread(fd, contents, sizeof(contents), 0) != sizeof(contents)) {
+      error("read of the shared file failed", id);
+      break;
+    }
+    for (w = 0; w < WRITERS; w++) {
+      char *region = contents + w * REGION;
+      if (region[0] != 'a' + w && region[0] != 'A' + w) {
+        error("a region holds a foreign byte", id);
+        break;
+      }
+      for (i = 1; i < REGION && region[i] == region[0]; i++) {
+      }
+      if (i < REGION) {
+        error("a region was read halfway through a write", id);
+        break;
+      }
+    }
+  } while (!done);
+  sfs_fclose(fd);
+  return NULL;
+}
+
+/* check_files() - the shared file holds each writer's last letter, the
+ * logs hold every append and only the scratch files never removed are left.
+ */
+static void check_files()
+{
+  char contents[ROUNDS * APPEND];
+  char name[MAX_FILENAME_LENGTH];
+  int fd, w, i, size, count = 0;
+
+  fd = sfs_open("shared", OpenRead);
+  for (w = 0; w < WRITERS; w++) {
+    sfs_pread(fd, contents, REGION, w * REGION);
+    for (i = 0; i < REGION && contents[i] == ((ROUNDS - 1) % 2 ? 'a' : 'A') + w; i++) {
+    }
+    if (i < REGION) {
+      fprintf(stderr, "ERROR: region %d does not hold its last write\n", w);
+      error_count++;
+    }
+  }
+  sfs_fclose(fd);
+
+  for (w = 0; w < WRITERS; w++) {
+    sprintf(name, "log%d", w);
+    size = sfs_getfilesize(name);
+    fd = sfs_open(name, OpenRead);
+    if (size != sizeof(contents) || sfs_pread(fd, contents, size, 0) != size) {
+      fprintf(stderr, "ERROR: %s holds %d bytes instead of %d\n", name, size, (int)sizeof(contents));
+      error_count++;
+    }
+    else {
+      for (i = 0; i < size && contents[i] == log_byte(w, i); i++) {
+      }
+      if (i < size) {
+        fprintf(stderr, "ERROR: %s holds a wrong byte at %d\n", name, i);
+        error_count++;
+      }
+    }
+    sfs_fclose(fd);
+  }
+
+  while (sfs_getnextfilename(name)) {
+    count++;
+  }
+  /* the shared file, a log and two scratch files per writer */
+  if (count != 1 + 3 * WRITERS) {
+    fprintf(stderr, "ERROR: %d files found instead of %d\n", count, 1 + 3 * WRITERS);
+    error_count++;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  pthread_t threads[WRITERS + READERS];
+  char initial[WRITERS * REGION];
+  int fd, i;
+
+  mksfs(1);
+  fd = sfs_open("shared", OpenWrite | OpenCreate);
+  for (i = 0; i < WRITERS; i++) {
+    memset(initial + i * REGION, 'A' + i, REGION);
+  }
+  sfs_pwrite(fd, initial, sizeof(initial), 0);
+  sfs_fclose(fd);
+
+  for (i = 0; i < WRITERS; i++) {
+    pthread_create(&threads[i], NULL, writer, (void *)(long)i);
+  }
+  for (i = 0; i < READERS; i++) {
+    pthread_create(&threads[WRITERS + i], NULL, reader, (void *)(long)(WRITERS + i));
+  }
+  for (i = 0; i < WRITERS + READERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  check_files();
+  mksfs(0);
+  check_files();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,183 @@
+/* sfs_test7.c
+ *
+ * Inline data test: files up to INODE_INLINE_BYTES keep their bytes in the
+ * i-node and use no data block, so the disk holds as much as a fresh one.
+ * The test grows files past the i-node a byte at a time and by large
+ * writes, shrinks them with sfs_ftruncate, extends them with zeros from
+ * inside and outside the i-node, and empties them back to inline data,
+ * checking the contents after every step and again after a remount.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs_test_helpers.h"
+
+#define BLOCK DISK_BLOCK_SIZE
+#define INLINE INODE_INLINE_BYTES
+#define NFILES 20
+#define PIECE 7 /* the inline bytes are written a few at a time */
+#define LARGE (3 * BLOCK + 11)
+#define SHORT 30
+#define EXTENDED (2 * BLOCK + 5)
+
+static int error_count = 0;
+static char buf[LARGE];
+
+/* file_byte() - the byte a file holds at the given offset, unless it was
+ * zeroed.
+ */
+static char file_byte(int file, int offset)
+{
+  return 'a' + (file * 3 + offset) % 26;
+}
+
+/* check_file() - the file holds file_byte() up to data, then zeros up
+ * to size.
+ */
+static void check_file(int file, int data, int size, const char *step)
+{
+  char name[MAX_FILENAME_LENGTH];
+  int fd, i;
+
+  sprintf(name, "f%d", file);
+  if (sfs_getfilesize(name) != size) {
+    fprintf(stderr, "ERROR: %s: f%d holds %d bytes instead of %d\n", step, file, sfs_getfilesize(name), size);
+    error_count++;
+    return;
+  }
+  fd = sfs_open(name, OpenRead);
+  memset(buf, '?', size);
+  if (sfs_pread(fd, buf, size, 0) != size) {
+    fprintf(stderr, "ERROR: %s: f%d does not read back\n", step, file);
+    error_count++;
+  }
+  for (i = 0; i < size; i++) {
+    if (buf[i] != (i < data ? file_byte(file, i) : 0)) {
+      fprintf(stderr, "ERROR: %s: f%d holds a wrong byte at %d\n", step, file, i);
+      error_count++;
+      break;
+    }
+  }
+  sfs_fclose(fd);
+}
+
+/* check_files() - checks every file, and the free space left: the
+ * whole disk when the files are inline, less than that by at least
+ * blocks per file otherwise.
+ */
+static void check_files(int data, int size, long capacity, int blocks, const char *step)
+{
+  long free_bytes;
+  int file;
+
+  for (file = 0; file < NFILES; file++) {
+    check_file(file, data, size, step);
+  }
+  free_bytes = fill_disk();
+  if (blocks == 0 && free_bytes != capacity) {
+    fprintf(stderr, "ERROR: %s: %ld bytes free instead of %ld, the files use data blocks\n", step, free_bytes, capacity);
+    error_count++;
+  }
+  if (blocks > 0 && free_bytes > capacity - (long)NFILES * blocks * BLOCK) {
+    fprintf(stderr, "ERROR: %s: %ld bytes free, the files use fewer than %d blocks each\n", step, free_bytes, blocks);
+    error_count++;
+  }
+}
+
+/* write_files() - writes file_byte() from offset up to end in every file,
+ * piece bytes per call.
+ */
+static void write_files(int offset, int end, int piece)
+{
+  char name[MAX_FILENAME_LENGTH];
+  int file, fd, i, j, count;
+
+  for (file = 0; file < NFILES; file++) {
+    sprintf(name, "f%d", file);
+    fd = sfs_open(name, OpenWrite | OpenCreate);
+    for (i = offset; i < end; i += count) {
+      count = end - i < piece ? end - i : piece;
+      for (j = 0; j < count; j++) {
+        buf[j] = file_byte(file, i + j);
+      }
+      if (sfs_pwrite(fd, buf, count, i) != count) {
+        fprintf(stderr, "ERROR: write of f%d at %d failed\n", file, i);
+        error_count++;
+      }
+    }
+    sfs_fclose(fd);
+  }
+}
+
+/* truncate_files() - sets the size of every file.
+ */
+static void truncate_files(int length)
+{
+  char name[MAX_FILENAME_LENGTH];
+  int file, fd;
+
+  for (file = 0; file < NFILES; file++) {
+    sprintf(name, "f%d", file);
+    fd = sfs_open(name, OpenWrite);
+    if (sfs_ftruncate(fd, length) != 0) {
+      fprintf(stderr, "ERROR: truncate of f%d to %d failed\n", file, length);
+      error_count++;
+    }
+    sfs_fclose(fd);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  long capacity;
+
+  mksfs(1);
+  capacity = fill_disk();
+
+  /* A few bytes at a time, up to the last byte the i-node holds.
+   */
+  write_files(0, INLINE, PIECE);
+  check_files(INLINE, INLINE, capacity, 0, "filled inline");
+
+  /* One more byte moves the file to a data block.
+   */
+  write_files(INLINE, INLINE + 1, 1);
+  check_files(INLINE + 1, INLINE + 1, capacity, 1, "spilled by a byte");
+
+  /* Emptied, a file is inline again; growing it past the i-node with
+   * zeros spills it too.
+   */
+  truncate_files(0);
+  check_files(0, 0, capacity, 0, "emptied");
+  write_files(0, SHORT, PIECE);
+  truncate_files(INLINE);
+  check_files(SHORT, INLINE, capacity, 0, "extended inline");
+  truncate_files(EXTENDED);
+  check_files(SHORT, EXTENDED, capacity, 3, "extended past the i-node");
+
+  /* A single large write spills a file; shrinking it keeps only the
+   * blocks up to the new end, and growing it again gives zeros.
+   */
+  truncate_files(0);
+  write_files(0, LARGE, LARGE);
+  check_files(LARGE, LARGE, capacity, 4, "spilled by a large write");
+  truncate_files(SHORT);
+  check_files(SHORT, SHORT, capacity, 1, "shrunk");
+  truncate_files(EXTENDED);
+  check_files(SHORT, EXTENDED, capacity, 3, "extended");
+
+  /* All of it is still there after a remount.
+   */
+  mksfs(0);
+  check_files(SHORT, EXTENDED, capacity, 3, "extended, after a remount");
+  truncate_files(0);
+  write_files(0, SHORT, PIECE);
+  mksfs(0);
+  check_files(SHORT, SHORT, capacity, 0, "inline, after a remount");
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
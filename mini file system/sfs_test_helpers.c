@@ -0,0 +1,27 @@
+/* sfs_test_helpers.c
+ *
+ * Fixtures shared by the test programs.
+ */
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs_test_helpers.h"
+
+long fill_disk()
+{
+  char buf[DISK_BLOCK_SIZE];
+  long written = 0;
+  int fd = sfs_fopen("fill");
+
+  while (1) {
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, &written, sizeof(written));
+    if (sfs_fwrite(fd, buf, DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE) {
+      break;
+    }
+    written += DISK_BLOCK_SIZE;
+  }
+  sfs_fclose(fd);
+  sfs_remove("fill");
+  return written;
+}
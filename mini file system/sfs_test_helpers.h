@@ -0,0 +1,14 @@
+/* sfs_test_helpers.h
+ *
+ * Fixtures shared by the test programs.
+ */
+#ifndef SFS_TEST_HELPERS_H
+#define SFS_TEST_HELPERS_H
+
+/* fill_disk() - writes distinct blocks to a file until the disk is full,
+ * removes the file again and returns how many bytes fit. No two blocks
+ * are alike, so the count is the same whether blocks are shared or not.
+ */
+long fill_disk();
+
+#endif
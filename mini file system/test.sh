@@ -3,4 +3,4 @@ make clean
 make
 ./sfs
 make clean
-rm disko
\ No newline at end of file
+rm -f disko disko.sum
\ No newline at end of file